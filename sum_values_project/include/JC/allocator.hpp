@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// return smallest x >= size that is a multiple of the divisor
+inline size_t closestMultiple(size_t size, size_t divisor)
+{
+    size_t remainder = size % divisor;
+    return remainder == 0 ? size : size - remainder + divisor;
+}
+
+namespace jc {
+
+const size_t CACHE_LINE_SIZE = 64;
+const size_t HOST_PAGE_SIZE = 4096;
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// process-wide allocation counters, updated by every jc::Allocator
+struct AllocationStats {
+    std::atomic<size_t> allocations;
+    std::atomic<size_t> deallocations;
+    std::atomic<size_t> bytesInUse;
+    std::atomic<size_t> peakBytes;
+    std::atomic<size_t> hugePageBytes;  // bytes advised to use transparent huge pages
+};
+
+inline AllocationStats& allocationStats()
+{
+    static AllocationStats stats = {};
+    return stats;
+}
+
+// called after every allocation (allocated == true) and before every
+// deallocation, e.g. to log or to attribute memory to a phase
+typedef void (*AllocationHook)(void *ptr, size_t bytes, bool allocated);
+
+inline std::atomic<AllocationHook>& allocationHook()
+{
+    static std::atomic<AllocationHook> hook(nullptr);
+    return hook;
+}
+
+inline void setAllocationHook(AllocationHook hook)
+{
+    allocationHook().store(hook);
+}
+
+// Memory policy used by jc::Data and jc::Matrix. Implementations must return
+// memory aligned to alignment() and sized to at least the requested bytes.
+class Allocator {
+public:
+    virtual ~Allocator() {}
+    virtual void *allocate(size_t bytes) = 0;
+    virtual void deallocate(void *ptr, size_t bytes) = 0;
+    virtual size_t alignment() const = 0;
+
+    // number of elements to allocate for n elements of elementSize bytes so
+    // that the buffer ends on an alignment boundary; code working in SIMD
+    // vectors or full work-groups can then run over the padding instead of
+    // handling a scalar tail
+    size_t paddedCount(size_t n, size_t elementSize) const
+    {
+        return closestMultiple(n * elementSize, alignment()) / elementSize;
+    }
+
+protected:
+    static void recordAllocation(void *ptr, size_t bytes)
+    {
+        AllocationStats &s = allocationStats();
+        s.allocations++;
+        size_t inUse = s.bytesInUse += bytes;
+        size_t peak = s.peakBytes.load();
+        while (inUse > peak && !s.peakBytes.compare_exchange_weak(peak, inUse)) {}
+        AllocationHook hook = allocationHook().load();
+        if (hook) hook(ptr, bytes, true);
+    }
+
+    static void recordDeallocation(void *ptr, size_t bytes)
+    {
+        AllocationHook hook = allocationHook().load();
+        if (hook) hook(ptr, bytes, false);
+        AllocationStats &s = allocationStats();
+        s.deallocations++;
+        s.bytesInUse -= bytes;
+    }
+};
+
+// plain malloc/free, what Data used before
+class MallocAllocator : public Allocator {
+public:
+    void *allocate(size_t bytes)
+    {
+        void *ptr = malloc(bytes == 0 ? 1 : bytes);
+        if (!ptr) {
+            std::ostringstream oss;
+            oss << "malloc failed to allocate " << bytes << " bytes";
+            throw std::runtime_error(oss.str());
+        }
+        recordAllocation(ptr, bytes);
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t bytes)
+    {
+        if (!ptr) return;
+        recordDeallocation(ptr, bytes);
+        free(ptr);
+    }
+
+    size_t alignment() const { return alignof(std::max_align_t); }
+};
+
+// Memory aligned to a power of two. With hugePages set, blocks of at least
+// HUGE_PAGE_SIZE are aligned to it and advised to the kernel as candidates
+// for transparent huge pages (Linux only; elsewhere the flag is ignored).
+class AlignedAllocator : public Allocator {
+public:
+    explicit AlignedAllocator(size_t alignment, bool hugePages = false)
+        : alignment_(alignment), hugePages_(hugePages)
+    {
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+            throw std::invalid_argument("jc::AlignedAllocator: alignment must be a power of two");
+        }
+    }
+
+    void *allocate(size_t bytes)
+    {
+        bool huge = hugePages_ && bytes >= HUGE_PAGE_SIZE;
+        size_t align = huge && alignment_ < HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : alignment_;
+        size_t size = closestMultiple(bytes == 0 ? 1 : bytes, align);
+        void *ptr = nullptr;
+#ifdef _WIN32
+        ptr = _aligned_malloc(size, align);
+#else
+        if (align < sizeof(void*)) align = sizeof(void*);
+        if (posix_memalign(&ptr, align, size) != 0) ptr = nullptr;
+#endif
+        if (!ptr) {
+            std::ostringstream oss;
+            oss << "failed to allocate " << bytes << " bytes aligned to " << align;
+            throw std::runtime_error(oss.str());
+        }
+#if defined(MADV_HUGEPAGE)
+        if (huge && madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+            allocationStats().hugePageBytes += size;
+        }
+#endif
+        recordAllocation(ptr, bytes);
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t bytes)
+    {
+        if (!ptr) return;
+        recordDeallocation(ptr, bytes);
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    size_t alignment() const { return alignment_; }
+
+private:
+    size_t alignment_;
+    bool hugePages_;
+};
+
+// 64-byte alignment: every aligned SIMD load up to AVX-512 is legal
+inline Allocator& cacheLineAllocator()
+{
+    static AlignedAllocator allocator(CACHE_LINE_SIZE);
+    return allocator;
+}
+
+// page alignment: lets OpenCL use the memory in place with CL_MEM_USE_HOST_PTR
+inline Allocator& pageAllocator()
+{
+    static AlignedAllocator allocator(HOST_PAGE_SIZE);
+    return allocator;
+}
+
+// page alignment plus transparent huge pages for large buffers
+inline Allocator& hugePageAllocator()
+{
+    static AlignedAllocator allocator(HOST_PAGE_SIZE, true);
+    return allocator;
+}
+
+inline std::atomic<Allocator*>& defaultAllocatorSlot()
+{
+    static std::atomic<Allocator*> slot(&cacheLineAllocator());
+    return slot;
+}
+
+// the allocator used when none is passed explicitly
+inline Allocator& defaultAllocator()
+{
+    return *defaultAllocatorSlot().load();
+}
+
+// the allocator must outlive every object created with it
+inline void setDefaultAllocator(Allocator &allocator)
+{
+    defaultAllocatorSlot().store(&allocator);
+}
+
+}
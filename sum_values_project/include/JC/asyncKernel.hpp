@@ -0,0 +1,381 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/trace.hpp>
+
+// Asynchronous counterparts of jc::runAndTimeKernel. A launch returns a
+// jc::DeviceFuture at once; the future becomes ready from the event's
+// completion callback (clSetEventCallback) and then carries the result and
+// the profiling times, so the host thread can prepare the next batch while
+// the device works:
+//
+//     jc::DeviceFuture<cl_ulong> run = jc::runKernelAsync(kernel, queue, global, local);
+//     prepareNextBatch();
+//     cl_ulong ns = run.get();
+//
+//     jc::readBufferAsync<float>(queue, out, n)
+//         .then([](const std::vector<float> &v) { return sum(v); });
+//
+// Continuations run on the thread that completes the future, usually the
+// OpenCL runtime's callback thread: keep them short and do not make blocking
+// OpenCL calls (waits, blocking reads, finish) from them. Enqueuing is fine,
+// and a continuation returning a DeviceFuture is flattened into the one
+// then() returns. For profiling times the queue needs
+// CL_QUEUE_PROFILING_ENABLE, otherwise they are 0.
+
+namespace jc {
+
+// profiling times of a command in nanoseconds on the device clock
+struct KernelTiming {
+    cl_ulong queued, submit, start, end;
+
+    cl_ulong nanoseconds() const
+    {
+        return end > start ? end - start : 0;
+    }
+};
+
+template <typename T> class DeviceFuture;
+
+namespace async_detail {
+
+template <typename T>
+struct State {
+    State() : ready(false)
+    {
+        timing = KernelTiming();
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool ready;
+    T value;
+    std::exception_ptr error;
+    KernelTiming timing;
+    std::vector<std::function<void()> > continuations;
+    cl::Event event;
+    std::function<T()> result;  // makes the value once the command has finished
+
+    // runs fn once the state is ready, right away if it is already
+    void onReady(const std::function<void()> &fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ready) {
+                continuations.push_back(fn);
+                return;
+            }
+        }
+        fn();
+    }
+
+    void finish(const std::function<void(State&)> &set)
+    {
+        std::vector<std::function<void()> > pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            set(*this);
+            ready = true;
+            pending.swap(continuations);
+        }
+        cond.notify_all();
+        for (size_t i = 0; i < pending.size(); ++i) {
+            pending[i]();
+        }
+    }
+
+    void complete(const T &v, const KernelTiming &t)
+    {
+        finish([&](State &s) { s.value = v; s.timing = t; });
+    }
+
+    void fail(std::exception_ptr e)
+    {
+        finish([&](State &s) { s.error = e; });
+    }
+};
+
+inline KernelTiming timingOf(const cl::Event &event)
+{
+    KernelTiming t = KernelTiming();
+    try {
+        t.queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        t.submit = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        t.start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        t.end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    }
+    catch (cl::Error&) {
+        // CL_PROFILING_INFO_NOT_AVAILABLE: the queue does not profile
+        t = KernelTiming();
+    }
+    return t;
+}
+
+// what then() returns for a continuation returning R: DeviceFuture<R>, or
+// R itself when R is a future already
+template <typename R> struct Flatten {
+    typedef DeviceFuture<R> type;
+};
+template <typename U> struct Flatten<DeviceFuture<U> > {
+    typedef DeviceFuture<U> type;
+};
+
+}
+
+template <typename T>
+class DeviceFuture {
+public:
+    typedef T value_type;
+
+    DeviceFuture() {}
+
+    // a future completed by event, with the value produced by result once the
+    // command has finished (called on the callback thread)
+    DeviceFuture(const cl::Event &event, const std::function<T()> &result)
+        : state_(std::make_shared<async_detail::State<T> >())
+    {
+        state_->event = event;
+        state_->result = result;
+        // the callback can fire before setCallback returns, so everything it
+        // uses is in place beforehand
+        std::shared_ptr<async_detail::State<T> > *owner = new std::shared_ptr<async_detail::State<T> >(state_);
+        try {
+            cl::Event e = event;
+            e.setCallback(CL_COMPLETE, &DeviceFuture::callback, owner);
+        }
+        catch (...) {
+            delete owner;
+            throw;
+        }
+    }
+
+    bool valid() const
+    {
+        return state_ != nullptr;
+    }
+
+    bool ready() const
+    {
+        std::lock_guard<std::mutex> lock(state_->mutex);
+        return state_->ready;
+    }
+
+    void wait() const
+    {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->cond.wait(lock, [this] { return state_->ready; });
+    }
+
+    // waits, then returns the result or rethrows the error
+    const T &get() const
+    {
+        wait();
+        if (state_->error) {
+            std::rethrow_exception(state_->error);
+        }
+        return state_->value;
+    }
+
+    // waits, then returns the profiling times of the command
+    KernelTiming timing() const
+    {
+        wait();
+        return state_->timing;
+    }
+
+    // event of the command, for wait lists of later commands
+    const cl::Event &event() const
+    {
+        return state_->event;
+    }
+
+    // Calls f(result) once this future is ready and returns a future of what
+    // f returns. An error skips f and is passed on.
+    template <typename F>
+    auto then(F f) const -> typename async_detail::Flatten<decltype(f(std::declval<const T&>()))>::type
+    {
+        typedef decltype(f(std::declval<const T&>())) R;
+        return chain<R>(f, std::integral_constant<bool, IsFuture<R>::value>());
+    }
+
+private:
+    template <typename U> friend class DeviceFuture;
+    template <typename U> friend DeviceFuture<std::vector<U> > when_all(const std::vector<DeviceFuture<U> > &);
+    template <typename U> friend DeviceFuture<U> makeReadyFuture(const U &, const KernelTiming &);
+
+    template <typename R> struct IsFuture : std::false_type {};
+    template <typename U> struct IsFuture<DeviceFuture<U> > : std::true_type {};
+
+    explicit DeviceFuture(const std::shared_ptr<async_detail::State<T> > &state)
+        : state_(state)
+    {
+    }
+
+    static void CL_CALLBACK callback(cl_event, cl_int status, void *data)
+    {
+        std::shared_ptr<async_detail::State<T> > *owner = static_cast<std::shared_ptr<async_detail::State<T> >*>(data);
+        std::shared_ptr<async_detail::State<T> > state = *owner;
+        delete owner;
+        if (status < 0) {
+            state->fail(std::make_exception_ptr(cl::Error(status, "jc::DeviceFuture: the command failed")));
+            return;
+        }
+        T value;
+        try {
+            value = state->result();
+        }
+        catch (...) {
+            state->fail(std::current_exception());
+            return;
+        }
+        state->complete(value, async_detail::timingOf(state->event));
+    }
+
+    // f returns a value
+    template <typename R, typename F>
+    DeviceFuture<R> chain(F f, std::false_type) const
+    {
+        std::shared_ptr<async_detail::State<T> > src = state_;
+        std::shared_ptr<async_detail::State<R> > dst = std::make_shared<async_detail::State<R> >();
+        dst->event = src->event;
+        src->onReady([src, dst, f]() {
+            if (src->error) {
+                dst->fail(src->error);
+                return;
+            }
+            try {
+                dst->complete(f(src->value), src->timing);
+            }
+            catch (...) {
+                dst->fail(std::current_exception());
+            }
+        });
+        return DeviceFuture<R>(dst);
+    }
+
+    // f returns a future: the result is ready when that one is
+    template <typename R, typename F>
+    R chain(F f, std::true_type) const
+    {
+        typedef typename R::value_type U;
+        std::shared_ptr<async_detail::State<T> > src = state_;
+        std::shared_ptr<async_detail::State<U> > dst = std::make_shared<async_detail::State<U> >();
+        dst->event = src->event;
+        src->onReady([src, dst, f]() {
+            if (src->error) {
+                dst->fail(src->error);
+                return;
+            }
+            try {
+                R inner = f(src->value);
+                std::shared_ptr<async_detail::State<U> > in = inner.state_;
+                in->onReady([in, dst]() {
+                    if (in->error) dst->fail(in->error);
+                    else dst->complete(in->value, in->timing);
+                });
+            }
+            catch (...) {
+                dst->fail(std::current_exception());
+            }
+        });
+        return R(dst);
+    }
+
+    std::shared_ptr<async_detail::State<T> > state_;
+};
+
+// a future that is ready already
+template <typename T>
+DeviceFuture<T> makeReadyFuture(const T &value, const KernelTiming &timing = KernelTiming())
+{
+    std::shared_ptr<async_detail::State<T> > state = std::make_shared<async_detail::State<T> >();
+    state->complete(value, timing);
+    return DeviceFuture<T>(state);
+}
+
+// Ready when all of futures are, with their results in order. The timing
+// spans from the earliest start to the latest end. The first error is
+// passed on.
+template <typename T>
+DeviceFuture<std::vector<T> > when_all(const std::vector<DeviceFuture<T> > &futures)
+{
+    typedef async_detail::State<std::vector<T> > Out;
+    std::shared_ptr<Out> out = std::make_shared<Out>();
+    if (futures.empty()) {
+        out->complete(std::vector<T>(), KernelTiming());
+        return DeviceFuture<std::vector<T> >(out);
+    }
+    std::shared_ptr<std::atomic<size_t> > left = std::make_shared<std::atomic<size_t> >(futures.size());
+    std::vector<std::shared_ptr<async_detail::State<T> > > states;
+    for (size_t i = 0; i < futures.size(); ++i) {
+        states.push_back(futures[i].state_);
+    }
+    for (size_t i = 0; i < states.size(); ++i) {
+        states[i]->onReady([states, out, left]() {
+            if (--*left != 0) {
+                return;
+            }
+            std::vector<T> values;
+            KernelTiming span = KernelTiming();
+            span.queued = span.submit = span.start = ~(cl_ulong)0;
+            for (size_t k = 0; k < states.size(); ++k) {
+                if (states[k]->error) {
+                    out->fail(states[k]->error);
+                    return;
+                }
+                values.push_back(states[k]->value);
+                const KernelTiming &t = states[k]->timing;
+                span.queued = std::min(span.queued, t.queued);
+                span.submit = std::min(span.submit, t.submit);
+                span.start = std::min(span.start, t.start);
+                span.end = std::max(span.end, t.end);
+            }
+            out->complete(values, span);
+        });
+    }
+    return DeviceFuture<std::vector<T> >(out);
+}
+
+// Enqueues kernel and returns at once; the result is the run time in
+// nanoseconds, as jc::runAndTimeKernel returns.
+inline DeviceFuture<cl_ulong> runKernelAsync(const cl::Kernel &kernel, const cl::CommandQueue &queue,
+                                             const cl::NDRange &global, const cl::NDRange &local = cl::NullRange,
+                                             const std::vector<cl::Event> *waitFor = NULL)
+{
+    cl::Event event;
+    uint64_t enqueued = defaultTracer().now();
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, waitFor, &event);
+    defaultTracer().kernel(queue, kernel, event, enqueued);
+    queue.flush();
+    std::shared_ptr<cl::Event> e = std::make_shared<cl::Event>(event);
+    return DeviceFuture<cl_ulong>(event, [e]() { return async_detail::timingOf(*e).nanoseconds(); });
+}
+
+// reads n elements of buffer from offset (in elements) without blocking; the result is the data
+template <typename T>
+DeviceFuture<std::vector<T> > readBufferAsync(const cl::CommandQueue &queue, const cl::Buffer &buffer, size_t n,
+                                             size_t offset = 0, const std::vector<cl::Event> *waitFor = NULL)
+{
+    std::shared_ptr<std::vector<T> > data = std::make_shared<std::vector<T> >(n);
+    cl::Event event;
+    uint64_t enqueued = defaultTracer().now();
+    queue.enqueueReadBuffer(buffer, CL_FALSE, offset * sizeof(T), n * sizeof(T), data->data(), waitFor, &event);
+    defaultTracer().command(queue, "read", "transfer", event, enqueued, n * sizeof(T));
+    queue.flush();
+    return DeviceFuture<std::vector<T> >(event, [data]() { return std::move(*data); });
+}
+
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/instrument.hpp>
+
+// Recycles device buffers instead of creating and releasing one per use.
+// Requests are rounded up to a power-of-two size class. Classes up to a
+// quarter of a slab are carved as sub-buffers out of large slabs (one
+// clCreateBuffer for many buffers), bigger ones get a buffer of their own.
+// A released buffer goes to the free list of its context, access flags and
+// class, and the next request of that kind takes it from there:
+//
+//     jc::PooledBuffer out = jc::defaultBufferPool().acquire(context, bytes, CL_MEM_WRITE_ONLY);
+//     kernel.setArg<cl::Buffer>(0, out);
+//     // back in the pool when out goes out of scope
+//
+// Pooled buffers are not cleared. Only the access flags (CL_MEM_READ_WRITE,
+// CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY) are supported, host pointer flags are
+// not. The pool is thread-safe and must outlive its buffers. Release a
+// buffer only once the commands using it have completed, or when all its
+// users share one in-order queue.
+
+namespace jc {
+
+struct BufferPoolStats {
+    size_t acquires;
+    size_t hits;                // acquires served from a free list
+    size_t driverAllocations;   // slabs and dedicated buffers created
+    size_t bytesInUse;          // in size classes, handed out and not released
+    size_t highWater;           // largest bytesInUse so far
+    size_t bytesReserved;       // device memory held by the pool
+
+    double hitRate() const
+    {
+        return acquires ? (double)hits / acquires : 0;
+    }
+};
+
+class BufferPool;
+
+// a buffer of the pool, returned to it on destruction
+class PooledBuffer {
+public:
+    PooledBuffer()
+        : pool_(NULL), context_(NULL), bytes_(0), sizeClass_(0), flags_(0)
+    {
+    }
+
+    PooledBuffer(PooledBuffer &&other)
+        : pool_(NULL)
+    {
+        *this = std::move(other);
+    }
+
+    PooledBuffer& operator=(PooledBuffer &&other)
+    {
+        if (this != &other) {
+            release();
+            pool_ = other.pool_;
+            context_ = other.context_;
+            buffer_ = other.buffer_;
+            bytes_ = other.bytes_;
+            sizeClass_ = other.sizeClass_;
+            flags_ = other.flags_;
+            other.pool_ = NULL;
+            other.buffer_ = cl::Buffer();
+        }
+        return *this;
+    }
+
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer& operator=(const PooledBuffer &) = delete;
+
+    ~PooledBuffer()
+    {
+        release();
+    }
+
+    const cl::Buffer &buffer() const
+    {
+        return buffer_;
+    }
+
+    operator const cl::Buffer&() const
+    {
+        return buffer_;
+    }
+
+    // bytes requested
+    size_t size() const
+    {
+        return bytes_;
+    }
+
+    // bytes usable, the size class
+    size_t capacity() const
+    {
+        return sizeClass_;
+    }
+
+    // gives the buffer back to the pool before destruction
+    void release();
+
+private:
+    friend class BufferPool;
+
+    BufferPool *pool_;
+    cl_context context_;
+    cl::Buffer buffer_;
+    size_t bytes_;
+    size_t sizeClass_;
+    cl_mem_flags flags_;
+};
+
+class BufferPool {
+public:
+    // slabSize: bytes of the slabs sub-buffers are carved from, a power of two
+    explicit BufferPool(size_t slabSize = 64 << 20)
+        : slabSize_(slabSize)
+    {
+        if (slabSize_ & (slabSize_ - 1)) {
+            throw std::invalid_argument("jc::BufferPool: the slab size must be a power of two");
+        }
+        stats_ = BufferPoolStats();
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool& operator=(const BufferPool &) = delete;
+
+    PooledBuffer acquire(const cl::Context &context, size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE)
+    {
+        if (flags & ~(cl_mem_flags)(CL_MEM_READ_WRITE | CL_MEM_READ_ONLY | CL_MEM_WRITE_ONLY)) {
+            throw std::invalid_argument("jc::BufferPool: only access flags are supported");
+        }
+        JC_TIMED_SCOPE("BufferPool::acquire");
+        JC_COUNT("BufferPool::acquire bytes", bytes);
+        std::lock_guard<std::mutex> lock(mutex_);
+        ContextPool &pool = contextPool(context);
+        size_t sizeClass = std::max<size_t>(pool.minClass, 1);
+        while (sizeClass < bytes) sizeClass <<= 1;
+
+        PooledBuffer result;
+        result.pool_ = this;
+        result.context_ = context();
+        result.bytes_ = bytes;
+        result.sizeClass_ = sizeClass;
+        result.flags_ = flags;
+
+        ++stats_.acquires;
+        std::vector<cl::Buffer> &free = pool.free[std::make_pair(flags, sizeClass)];
+        if (!free.empty()) {
+            ++stats_.hits;
+            result.buffer_ = free.back();
+            free.pop_back();
+        }
+        else if (sizeClass <= slabSize_ / 4) {
+            result.buffer_ = carve(context, pool, sizeClass, flags);
+        }
+        else {
+            result.buffer_ = cl::Buffer(context, flags, sizeClass);
+            ++stats_.driverAllocations;
+            stats_.bytesReserved += sizeClass;
+        }
+        stats_.bytesInUse += sizeClass;
+        stats_.highWater = std::max(stats_.highWater, stats_.bytesInUse);
+        return result;
+    }
+
+    BufferPoolStats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    // Drops the free lists and the slabs. Device memory comes back once the
+    // buffers still in use are released too.
+    void trim()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        contexts_.clear();
+        stats_.bytesReserved = 0;
+    }
+
+private:
+    friend class PooledBuffer;
+
+    struct ContextPool {
+        cl::Context context;            // held, so that its handle is not reused
+        size_t minClass;                // the devices' base address alignment
+        std::vector<cl::Buffer> slabs;
+        size_t used;                    // bytes carved out of slabs.back()
+        std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl::Buffer> > free;
+    };
+
+    ContextPool &contextPool(const cl::Context &context)
+    {
+        auto it = contexts_.find(context());
+        if (it != contexts_.end()) {
+            return it->second;
+        }
+        ContextPool &pool = contexts_[context()];
+        // sub-buffer origins must be aligned for every device of the context
+        size_t align = 1;
+        std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+        for (size_t d = 0; d < devices.size(); ++d) {
+            align = std::max<size_t>(align, devices[d].getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8);
+        }
+        pool.context = context;
+        pool.minClass = align;
+        pool.used = slabSize_;
+        return pool;
+    }
+
+    // a sub-buffer of sizeClass bytes; the classes are powers of two of at
+    // least the alignment, so bumping by sizeClass keeps every origin aligned
+    cl::Buffer carve(const cl::Context &context, ContextPool &pool, size_t sizeClass, cl_mem_flags flags)
+    {
+        size_t origin = (pool.used + sizeClass - 1) / sizeClass * sizeClass;
+        if (origin + sizeClass > slabSize_) {
+            pool.slabs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, slabSize_));
+            ++stats_.driverAllocations;
+            stats_.bytesReserved += slabSize_;
+            origin = 0;
+        }
+        pool.used = origin + sizeClass;
+        cl_buffer_region region = { origin, sizeClass };
+        return pool.slabs.back().createSubBuffer(flags, CL_BUFFER_CREATE_TYPE_REGION, &region);
+    }
+
+    void release(PooledBuffer &buffer)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.bytesInUse -= buffer.sizeClass_;
+        auto it = contexts_.find(buffer.context_);
+        if (it != contexts_.end()) {  // else trimmed meanwhile: let the buffer go
+            it->second.free[std::make_pair(buffer.flags_, buffer.sizeClass_)].push_back(buffer.buffer_);
+        }
+    }
+
+    size_t slabSize_;
+    std::map<cl_context, ContextPool> contexts_;
+    BufferPoolStats stats_;
+    mutable std::mutex mutex_;
+};
+
+inline void PooledBuffer::release()
+{
+    if (pool_) {
+        pool_->release(*this);
+        pool_ = NULL;
+        buffer_ = cl::Buffer();
+    }
+}
+
+// process-wide pool
+inline BufferPool& defaultBufferPool()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+}
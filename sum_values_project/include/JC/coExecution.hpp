@@ -0,0 +1,403 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/bufferPool.hpp>
+#include <JC/kernelFn.hpp>
+#include <JC/threadPool.hpp>
+
+// Runs one index space on the host threads and on an OpenCL device at the
+// same time. The remaining range [begin, end) is a single atomic word: the
+// device takes chunks from the front and the host threads from the back,
+// each with a compare-and-swap, so nobody waits for a lock and whoever is
+// faster simply takes more. Chunks shrink as the range runs out (guided
+// self-scheduling weighted by the measured throughput of both sides), so
+// both finish at about the same time.
+//
+//     jc::CoExecutor executor(queue);
+//     jc::saxpyCoExecute(executor, program, a, x, y, n);
+//     std::cout << executor.report();
+//
+// Every element is processed exactly once by one side. Reductions work on
+// fixed blocks whose results are combined in index order, so their result
+// does not depend on the split (see CoExecutor::reduce). An exception thrown
+// by either side stops both and is rethrown by the call that started them.
+
+namespace jc {
+
+enum CoExecutionMode { CO_EXECUTE, HOST_ONLY, DEVICE_ONLY };
+
+struct CoExecutionReport {
+    size_t n;
+    size_t hostElements, deviceElements;
+    size_t hostChunks, deviceChunks;
+    double seconds;
+    // times of the same work on one side alone, 0 until measured (see benchmarkCoExecution)
+    double hostOnlySeconds, deviceOnlySeconds;
+
+    double deviceShare() const
+    {
+        return n ? (double)deviceElements / n : 0;
+    }
+    double speedupOverHost() const
+    {
+        return seconds > 0 ? hostOnlySeconds / seconds : 0;
+    }
+    double speedupOverDevice() const
+    {
+        return seconds > 0 ? deviceOnlySeconds / seconds : 0;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream &os, const CoExecutionReport &r)
+{
+    os << std::fixed << std::setprecision(1)
+       << "co-execution of " << r.n << " elements: device " << 100 * r.deviceShare() << "% in "
+       << r.deviceChunks << " chunks, host " << 100 * (1 - r.deviceShare()) << "% in "
+       << r.hostChunks << " chunks, " << std::setprecision(3) << 1e3 * r.seconds << " ms";
+    if (r.hostOnlySeconds > 0) os << ", " << std::setprecision(2) << r.speedupOverHost() << "x over host only";
+    if (r.deviceOnlySeconds > 0) os << ", " << std::setprecision(2) << r.speedupOverDevice() << "x over device only";
+    return os << std::defaultfloat << std::setprecision(6);
+}
+
+namespace coexec_detail {
+
+// [begin, end) in grains, packed into one word so that both ends move with
+// a single compare-and-swap
+class SharedRange {
+public:
+    void reset(uint32_t end)
+    {
+        range_.store(end);
+    }
+
+    // takes up to want grains from the front; false once the range is empty
+    bool takeFront(uint32_t want, uint32_t &begin, uint32_t &end)
+    {
+        uint64_t r = range_.load();
+        for (;;) {
+            uint32_t b = (uint32_t)(r >> 32), e = (uint32_t)r;
+            if (b >= e) return false;
+            uint32_t take = std::min(std::max<uint32_t>(want, 1), e - b);
+            if (range_.compare_exchange_weak(r, ((uint64_t)(b + take) << 32) | e)) {
+                begin = b;
+                end = b + take;
+                return true;
+            }
+        }
+    }
+
+    bool takeBack(uint32_t want, uint32_t &begin, uint32_t &end)
+    {
+        uint64_t r = range_.load();
+        for (;;) {
+            uint32_t b = (uint32_t)(r >> 32), e = (uint32_t)r;
+            if (b >= e) return false;
+            uint32_t take = std::min(std::max<uint32_t>(want, 1), e - b);
+            if (range_.compare_exchange_weak(r, ((uint64_t)b << 32) | (e - take))) {
+                begin = e - take;
+                end = e;
+                return true;
+            }
+        }
+    }
+
+    uint32_t remaining() const
+    {
+        uint64_t r = range_.load();
+        uint32_t b = (uint32_t)(r >> 32), e = (uint32_t)r;
+        return b < e ? e - b : 0;
+    }
+
+private:
+    std::atomic<uint64_t> range_;
+};
+
+// work-group size of blockSumReduce in array_kernels.ocl
+const size_t BLOCK_SUM_LOCAL = 256;
+
+// sum of x[begin, end) in the order blockSumReduce adds them: BLOCK_SUM_LOCAL
+// strided running sums, then a pairwise tree
+inline float blockSum(const float *x, size_t begin, size_t end)
+{
+    float scratch[BLOCK_SUM_LOCAL];
+    for (size_t l = 0; l < BLOCK_SUM_LOCAL; ++l) {
+        float sum = 0.0f;
+        for (size_t i = begin + l; i < end; i += BLOCK_SUM_LOCAL) {
+            sum += x[i];
+        }
+        scratch[l] = sum;
+    }
+    for (size_t s = BLOCK_SUM_LOCAL / 2; s > 0; s >>= 1) {
+        for (size_t l = 0; l < s; ++l) {
+            scratch[l] += scratch[l + s];
+        }
+    }
+    return scratch[0];
+}
+
+inline double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+class CoExecutor {
+public:
+    typedef std::function<void(size_t, size_t)> HostFn;
+    typedef std::function<void(cl::CommandQueue&, size_t, size_t)> DeviceFn;
+
+    // grain: the smallest chunk in elements, and the granularity of all
+    // chunks; maxDeviceChunk: the largest chunk handed to the device in one go
+    explicit CoExecutor(const cl::CommandQueue &queue, ThreadPool &pool = defaultThreadPool(),
+                        size_t grain = 4096, size_t maxDeviceChunk = 1 << 22)
+        : queue_(queue), pool_(pool), grain_(std::max<size_t>(grain, 1)), maxDeviceChunk_(maxDeviceChunk),
+          mode_(CO_EXECUTE)
+    {
+        maxDeviceChunk_ = std::max(maxDeviceChunk_ / grain_ * grain_, grain_);
+        report_ = CoExecutionReport();
+    }
+
+    void setMode(CoExecutionMode mode)
+    {
+        mode_ = mode;
+    }
+
+    size_t maxDeviceChunk() const
+    {
+        return maxDeviceChunk_;
+    }
+
+    const CoExecutionReport& report() const
+    {
+        return report_;
+    }
+
+    CoExecutionReport& report()
+    {
+        return report_;
+    }
+
+    // Runs host(begin, end) on the host threads and device(queue, begin, end)
+    // on the device over [0, n). device must have finished with the chunk when
+    // it returns (end with a blocking read or queue.finish()); its chunks are
+    // at most maxDeviceChunk() elements.
+    void forEach(size_t n, const HostFn &host, const DeviceFn &device)
+    {
+        run(n, host, device);
+    }
+
+    // elements per block of a reduction over n elements; chunks start on a
+    // block boundary
+    size_t blockSize(size_t n) const
+    {
+        // keep the count of grains within 32 bits
+        return std::max(grain_, (n + 0xFFFFFFFEu) / 0xFFFFFFFFu);
+    }
+
+    // host(begin, end, out) and device(queue, begin, end, out) write the
+    // reduction of each block of blockSize(n) elements of their chunk to
+    // out[0], out[1], ... The block results are combined with combine in
+    // index order, starting from init. When both sides reduce a block the
+    // same way the result is the same whichever side took which chunk, and
+    // equals that of a host-only or device-only run.
+    template <typename T, typename Combine>
+    T reduce(size_t n, const std::function<void(size_t, size_t, T*)> &host,
+             const std::function<void(cl::CommandQueue&, size_t, size_t, T*)> &device, T init, Combine combine)
+    {
+        size_t block = blockSize(n);
+        std::vector<T> blocks((n + block - 1) / block);
+        run(n,
+            [&](size_t b, size_t e) { host(b, e, &blocks[b / block]); },
+            [&](cl::CommandQueue &q, size_t b, size_t e) { device(q, b, e, &blocks[b / block]); });
+
+        T result = init;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            result = combine(result, blocks[i]);
+        }
+        return result;
+    }
+
+private:
+    void run(size_t n, const HostFn &host, const DeviceFn &device)
+    {
+        report_.n = n;
+        report_.hostElements = report_.deviceElements = 0;
+        report_.hostChunks = report_.deviceChunks = 0;
+        report_.seconds = report_.hostOnlySeconds = report_.deviceOnlySeconds = 0;
+        if (n == 0) {
+            return;
+        }
+        size_t grain = blockSize(n);
+        uint32_t grains = (uint32_t)((n + grain - 1) / grain);
+        range_.reset(grains);
+
+        bool useHost = mode_ != DEVICE_ONLY, useDevice = mode_ != HOST_ONLY;
+        size_t hostThreads = useHost ? (useDevice ? std::max<size_t>(pool_.size() - 1, 1) : pool_.size()) : 0;
+        // elements per second of the device and of all host threads together,
+        // from the work done so far; a side that has not finished a chunk yet
+        // is assumed as fast as the other
+        std::atomic<uint64_t> hostDone(0), hostNs(0), deviceDone(0), deviceNs(0);
+        std::atomic<size_t> hostChunks(0), deviceChunks(0);
+        auto deviceShare = [&]() -> double {
+            double d = deviceNs.load() ? (double)deviceDone.load() / deviceNs.load() : 0;
+            double h = hostNs.load() ? hostThreads * (double)hostDone.load() / hostNs.load() : 0;
+            if (!useHost) return 1;
+            if (!useDevice) return 0;
+            if (d == 0 || h == 0) return 0.5;
+            return d / (d + h);
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        auto deviceLoop = [&]() {
+            uint32_t b, e;
+            for (;;) {
+                // half of the device's share of what is left, so that the last
+                // chunks are small
+                double want = 0.5 * deviceShare() * range_.remaining();
+                uint32_t wantGrains = (uint32_t)std::min<double>(want, (double)(maxDeviceChunk_ / grain));
+                if (!range_.takeFront(wantGrains, b, e)) break;
+                size_t first = (size_t)b * grain, last = std::min((size_t)e * grain, n);
+                auto t = std::chrono::steady_clock::now();
+                device(queue_, first, last);
+                deviceNs += (uint64_t)(1e9 * coexec_detail::secondsSince(t)) + 1;
+                deviceDone += last - first;
+                ++deviceChunks;
+            }
+        };
+        auto hostLoop = [&]() {
+            uint32_t b, e;
+            for (;;) {
+                double want = 0.5 * (1 - deviceShare()) * range_.remaining() / hostThreads;
+                if (!range_.takeBack((uint32_t)want, b, e)) break;
+                size_t first = (size_t)b * grain, last = std::min((size_t)e * grain, n);
+                auto t = std::chrono::steady_clock::now();
+                host(first, last);
+                hostNs += (uint64_t)(1e9 * coexec_detail::secondsSince(t)) + 1;
+                hostDone += last - first;
+                ++hostChunks;
+            }
+        };
+
+        // task 0 drives the device, the others run host chunks. A side that
+        // throws empties the range, so that the other stops after its current
+        // chunk, and parallelFor rethrows the exception.
+        size_t tasks = hostThreads + (useDevice ? 1 : 0);
+        pool_.parallelFor(tasks, [&](size_t task) {
+            try {
+                if (useDevice && task == 0) {
+                    deviceLoop();
+                }
+                else {
+                    hostLoop();
+                }
+            }
+            catch (...) {
+                range_.reset(0);
+                throw;
+            }
+        });
+
+        report_.seconds = coexec_detail::secondsSince(start);
+        report_.hostElements = (size_t)hostDone.load();
+        report_.deviceElements = (size_t)deviceDone.load();
+        report_.hostChunks = hostChunks.load();
+        report_.deviceChunks = deviceChunks.load();
+    }
+
+    cl::CommandQueue queue_;
+    ThreadPool &pool_;
+    size_t grain_;
+    size_t maxDeviceChunk_;
+    CoExecutionMode mode_;
+    coexec_detail::SharedRange range_;
+    CoExecutionReport report_;
+};
+
+// Runs job (which must give the same result when repeated) on the host
+// alone, on the device alone and on both, and returns the report of the
+// last run with the times of the first two filled in.
+inline CoExecutionReport benchmarkCoExecution(CoExecutor &executor, const std::function<void()> &job)
+{
+    executor.setMode(HOST_ONLY);
+    job();
+    double hostOnly = executor.report().seconds;
+    executor.setMode(DEVICE_ONLY);
+    job();
+    double deviceOnly = executor.report().seconds;
+    executor.setMode(CO_EXECUTE);
+    job();
+    executor.report().hostOnlySeconds = hostOnly;
+    executor.report().deviceOnlySeconds = deviceOnly;
+    return executor.report();
+}
+
+// y = a * x + y, with saxpy from array_kernels.ocl on the device
+inline void saxpyCoExecute(CoExecutor &executor, const cl::Program &program,
+                           float a, const float *x, float *y, size_t n)
+{
+    cl::Context context = program.getInfo<CL_PROGRAM_CONTEXT>();
+    size_t chunk = std::min(executor.maxDeviceChunk(), n);
+    PooledBuffer xBuffer = defaultBufferPool().acquire(context, std::max<size_t>(chunk, 1) * sizeof(float), CL_MEM_READ_ONLY);
+    PooledBuffer yBuffer = defaultBufferPool().acquire(context, std::max<size_t>(chunk, 1) * sizeof(float), CL_MEM_READ_WRITE);
+    KernelFn<cl::Buffer, cl::Buffer, cl_float, cl_ulong> saxpy(program, "saxpy");
+
+    executor.forEach(n,
+        [&](size_t b, size_t e) {
+            for (size_t i = b; i < e; ++i) {
+                y[i] = a * x[i] + y[i];
+            }
+        },
+        [&](cl::CommandQueue &queue, size_t b, size_t e) {
+            size_t len = e - b;
+            queue.enqueueWriteBuffer(xBuffer, CL_FALSE, 0, len * sizeof(float), x + b);
+            queue.enqueueWriteBuffer(yBuffer, CL_FALSE, 0, len * sizeof(float), y + b);
+            size_t global = (len + 255) / 256 * 256;
+            saxpy(queue, cl::NDRange(global), cl::NDRange(256), xBuffer, yBuffer, a, (cl_ulong)len);
+            queue.enqueueReadBuffer(yBuffer, CL_TRUE, 0, len * sizeof(float), y + b);
+        });
+}
+
+// sum of x, with blockSumReduce from array_kernels.ocl on the device. The
+// host sums each block as the kernel does, so the result is the same in every
+// mode and for every split (barring a device that flushes denormals).
+inline float sumCoExecute(CoExecutor &executor, const cl::Program &program, const float *x, size_t n)
+{
+    const size_t local = coexec_detail::BLOCK_SUM_LOCAL;
+    size_t block = executor.blockSize(n);
+    cl::Context context = program.getInfo<CL_PROGRAM_CONTEXT>();
+    size_t chunk = std::max(std::min(executor.maxDeviceChunk(), n), block);
+    size_t groups = (chunk + block - 1) / block;
+    PooledBuffer xBuffer = defaultBufferPool().acquire(context, chunk * sizeof(float), CL_MEM_READ_ONLY);
+    PooledBuffer partial = defaultBufferPool().acquire(context, groups * sizeof(float), CL_MEM_WRITE_ONLY);
+    KernelFn<cl::Buffer, cl::Buffer, LocalMemory, cl_ulong, cl_ulong> blockSumReduce(program, "blockSumReduce");
+
+    std::function<void(size_t, size_t, float*)> host = [&](size_t b, size_t e, float *out) {
+        for (size_t i = b; i < e; i += block) {
+            *out++ = coexec_detail::blockSum(x, i, std::min(i + block, e));
+        }
+    };
+    std::function<void(cl::CommandQueue&, size_t, size_t, float*)> device =
+        [&](cl::CommandQueue &queue, size_t b, size_t e, float *out) {
+            size_t len = e - b, blocks = (len + block - 1) / block;
+            queue.enqueueWriteBuffer(xBuffer, CL_FALSE, 0, len * sizeof(float), x + b);
+            blockSumReduce(queue, cl::NDRange(blocks * local), cl::NDRange(local), xBuffer, partial,
+                           LocalMemory(local * sizeof(float)), (cl_ulong)block, (cl_ulong)len);
+            queue.enqueueReadBuffer(partial, CL_TRUE, 0, blocks * sizeof(float), out);
+        };
+    return executor.reduce<float>(n, host, device, 0.0f, std::plus<float>());
+}
+
+}
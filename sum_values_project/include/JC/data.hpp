@@ -1,19 +1,36 @@
 #ifndef __JC_DATA_HPP_
 #define __JC_DATA_HPP_
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
-#include <time.h>
 
-#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+#include <JC/allocator.hpp>
+#include <JC/random.hpp>
+#include <JC/verify.hpp>
 
 namespace jc {
 
 template <typename T>
 class Distribution {
 public:
+    virtual ~Distribution() {}
+
     virtual T get_value() = 0;
+
+    // the next n values, same as n calls to get_value(); distributions that
+    // can produce a batch faster override it
+    virtual void fill_n(T *out, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = get_value();
+        }
+    }
 }; 
 
 template <typename T>
@@ -26,48 +43,158 @@ public:
         return value_;
     }
 
+    void fill_n(T *out, size_t n)
+    {
+        std::fill_n(out, n, value_);
+    }
+
 private:
     T value_;
 };
 
-template <typename T>
-class RandomDistribution : public Distribution<T> {
+// Base of the distributions drawing from the Philox stream of a seed
+// (JC/random.hpp). The same seed always gives the same sequence, whether it
+// is consumed by get_value(), by fill_n() or by several threads.
+template <typename T, typename Map>
+class PhiloxDistribution : public Distribution<T> {
 public:
-    RandomDistribution(T value) : max_value_(value) 
-    {   
-        srand ( (unsigned) time(0) );
+    T get_value()
+    {
+        if (cached_ == size_) {
+            size_ = sizeof(cache_) / sizeof(T);
+            random_detail::generate(seed_, position_, size_, cache_, map_);
+            cached_ = 0;
+        }
+        position_++;
+        return cache_[cached_++];
+    }
+
+    void fill_n(T *out, size_t n)
+    {
+        // values already generated for get_value() come first
+        size_t k = std::min(n, size_ - cached_);
+        std::copy(cache_ + cached_, cache_ + cached_ + k, out);
+        cached_ += k;
+        position_ += k;
+        random_detail::generateParallel(seed_, position_, n - k, out + k, map_, defaultThreadPool());
+        position_ += n - k;
+    }
+
+    uint64_t seed() const
+    {
+        return seed_;
     }
 
-	 T get_value()
+    // index of the next value in the stream
+    uint64_t position() const
+    {
+        return position_;
+    }
+
+protected:
+    PhiloxDistribution(const Map &map, uint64_t seed)
+        : map_(map), seed_(seed), position_(0), cached_(0), size_(0)
+    {}
+
+    const Map &map() const
     {
-        float fraction = static_cast<float>(max_value_) / RAND_MAX;
-        return static_cast<T>(rand() * fraction);
+        return map_;
     }
 
 private:
-    T max_value_;
+    Map map_;
+    uint64_t seed_;
+    uint64_t position_;
+    T cache_[64];
+    size_t cached_;
+    size_t size_;
+};
+
+// values uniform in [min, max)
+template <typename T>
+class UniformDistribution : public PhiloxDistribution<T, random_detail::Uniform<T> > {
+public:
+    UniformDistribution(T min, T max, uint64_t seed = DEFAULT_SEED)
+        : PhiloxDistribution<T, random_detail::Uniform<T> >(makeMap(min, max), seed)
+    {}
+
+    T min() const { return this->map().min; }
+    T max() const { return (T)(this->map().min + this->map().range); }
+
+private:
+    static random_detail::Uniform<T> makeMap(T min, T max)
+    {
+        random_detail::Uniform<T> map = { min, (T)(max - min) };
+        return map;
+    }
 };
 
+// normally distributed values (Box-Muller), floating point types only
+template <typename T>
+class NormalDistribution : public PhiloxDistribution<T, random_detail::Normal<T> > {
+    static_assert(std::is_floating_point<T>::value, "normal values must be floating point");
+
+public:
+    NormalDistribution(T mean, T stddev, uint64_t seed = DEFAULT_SEED)
+        : PhiloxDistribution<T, random_detail::Normal<T> >(makeMap(mean, stddev), seed)
+    {}
+
+    T mean() const { return this->map().mean; }
+    T stddev() const { return this->map().stddev; }
+
+private:
+    static random_detail::Normal<T> makeMap(T mean, T stddev)
+    {
+        random_detail::Normal<T> map = { mean, stddev };
+        return map;
+    }
+};
+
+// values uniform in [0, max_value); pass e.g. time(0) as the seed for a
+// different sequence on every run
+template <typename T>
+class RandomDistribution : public UniformDistribution<T> {
+public:
+    RandomDistribution(T max_value, uint64_t seed = DEFAULT_SEED)
+        : UniformDistribution<T>(T(0), max_value, seed)
+    {}
+};
+
+// X x Y x Z elements stored x-fastest. The memory comes from a jc::Allocator
+// (cache-line aligned by default) and is padded to a whole number of
+// alignment units; the padding is zeroed so vector code may read it.
 template <typename T>
 class Data {
+    static_assert(std::is_trivially_copyable<T>::value, "jc::Data holds plain values only");
+
 public: 
-    Data(int X, int Y = 1, int Z = 1) 
-        : X_(X), Y_(Y), Z_(Z)
-    {
-        data_ = static_cast<T*>(malloc(X * Y * Z * sizeof(T)));
-        if (!data_) {
-            std::ostringstream oss;
-            oss << "malloc failed to allocate "
-                << X * Y * Z * sizeof(T) << " bytes";
-            throw std::runtime_error(oss.str());
-        }
+    Data(int X, int Y = 1, int Z = 1, Allocator &allocator = defaultAllocator())
+        : X_(X), Y_(Y), Z_(Z), allocator_(&allocator)
+    {
+        size_t n = (size_t)X * Y * Z;
+        capacity_ = allocator.paddedCount(n, sizeof(T));
+        data_ = static_cast<T*>(allocator.allocate(capacity_ * sizeof(T)));
+        std::fill(data_ + n, data_ + capacity_, T());
     }
 
+    // wraps X x Y x Z elements kept alive by owner (e.g. a mapped file, see
+    // JC/dataset.hpp) without copying them
+    Data(T *data, int X, int Y, int Z, std::shared_ptr<void> owner)
+        : data_(data), X_(X), Y_(Y), Z_(Z), capacity_((size_t)X * Y * Z),
+          allocator_(&defaultAllocator()), owner_(owner)
+    {}
+
     ~Data()
     {
-        free(data_);
+        if (!owner_) {
+            allocator_->deallocate(data_, capacity_ * sizeof(T));
+        }
     }
 
+    // owns its buffer, copying would free it twice
+    Data(const Data &) = delete;
+    Data& operator=(const Data &) = delete;
+
     int X() const
     {
         return X_;
@@ -98,42 +225,50 @@ public:
         return data_;
     }
 
+    const T *data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return (size_t)X_ * Y_ * Z_;
+    }
+
+    // number of elements allocated, size() rounded up to the alignment
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    Allocator &allocator() const
+    {
+        return *allocator_;
+    }
+
+    // whether the elements are borrowed from an owner
+    bool borrowed() const
+    {
+        return owner_ != nullptr;
+    }
+
+    // the elements are contiguous and x-fastest, so one batch fills them in
+    // the order of the former x, y, z loop
     void fill(Distribution<T>& distribution)
     {
-        for (int z = 0; z < Z_; ++z) {
-            for (int y = 0; y < Y_; ++y) {
-                for (int x = 0; x < X_; ++x) {
-                    set(x, y, z, distribution.get_value());
-                }
-            }
-        }
+        distribution.fill_n(data_, size());
     }
 
 	void clear()
     {
-        for (int z = 0; z < Z_; ++z) {
-            for (int y = 0; y < Y_; ++y) {
-                for (int x = 0; x < X_; ++x) {
-                    set(x, y, z, 0);
-                }
-            }
-        }
+        std::fill_n(data_, size(), T(0));
     }
 
-    bool equals(const Data<T>& other) const {
+    bool equals(const Data<T>& other, const Tolerance& tolerance = Tolerance::exact()) const {
         if (X_ != other.X_ || Y_ != other.Y_ || Z_ != other.Z_) {
             return false;
         }
-        for (int z = 0; z < Z_; ++z) {
-            for (int y = 0; y < Y_; ++y) {
-                for (int x = 0; x < X_; ++x) {
-                    if (get(x, y, z) != other.get(x, y, z)) {
-                        return false;
-                    }
-                }
-            }
-        }
-        return true;
+        return verify(data_, other.data_, size(), tolerance, 0).ok();
     }
 
 
@@ -142,6 +277,9 @@ private:
   int X_;
   int Y_;
   int Z_;
+  size_t capacity_;
+  Allocator *allocator_;
+  std::shared_ptr<void> owner_;
 
 };
 
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/data.hpp>
+
+// jc::Data with a device copy that is synchronized lazily. Both sides keep
+// track of which element ranges are stale, and a side is only brought up to
+// date, range by range, when it is accessed:
+//
+//     jc::MirroredData<float> x(n);
+//     x.fill(dist);                                        // host written
+//     kernel.setArg(0, x.device_buffer(queue, jc::READ)); // uploads x
+//     kernel.setArg(1, y.device_buffer(queue, jc::WRITE));// nothing copied
+//     queue.enqueueNDRangeKernel(...);
+//     ... more kernels on y, nothing copied ...
+//     float *r = y.host_view(jc::READ);                   // downloads y once
+//
+// Declaring the access honestly is what saves the transfers: WRITE promises
+// that the whole range will be overwritten, so its stale contents are never
+// copied.
+
+namespace jc {
+
+enum Access {
+    READ = 1,
+    WRITE = 2,
+    READ_WRITE = READ | WRITE
+};
+
+// set of disjoint half-open element ranges [begin, end)
+class DirtyRanges {
+public:
+    typedef std::pair<size_t, size_t> Range;
+
+    bool empty() const
+    {
+        return ranges_.empty();
+    }
+
+    void clear()
+    {
+        ranges_.clear();
+    }
+
+    void add(size_t begin, size_t end)
+    {
+        if (begin >= end) return;
+        // merge with every range that overlaps or touches [begin, end)
+        auto it = ranges_.upper_bound(begin);
+        if (it != ranges_.begin() && std::prev(it)->second >= begin) {
+            --it;
+        }
+        while (it != ranges_.end() && it->first <= end) {
+            begin = std::min(begin, it->first);
+            end = std::max(end, it->second);
+            it = ranges_.erase(it);
+        }
+        ranges_[begin] = end;
+    }
+
+    void remove(size_t begin, size_t end)
+    {
+        if (begin >= end) return;
+        auto it = ranges_.upper_bound(begin);
+        if (it != ranges_.begin()) --it;
+        while (it != ranges_.end() && it->first < end) {
+            Range r = *it;
+            if (r.second <= begin) {
+                ++it;
+                continue;
+            }
+            it = ranges_.erase(it);
+            if (r.first < begin) ranges_[r.first] = begin;
+            if (r.second > end) ranges_[end] = r.second;
+        }
+    }
+
+    // the parts of the set inside [begin, end)
+    std::vector<Range> within(size_t begin, size_t end) const
+    {
+        std::vector<Range> result;
+        auto it = ranges_.upper_bound(begin);
+        if (it != ranges_.begin()) --it;
+        for (; it != ranges_.end() && it->first < end; ++it) {
+            size_t b = std::max(begin, it->first);
+            size_t e = std::min(end, it->second);
+            if (b < e) result.push_back(Range(b, e));
+        }
+        return result;
+    }
+
+private:
+    std::map<size_t, size_t> ranges_;  // begin -> end
+};
+
+// Buffer using the elements of data in place (CL_MEM_USE_HOST_PTR), e.g. a
+// dataset loaded with jc::loadData or Data allocated with jc::pageAllocator();
+// devices sharing host memory then need no copy. data must outlive the buffer.
+template <typename T>
+cl::Buffer hostPtrBuffer(const cl::Context &context, Data<T> &data, cl_mem_flags flags = CL_MEM_READ_ONLY)
+{
+    return cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, data.size() * sizeof(T), data.data());
+}
+
+// transfer counters, to check that a pipeline does not move more than needed
+struct TransferStats {
+    size_t uploads;
+    size_t downloads;
+    size_t bytesUploaded;
+    size_t bytesDownloaded;
+};
+
+// The host storage is the one of jc::Data; raw access to it goes through
+// host_view() so that the dirty state stays correct. The device buffer is
+// created on first use in the context of the queue passed to device_buffer().
+// Downloads are done on the last queue the buffer was requested with, which
+// must therefore see the kernels writing it (an in-order queue does).
+template <typename T>
+class MirroredData : protected Data<T> {
+public:
+    MirroredData(int X, int Y = 1, int Z = 1, Allocator &allocator = defaultAllocator())
+        : Data<T>(X, Y, Z, allocator), stats_()
+    {}
+
+    ~MirroredData()
+    {
+        // pending uploads still read the host memory
+        waitForUploads();
+    }
+
+    using Data<T>::X;
+    using Data<T>::Y;
+    using Data<T>::Z;
+    using Data<T>::size;
+    using Data<T>::capacity;
+    using Data<T>::allocator;
+
+    // Host pointer valid for the elements [offset, offset + count); count == 0
+    // means up to the end. Device results in the range are downloaded first
+    // when reading; writing marks the range stale on the device.
+    T *host_view(Access access = READ_WRITE, size_t offset = 0, size_t count = 0)
+    {
+        size_t end = rangeEnd(offset, count);
+        // the host memory may be read by a pending upload
+        if (access & WRITE) waitForUploads();
+
+        if (access & READ) {
+            std::vector<DirtyRanges::Range> stale = hostStale_.within(offset, end);
+            for (size_t k = 0; k < stale.size(); ++k) {
+                size_t b = stale[k].first, e = stale[k].second;
+                queue_.enqueueReadBuffer(buffer_, CL_TRUE, b * sizeof(T), (e - b) * sizeof(T),
+                                         Data<T>::data() + b);
+                stats_.downloads++;
+                stats_.bytesDownloaded += (e - b) * sizeof(T);
+            }
+        }
+        hostStale_.remove(offset, end);
+        if ((access & WRITE) && buffer_()) {
+            deviceStale_.add(offset, end);
+        }
+        return Data<T>::data();
+    }
+
+    // Device buffer holding capacity() elements, current for the elements
+    // [offset, offset + count) when reading; writing marks the range stale on
+    // the host. Uploads are not blocking, they are ordered before the kernels
+    // enqueued afterwards on the same queue.
+    const cl::Buffer &device_buffer(const cl::CommandQueue &queue, Access access = READ_WRITE,
+                                    size_t offset = 0, size_t count = 0)
+    {
+        size_t end = rangeEnd(offset, count);
+        cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+        if (!buffer_()) {
+            buffer_ = cl::Buffer(context, CL_MEM_READ_WRITE, capacity() * sizeof(T));
+            context_ = context;
+            deviceStale_.add(0, capacity());
+        }
+        else if (context() != context_()) {
+            throw std::runtime_error("jc::MirroredData: device buffer requested in a different context");
+        }
+        queue_ = queue;
+
+        if (access & READ) {
+            std::vector<DirtyRanges::Range> stale = deviceStale_.within(offset, end);
+            for (size_t k = 0; k < stale.size(); ++k) {
+                size_t b = stale[k].first, e = stale[k].second;
+                cl::Event evt;
+                queue.enqueueWriteBuffer(buffer_, CL_FALSE, b * sizeof(T), (e - b) * sizeof(T),
+                                         Data<T>::data() + b, 0, &evt);
+                uploads_.push_back(evt);
+                stats_.uploads++;
+                stats_.bytesUploaded += (e - b) * sizeof(T);
+            }
+        }
+        deviceStale_.remove(offset, end);
+        if (access & WRITE) {
+            hostStale_.add(offset, end);
+        }
+        return buffer_;
+    }
+
+    // explicit invalidation, for buffers written by means unknown to this class
+    void mark_host_dirty(size_t offset = 0, size_t count = 0)
+    {
+        size_t end = rangeEnd(offset, count);
+        hostStale_.remove(offset, end);
+        if (buffer_()) deviceStale_.add(offset, end);
+    }
+
+    void mark_device_dirty(size_t offset = 0, size_t count = 0)
+    {
+        size_t end = rangeEnd(offset, count);
+        if (!buffer_()) {
+            throw std::logic_error("jc::MirroredData: no device buffer to mark dirty");
+        }
+        deviceStale_.remove(offset, end);
+        hostStale_.add(offset, end);
+    }
+
+    bool host_is_current() const
+    {
+        return hostStale_.empty();
+    }
+
+    bool device_is_current() const
+    {
+        return buffer_() && deviceStale_.empty();
+    }
+
+    const TransferStats &transferStats() const
+    {
+        return stats_;
+    }
+
+    const T& get(int x, int y = 0, int z = 0)
+    {
+        return host_view(READ)[Y() * X() * z + X() * y + x];
+    }
+
+    void set(int x, int y, int z, T val)
+    {
+        size_t i = (size_t)Y() * X() * z + X() * y + x;
+        host_view(WRITE, i, 1)[i] = val;
+    }
+
+    void fill(Distribution<T>& distribution)
+    {
+        host_view(WRITE, 0, capacity());
+        Data<T>::fill(distribution);
+    }
+
+    void clear()
+    {
+        host_view(WRITE, 0, capacity());
+        Data<T>::clear();
+    }
+
+    bool equals(MirroredData<T>& other, const Tolerance& tolerance = Tolerance::exact())
+    {
+        host_view(READ);
+        other.host_view(READ);
+        return Data<T>::equals(other, tolerance);
+    }
+
+private:
+    size_t rangeEnd(size_t offset, size_t count) const
+    {
+        size_t end = count == 0 ? size() : offset + count;
+        if (offset > end || end > capacity()) {
+            throw std::out_of_range("jc::MirroredData: range outside the data");
+        }
+        return end;
+    }
+
+    void waitForUploads()
+    {
+        if (!uploads_.empty()) {
+            cl::Event::waitForEvents(uploads_);
+            uploads_.clear();
+        }
+    }
+
+    cl::Context context_;
+    cl::CommandQueue queue_;
+    cl::Buffer buffer_;
+    DirtyRanges hostStale_;    // device holds newer values
+    DirtyRanges deviceStale_;  // host holds newer values
+    std::vector<cl::Event> uploads_;
+    TransferStats stats_;
+};
+
+}
@@ -0,0 +1,525 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <JC/allocator.hpp>
+#include <JC/data.hpp>
+#include <JC/matrix.hpp>
+#include <JC/threadPool.hpp>
+
+// Binary container for Data<T> and Matrix<T> inputs:
+//
+//     [header, 128 bytes][zero padding][payload: count elements, x-fastest]
+//                                     ^ dataOffset, a multiple of alignment
+//
+// The payload starts page-aligned by default, so a mapped file can be used in
+// place by the host and, through CL_MEM_USE_HOST_PTR, by an OpenCL device.
+// Files are written in chunks, without a copy of the data, and loaded with
+// mmap: opening a file of tens of GB costs a few system calls, the pages are
+// read when touched. The mapping is private (copy on write), so the loaded
+// Data or Matrix may be modified without changing the file.
+//
+// Multi-byte values are stored in the byte order of the machine; loading a
+// file written on a machine of the other byte order fails.
+
+namespace jc {
+
+const char DATASET_MAGIC[8] = { 'J', 'C', 'D', 'A', 'T', 'A', '\r', '\n' };
+const uint32_t DATASET_VERSION = 1;
+const uint32_t DATASET_BYTE_ORDER = 0x01020304;
+
+// the checksum is computed over chunks of this many bytes (in parallel when
+// verifying), so it must stay fixed for a file format version
+const size_t DATASET_CHUNK = 1 << 20;
+
+// element type code: kind | size in bytes
+enum DatasetKind {
+    DATASET_UNSIGNED = 0x100,
+    DATASET_SIGNED = 0x200,
+    DATASET_FLOAT = 0x300
+};
+
+template <typename T>
+uint32_t datasetType()
+{
+    static_assert(std::is_arithmetic<T>::value, "datasets hold arithmetic values");
+    return (std::is_floating_point<T>::value ? DATASET_FLOAT
+            : std::is_signed<T>::value ? DATASET_SIGNED : DATASET_UNSIGNED) | (uint32_t)sizeof(T);
+}
+
+struct DatasetHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t elementType;   // datasetType<T>()
+    uint32_t rank;          // 1 to 3, dims beyond rank are 1
+    uint64_t dims[3];       // X, Y, Z of Data; cols, rows of Matrix
+    uint64_t count;         // number of elements
+    uint64_t alignment;
+    uint64_t dataOffset;
+    uint64_t checksum;      // datasetChecksum of the payload
+    uint8_t reserved[128 - 80];
+};
+
+static_assert(sizeof(DatasetHeader) == 128, "the dataset header is 128 bytes");
+
+namespace dataset_detail {
+
+inline uint64_t mix(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x100000001b3ULL;
+    return h ^ (h >> 29);
+}
+
+// 64-bit multiplicative hash of one chunk, 8 bytes per step
+inline uint64_t chunkHash(const unsigned char *p, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = mix(h, w);
+    }
+    if (i < n) {
+        uint64_t w = 0;
+        std::memcpy(&w, p + i, n - i);
+        h = mix(h, w);
+    }
+    return h;
+}
+
+inline std::runtime_error error(const std::string &path, const std::string &what)
+{
+    return std::runtime_error("jc dataset '" + path + "': " + what);
+}
+
+}
+
+// Accumulates the checksum of a payload handed over in any pieces; equal to
+// datasetChecksum() of the concatenation.
+class DatasetChecksum {
+public:
+    DatasetChecksum() : hash_(0), filled_(0), buffer_(DATASET_CHUNK) {}
+
+    void update(const void *data, size_t bytes)
+    {
+        const unsigned char *p = static_cast<const unsigned char*>(data);
+        while (bytes > 0) {
+            if (filled_ == 0 && bytes >= DATASET_CHUNK) {
+                hash_ = dataset_detail::mix(hash_, dataset_detail::chunkHash(p, DATASET_CHUNK));
+                p += DATASET_CHUNK;
+                bytes -= DATASET_CHUNK;
+                continue;
+            }
+            size_t k = std::min(bytes, DATASET_CHUNK - filled_);
+            std::memcpy(&buffer_[filled_], p, k);
+            filled_ += k;
+            p += k;
+            bytes -= k;
+            if (filled_ == DATASET_CHUNK) {
+                hash_ = dataset_detail::mix(hash_, dataset_detail::chunkHash(&buffer_[0], DATASET_CHUNK));
+                filled_ = 0;
+            }
+        }
+    }
+
+    uint64_t value() const
+    {
+        return filled_ == 0 ? hash_
+                            : dataset_detail::mix(hash_, dataset_detail::chunkHash(&buffer_[0], filled_));
+    }
+
+private:
+    uint64_t hash_;
+    size_t filled_;
+    std::vector<unsigned char> buffer_;
+};
+
+// checksum of bytes in memory, chunks hashed in parallel
+inline uint64_t datasetChecksum(const void *data, size_t bytes, ThreadPool &pool = defaultThreadPool())
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    size_t chunks = (bytes + DATASET_CHUNK - 1) / DATASET_CHUNK;
+    std::vector<uint64_t> hashes(chunks);
+    pool.parallelFor(chunks, [&](size_t c) {
+        size_t begin = c * DATASET_CHUNK;
+        hashes[c] = dataset_detail::chunkHash(p + begin, std::min(DATASET_CHUNK, bytes - begin));
+    });
+    uint64_t h = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        h = dataset_detail::mix(h, hashes[c]);
+    }
+    return h;
+}
+
+// Writes a dataset whose payload is handed over in pieces, for inputs that
+// are produced incrementally and never held in memory at once. The header
+// is completed (checksum) by close(), which the destructor calls.
+class DatasetWriter {
+public:
+    DatasetWriter(const std::string &path, uint32_t elementType, uint32_t rank, const uint64_t dims[3],
+                  uint64_t alignment = HOST_PAGE_SIZE)
+        : path_(path), file_(nullptr), written_(0)
+    {
+        if (alignment < sizeof(DatasetHeader) || (alignment & (alignment - 1)) != 0) {
+            throw dataset_detail::error(path, "alignment must be a power of two of at least 128");
+        }
+        if (rank < 1 || rank > 3) {
+            throw dataset_detail::error(path, "rank must be 1 to 3");
+        }
+        std::memset(&header_, 0, sizeof header_);
+        std::memcpy(header_.magic, DATASET_MAGIC, sizeof header_.magic);
+        header_.version = DATASET_VERSION;
+        header_.byteOrder = DATASET_BYTE_ORDER;
+        header_.elementType = elementType;
+        header_.rank = rank;
+        header_.count = 1;
+        for (int d = 0; d < 3; ++d) {
+            header_.dims[d] = d < (int)rank ? dims[d] : 1;
+            header_.count *= header_.dims[d];
+        }
+        header_.alignment = alignment;
+        header_.dataOffset = alignment;
+
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            throw dataset_detail::error(path, "cannot be created");
+        }
+        std::vector<char> head(alignment, 0);
+        std::memcpy(&head[0], &header_, sizeof header_);
+        write(&head[0], head.size());
+    }
+
+    ~DatasetWriter()
+    {
+        try {
+            close();
+        }
+        catch (...) {}
+    }
+
+    DatasetWriter(const DatasetWriter &) = delete;
+    DatasetWriter& operator=(const DatasetWriter &) = delete;
+
+    // appends bytes of payload
+    void append(const void *data, size_t bytes)
+    {
+        if (written_ + bytes > payloadBytes()) {
+            throw dataset_detail::error(path_, "more data than the header declares");
+        }
+        // hash and write chunk by chunk, so each chunk is hashed while in cache
+        const char *p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            size_t k = std::min(bytes, DATASET_CHUNK);
+            checksum_.update(p, k);
+            write(p, k);
+            written_ += k;
+            p += k;
+            bytes -= k;
+        }
+    }
+
+    template <typename T>
+    void append(const T *values, size_t n)
+    {
+        if (datasetType<T>() != header_.elementType) {
+            throw dataset_detail::error(path_, "element type differs from the header");
+        }
+        append(static_cast<const void*>(values), n * sizeof(T));
+    }
+
+    void close()
+    {
+        if (!file_) {
+            return;
+        }
+        bool complete = written_ == payloadBytes();
+        header_.checksum = checksum_.value();
+        bool ok = complete && std::fseek(file_, 0, SEEK_SET) == 0
+                  && std::fwrite(&header_, sizeof header_, 1, file_) == 1;
+        ok = std::fclose(file_) == 0 && ok;
+        file_ = nullptr;
+        if (!complete) {
+            throw dataset_detail::error(path_, "closed before all data was written");
+        }
+        if (!ok) {
+            throw dataset_detail::error(path_, "writing the header failed");
+        }
+    }
+
+private:
+    uint64_t payloadBytes() const
+    {
+        return header_.count * (header_.elementType & 0xff);
+    }
+
+    void write(const void *data, size_t bytes)
+    {
+        if (std::fwrite(data, 1, bytes, file_) != bytes) {
+            throw dataset_detail::error(path_, "write failed");
+        }
+    }
+
+    std::string path_;
+    std::FILE *file_;
+    DatasetHeader header_;
+    DatasetChecksum checksum_;
+    uint64_t written_;
+};
+
+// A dataset file mapped into memory, read-write and private to the process.
+class MappedDataset {
+public:
+    explicit MappedDataset(const std::string &path)
+        : path_(path), base_(nullptr), size_(0)
+    {
+        map();
+        if (size_ < sizeof(DatasetHeader)) {
+            unmap();
+            throw dataset_detail::error(path, "too short for a header");
+        }
+        std::memcpy(&header_, base_, sizeof header_);
+        std::string problem = check();
+        if (!problem.empty()) {
+            unmap();
+            throw dataset_detail::error(path, problem);
+        }
+    }
+
+    ~MappedDataset()
+    {
+        unmap();
+    }
+
+    MappedDataset(const MappedDataset &) = delete;
+    MappedDataset& operator=(const MappedDataset &) = delete;
+
+    const DatasetHeader &header() const
+    {
+        return header_;
+    }
+
+    const std::string &path() const
+    {
+        return path_;
+    }
+
+    void *payload()
+    {
+        return static_cast<char*>(base_) + header_.dataOffset;
+    }
+
+    size_t payloadBytes() const
+    {
+        return (size_t)(header_.count * (header_.elementType & 0xff));
+    }
+
+    // the payload as T; throws if the file holds another element type
+    template <typename T>
+    T *data()
+    {
+        if (datasetType<T>() != header_.elementType) {
+            throw dataset_detail::error(path_, "element type differs from the requested one");
+        }
+        return static_cast<T*>(payload());
+    }
+
+    // reads the whole payload, so it is not done on load
+    bool verifyChecksum(ThreadPool &pool = defaultThreadPool()) const
+    {
+        const char *p = static_cast<const char*>(base_) + header_.dataOffset;
+        return datasetChecksum(p, payloadBytes(), pool) == header_.checksum;
+    }
+
+private:
+    std::string check() const
+    {
+        if (std::memcmp(header_.magic, DATASET_MAGIC, sizeof header_.magic) != 0) {
+            return "not a dataset file";
+        }
+        if (header_.byteOrder != DATASET_BYTE_ORDER) {
+            return "written with another byte order";
+        }
+        if (header_.version != DATASET_VERSION) {
+            std::ostringstream oss;
+            oss << "unsupported version " << header_.version;
+            return oss.str();
+        }
+        // every size below is checked before it is used, so that a damaged
+        // header cannot lead to reads outside the mapping or misaligned ones
+        uint32_t kind = header_.elementType & ~0xffu, bytes = header_.elementType & 0xff;
+        if ((kind != DATASET_UNSIGNED && kind != DATASET_SIGNED && kind != DATASET_FLOAT)
+            || (bytes != 1 && bytes != 2 && bytes != 4 && bytes != 8)) {
+            return "unknown element type";
+        }
+        if (header_.rank < 1 || header_.rank > 3) {
+            return "rank must be 1 to 3";
+        }
+        uint64_t count = 1;
+        for (uint32_t d = 0; d < 3; ++d) {
+            uint64_t n = header_.dims[d];
+            if (d >= header_.rank && n != 1) {
+                return "dimensions beyond the rank must be 1";
+            }
+            if (n != 0 && count > std::numeric_limits<uint64_t>::max() / n) {
+                return "dimensions overflow";
+            }
+            count *= n;
+        }
+        if (count != header_.count) {
+            return "element count differs from the dimensions";
+        }
+        if (count > std::numeric_limits<size_t>::max() / bytes) {
+            return "payload too large";
+        }
+        if (header_.alignment == 0 || (header_.alignment & (header_.alignment - 1)) != 0) {
+            return "alignment is not a power of two";
+        }
+        if (header_.dataOffset < sizeof(DatasetHeader) || header_.dataOffset % bytes != 0) {
+            return "payload offset is not aligned to the element size";
+        }
+        if (header_.dataOffset > size_ || count * bytes > size_ - header_.dataOffset) {
+            return "truncated";
+        }
+        return "";
+    }
+
+#ifdef _WIN32
+    void map()
+    {
+        HANDLE file = CreateFileA(path_.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw dataset_detail::error(path_, "cannot be opened");
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        size_ = (size_t)size.QuadPart;
+        HANDLE mapping = size_ ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+        CloseHandle(file);
+        if (!mapping) {
+            throw dataset_detail::error(path_, "cannot be mapped");
+        }
+        base_ = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!base_) {
+            throw dataset_detail::error(path_, "cannot be mapped");
+        }
+    }
+
+    void unmap()
+    {
+        if (base_) UnmapViewOfFile(base_);
+        base_ = nullptr;
+    }
+#else
+    void map()
+    {
+        int fd = open(path_.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw dataset_detail::error(path_, "cannot be opened");
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            throw dataset_detail::error(path_, "empty or unreadable");
+        }
+        size_ = (size_t)st.st_size;
+        void *base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            throw dataset_detail::error(path_, "cannot be mapped");
+        }
+        base_ = base;
+    }
+
+    void unmap()
+    {
+        if (base_) munmap(base_, size_);
+        base_ = nullptr;
+    }
+#endif
+
+    std::string path_;
+    void *base_;
+    size_t size_;
+    DatasetHeader header_;
+};
+
+template <typename T>
+void saveDataset(const std::string &path, const Data<T> &data, uint64_t alignment = HOST_PAGE_SIZE)
+{
+    const uint64_t dims[3] = { (uint64_t)data.X(), (uint64_t)data.Y(), (uint64_t)data.Z() };
+    DatasetWriter writer(path, datasetType<T>(), 3, dims, alignment);
+    writer.append(data.data(), data.size());
+    writer.close();
+}
+
+template <typename T>
+void saveDataset(const std::string &path, const Matrix<T> &m, uint64_t alignment = HOST_PAGE_SIZE)
+{
+    const uint64_t dims[3] = { m.cols(), m.rows(), 1 };
+    DatasetWriter writer(path, datasetType<T>(), 2, dims, alignment);
+    writer.append(m.data(), (size_t)m.rows() * m.cols());
+    writer.close();
+}
+
+// Data viewing the mapped file; the mapping lives as long as the Data
+template <typename T>
+std::unique_ptr<Data<T> > loadData(const std::string &path)
+{
+    std::shared_ptr<MappedDataset> file = std::make_shared<MappedDataset>(path);
+    const DatasetHeader &h = file->header();
+    // Data keeps its dimensions as int
+    for (int d = 0; d < 3; ++d) {
+        if (h.dims[d] > (uint64_t)std::numeric_limits<int>::max()) {
+            throw dataset_detail::error(path, "a dimension is too large for jc::Data");
+        }
+    }
+    T *p = file->data<T>();
+    return std::unique_ptr<Data<T> >(new Data<T>(p, (int)h.dims[0], (int)h.dims[1], (int)h.dims[2], file));
+}
+
+// Matrix viewing the mapped file; the mapping lives as long as the Matrix
+// uses it
+template <typename T>
+Matrix<T> loadMatrix(const std::string &path)
+{
+    std::shared_ptr<MappedDataset> file = std::make_shared<MappedDataset>(path);
+    const DatasetHeader &h = file->header();
+    if (h.rank > 2 && h.dims[2] != 1) {
+        throw dataset_detail::error(path, "three-dimensional data is not a matrix");
+    }
+    // Matrix indexes its elements with unsigned int
+    if (h.dims[0] > std::numeric_limits<unsigned int>::max() || h.dims[1] > std::numeric_limits<unsigned int>::max()
+        || h.count > std::numeric_limits<unsigned int>::max()) {
+        throw dataset_detail::error(path, "too many elements for jc::Matrix");
+    }
+    T *p = file->data<T>();
+    return Matrix<T>(p, (unsigned int)h.dims[1], (unsigned int)h.dims[0], file);
+}
+
+}
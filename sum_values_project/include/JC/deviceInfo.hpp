@@ -0,0 +1,246 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+// What the project reads about platforms and devices, queried once per
+// process. The first call to jc::platformInfos() enumerates every platform
+// and device; later calls, and jc::deviceInfo(device), only read the cache:
+//
+//     const jc::DeviceInfo &info = jc::deviceInfo(device);
+//     if (info.fp64) ...
+//     double ai = flops / bytes, roof = std::min(info.peakFlops, ai * info.peakBandwidth);
+//
+// Devices not found by the enumeration (sub-devices) are queried on their
+// first lookup and cached as well. The peaks are rough estimates from the
+// device attributes (OpenCL has no query for them), good for an order of
+// magnitude; they are plain members, to be overwritten by measured values.
+
+namespace jc {
+
+struct DeviceInfo {
+    cl::Device device;
+    int platformIndex;              // position in jc::platformInfos(), -1 for sub-devices
+    int deviceIndex;                // position among the devices of the platform, -1 for sub-devices
+
+    std::string name;
+    std::string vendor;
+    std::string driverVersion;
+    std::string openCLCVersion;
+    std::string extensions;         // space-separated, as reported
+    cl_device_type type;
+
+    cl_uint computeUnits;
+    cl_uint clockFrequency;         // MHz
+    cl_uint nativeVectorWidthFloat;
+    size_t maxWorkGroupSize;
+    size_t timerResolution;         // ns
+    cl_command_queue_properties queueProperties;
+
+    cl_ulong globalMemSize;
+    cl_ulong globalMemCacheSize;
+    cl_device_mem_cache_type globalMemCacheType;
+    cl_ulong localMemSize;
+    cl_ulong maxMemAllocSize;
+    cl_uint memBaseAddrAlign;       // bits
+    bool hostUnifiedMemory;
+
+    size_t image2dMaxHeight, image2dMaxWidth;
+    size_t image3dMaxDepth, image3dMaxHeight, image3dMaxWidth;
+
+    bool fp64;                      // cl_khr_fp64
+    bool fp16;                      // cl_khr_fp16
+    bool int64Atomics;              // cl_khr_int64_base_atomics
+
+    double peakFlops;               // single precision FLOP/s, estimated
+    double peakBandwidth;           // global memory bytes/s, estimated
+
+    bool hasExtension(const std::string &extension) const
+    {
+        std::string padded = " " + extensions + " ";
+        return padded.find(" " + extension + " ") != std::string::npos;
+    }
+
+    bool isGPU() const
+    {
+        return (type & CL_DEVICE_TYPE_GPU) != 0;
+    }
+
+    bool isCPU() const
+    {
+        return (type & CL_DEVICE_TYPE_CPU) != 0;
+    }
+};
+
+struct PlatformInfo {
+    cl::Platform platform;
+    std::string name;
+    std::string vendor;
+    std::string profile;
+    std::string version;
+    std::string extensions;
+    std::vector<DeviceInfo> devices;
+};
+
+namespace device_info_detail {
+
+// single precision lanes per compute unit: SIMD width times ALUs per core
+// for CPUs, the usual shader count per compute unit of the vendor for GPUs
+inline double lanesPerUnit(const DeviceInfo &info)
+{
+    if (!info.isGPU()) {
+        return 2.0 * info.nativeVectorWidthFloat;   // two vector FMA ports
+    }
+    const std::string &v = info.vendor;
+    if (v.find("NVIDIA") != std::string::npos) return 128;
+    if (v.find("Intel") != std::string::npos) return 8;
+    return 64;  // AMD and most others
+}
+
+inline void estimatePeaks(DeviceInfo &info)
+{
+    double hz = info.clockFrequency * 1e6;
+    // an FMA counts as two operations
+    info.peakFlops = info.computeUnits * hz * lanesPerUnit(info) * 2;
+    // about a byte per cycle and core from system memory, eight per compute
+    // unit from dedicated video memory
+    double bytesPerCycle = info.isGPU() && !info.hostUnifiedMemory ? 8 : 1;
+    info.peakBandwidth = info.computeUnits * hz * bytesPerCycle;
+}
+
+inline DeviceInfo query(const cl::Device &device, int platformIndex, int deviceIndex)
+{
+    DeviceInfo info;
+    info.device = device;
+    info.platformIndex = platformIndex;
+    info.deviceIndex = deviceIndex;
+
+    info.name = device.getInfo<CL_DEVICE_NAME>();
+    info.vendor = device.getInfo<CL_DEVICE_VENDOR>();
+    info.driverVersion = device.getInfo<CL_DRIVER_VERSION>();
+    info.openCLCVersion = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+    info.extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+    info.type = device.getInfo<CL_DEVICE_TYPE>();
+
+    info.computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    info.clockFrequency = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+    info.nativeVectorWidthFloat = device.getInfo<CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT>();
+    info.maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    info.timerResolution = device.getInfo<CL_DEVICE_PROFILING_TIMER_RESOLUTION>();
+    info.queueProperties = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+
+    info.globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    info.globalMemCacheSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_CACHE_SIZE>();
+    info.globalMemCacheType = device.getInfo<CL_DEVICE_GLOBAL_MEM_CACHE_TYPE>();
+    info.localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    info.maxMemAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    info.memBaseAddrAlign = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>();
+    info.hostUnifiedMemory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() != CL_FALSE;
+
+    info.image2dMaxHeight = device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+    info.image2dMaxWidth = device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>();
+    info.image3dMaxDepth = device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>();
+    info.image3dMaxHeight = device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>();
+    info.image3dMaxWidth = device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>();
+
+    info.fp64 = info.hasExtension("cl_khr_fp64");
+    info.fp16 = info.hasExtension("cl_khr_fp16");
+    info.int64Atomics = info.hasExtension("cl_khr_int64_base_atomics");
+
+    estimatePeaks(info);
+    return info;
+}
+
+struct Cache {
+    Cache() : loaded(false) {}
+    std::mutex mutex;
+    bool loaded;
+    std::vector<PlatformInfo> platforms;
+    std::map<cl_device_id, DeviceInfo> others;  // devices outside the enumeration
+};
+
+inline Cache& cache()
+{
+    static Cache c;
+    return c;
+}
+
+}
+
+// every platform with its devices; enumerated on the first call, which
+// throws cl::Error when there is no OpenCL platform (and is retried then)
+inline const std::vector<PlatformInfo>& platformInfos()
+{
+    device_info_detail::Cache &c = device_info_detail::cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (c.loaded) {
+        return c.platforms;
+    }
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    std::vector<PlatformInfo> result(platforms.size());
+    for (size_t p = 0; p < platforms.size(); ++p) {
+        PlatformInfo &info = result[p];
+        info.platform = platforms[p];
+        info.name = platforms[p].getInfo<CL_PLATFORM_NAME>();
+        info.vendor = platforms[p].getInfo<CL_PLATFORM_VENDOR>();
+        info.profile = platforms[p].getInfo<CL_PLATFORM_PROFILE>();
+        info.version = platforms[p].getInfo<CL_PLATFORM_VERSION>();
+        info.extensions = platforms[p].getInfo<CL_PLATFORM_EXTENSIONS>();
+        std::vector<cl::Device> devices;
+        try {
+            platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        }
+        catch (cl::Error&) {
+            continue; // CL_DEVICE_NOT_FOUND: a platform without devices
+        }
+        for (size_t d = 0; d < devices.size(); ++d) {
+            info.devices.push_back(device_info_detail::query(devices[d], (int)p, (int)d));
+        }
+    }
+    c.platforms.swap(result);
+    c.loaded = true;
+    return c.platforms;
+}
+
+// the cached attributes of device
+inline const DeviceInfo& deviceInfo(const cl::Device &device)
+{
+    const std::vector<PlatformInfo> &platforms = platformInfos();
+    for (size_t p = 0; p < platforms.size(); ++p) {
+        for (size_t d = 0; d < platforms[p].devices.size(); ++d) {
+            if (platforms[p].devices[d].device() == device()) {
+                return platforms[p].devices[d];
+            }
+        }
+    }
+    device_info_detail::Cache &c = device_info_detail::cache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    auto it = c.others.find(device());
+    if (it == c.others.end()) {
+        it = c.others.insert(std::make_pair(device(), device_info_detail::query(device, -1, -1))).first;
+    }
+    return it->second;
+}
+
+// the cached attributes of device deviceIndex of platform platformIndex;
+// NULL when there is no such device
+inline const DeviceInfo* deviceInfo(int platformIndex, int deviceIndex)
+{
+    const std::vector<PlatformInfo> &platforms = platformInfos();
+    if (platformIndex < 0 || platformIndex >= (int)platforms.size()) {
+        return NULL;
+    }
+    const std::vector<DeviceInfo> &devices = platforms[platformIndex].devices;
+    if (deviceIndex < 0 || deviceIndex >= (int)devices.size()) {
+        return NULL;
+    }
+    return &devices[deviceIndex];
+}
+
+}
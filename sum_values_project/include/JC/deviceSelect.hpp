@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/deviceInfo.hpp>
+
+// Picks devices by what they can do instead of by platform and device index:
+//
+//     cl::Device device = jc::selectDevice(jc::DeviceQuery()
+//                                              .ofType(CL_DEVICE_TYPE_GPU)
+//                                              .withExtension("cl_khr_fp64")
+//                                              .withMemory(2ull << 30)
+//                                              .fastest());
+//
+// All conditions must hold. Among the matching devices the first in
+// enumeration order is taken, the one with the highest estimated peak
+// (byPeakEstimate), or the one fastest on a short probe kernel (fastest).
+// When no device matches, jc::DeviceNotFound is thrown; its message lists
+// the devices and why each was rejected.
+
+namespace jc {
+
+class DeviceNotFound : public std::runtime_error {
+public:
+    explicit DeviceNotFound(const std::string &message)
+        : std::runtime_error(message)
+    {
+    }
+};
+
+struct DeviceQuery {
+    enum Ranking { FIRST, PEAK_ESTIMATE, PROBE };
+
+    DeviceQuery()
+        : type(CL_DEVICE_TYPE_ALL), minGlobalMem(0), minAllocSize(0), ranking(FIRST)
+    {
+    }
+
+    DeviceQuery& ofType(cl_device_type t)
+    {
+        type = t;
+        return *this;
+    }
+
+    // ECMAScript regex searched in the device name, e.g. "GeForce|Radeon"
+    DeviceQuery& named(const std::string &regex)
+    {
+        nameRegex = regex;
+        return *this;
+    }
+
+    DeviceQuery& withMemory(cl_ulong bytes)
+    {
+        minGlobalMem = bytes;
+        return *this;
+    }
+
+    DeviceQuery& withAllocation(cl_ulong bytes)
+    {
+        minAllocSize = bytes;
+        return *this;
+    }
+
+    DeviceQuery& withExtension(const std::string &extension)
+    {
+        extensions.push_back(extension);
+        return *this;
+    }
+
+    DeviceQuery& byPeakEstimate()
+    {
+        ranking = PEAK_ESTIMATE;
+        return *this;
+    }
+
+    DeviceQuery& fastest()
+    {
+        ranking = PROBE;
+        return *this;
+    }
+
+    // empty when info matches, else the first condition it fails
+    std::string mismatch(const DeviceInfo &info) const
+    {
+        std::ostringstream why;
+        if (!(info.type & type)) {
+            why << "wrong type";
+        }
+        else if (!nameRegex.empty() && !std::regex_search(info.name, std::regex(nameRegex))) {
+            why << "name does not match '" << nameRegex << "'";
+        }
+        else if (info.globalMemSize < minGlobalMem) {
+            why << "global memory " << (info.globalMemSize >> 20) << " MB < " << (minGlobalMem >> 20) << " MB";
+        }
+        else if (info.maxMemAllocSize < minAllocSize) {
+            why << "max allocation " << (info.maxMemAllocSize >> 20) << " MB < " << (minAllocSize >> 20) << " MB";
+        }
+        else {
+            for (size_t e = 0; e < extensions.size(); ++e) {
+                if (!info.hasExtension(extensions[e])) {
+                    why << "no " << extensions[e];
+                    break;
+                }
+            }
+        }
+        return why.str();
+    }
+
+    cl_device_type type;
+    std::string nameRegex;
+    cl_ulong minGlobalMem;
+    cl_ulong minAllocSize;
+    std::vector<std::string> extensions;
+    Ranking ranking;
+};
+
+namespace select_detail {
+
+const size_t PROBE_ITEMS = 1 << 18;     // float4 elements, 4 MB each way
+const cl_uint PROBE_ITERATIONS = 64;
+
+const char *const PROBE_SOURCE =
+    "__kernel void jc_probe(__global const float4 *in, __global float4 *out, uint iterations)\n"
+    "{\n"
+    "    size_t i = get_global_id(0);\n"
+    "    float4 x = in[i], y = x * 0.5f, z = (float4)(1.0f);\n"
+    "    for (uint k = 0; k < iterations; ++k) {\n"
+    "        y = mad(y, x, z);\n"
+    "        z = mad(z, x, y);\n"
+    "    }\n"
+    "    out[i] = y + z;\n"
+    "}\n";
+
+// probe kernel runs per second on device, 0 when it cannot run there
+inline double runProbe(const cl::Device &device)
+{
+    try {
+        cl::Context context(device);
+        cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+        cl::Program::Sources sources(1, std::make_pair(PROBE_SOURCE, strlen(PROBE_SOURCE)));
+        cl::Program program(context, sources);
+        program.build(std::vector<cl::Device>(1, device));
+        cl::Kernel kernel(program, "jc_probe");
+        std::vector<cl_float> host(PROBE_ITEMS * 4, 1.0f);
+        cl::Buffer in(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, host.size() * sizeof(cl_float), host.data());
+        cl::Buffer out(context, CL_MEM_WRITE_ONLY, host.size() * sizeof(cl_float));
+        kernel.setArg<cl::Buffer>(0, in);
+        kernel.setArg<cl::Buffer>(1, out);
+        kernel.setArg<cl_uint>(2, PROBE_ITERATIONS);
+
+        // the first run pays for the lazy setup of the driver
+        cl_ulong best = ~(cl_ulong)0;
+        for (int run = 0; run < 3; ++run) {
+            cl::Event event;
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(PROBE_ITEMS), cl::NullRange, NULL, &event);
+            event.wait();
+            cl_ulong ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            if (run > 0) best = std::min(best, ns);
+        }
+        return 1e9 / std::max<cl_ulong>(best, 1);
+    }
+    catch (cl::Error&) {
+        return 0;
+    }
+}
+
+}
+
+// probe kernel runs per second on device, measured on the first call
+inline double probeThroughput(const cl::Device &device)
+{
+    static std::mutex mutex;
+    static std::map<cl_device_id, double> measured;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = measured.find(device());
+        if (it != measured.end()) {
+            return it->second;
+        }
+    }
+    double rate = select_detail::runProbe(device);
+    std::lock_guard<std::mutex> lock(mutex);
+    measured[device()] = rate;
+    return rate;
+}
+
+// the devices matching query, best first
+inline std::vector<cl::Device> selectDevices(const DeviceQuery &query)
+{
+    std::vector<const DeviceInfo*> matching;
+    const std::vector<PlatformInfo> &platforms = platformInfos();
+    for (size_t p = 0; p < platforms.size(); ++p) {
+        for (size_t d = 0; d < platforms[p].devices.size(); ++d) {
+            if (query.mismatch(platforms[p].devices[d]).empty()) {
+                matching.push_back(&platforms[p].devices[d]);
+            }
+        }
+    }
+    std::vector<double> score(matching.size(), 0);
+    for (size_t i = 0; i < matching.size(); ++i) {
+        if (query.ranking == DeviceQuery::PEAK_ESTIMATE) score[i] = matching[i]->peakFlops;
+        if (query.ranking == DeviceQuery::PROBE) score[i] = probeThroughput(matching[i]->device);
+    }
+    std::vector<size_t> order(matching.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return score[a] > score[b]; });
+
+    std::vector<cl::Device> result;
+    for (size_t i = 0; i < order.size(); ++i) {
+        result.push_back(matching[order[i]]->device);
+    }
+    return result;
+}
+
+// the best device matching query; throws jc::DeviceNotFound when none does
+inline cl::Device selectDevice(const DeviceQuery &query)
+{
+    std::vector<cl::Device> devices = selectDevices(query);
+    if (!devices.empty()) {
+        return devices[0];
+    }
+    std::ostringstream oss;
+    oss << "no OpenCL device matches the query";
+    const std::vector<PlatformInfo> &platforms = platformInfos();
+    for (size_t p = 0; p < platforms.size(); ++p) {
+        for (size_t d = 0; d < platforms[p].devices.size(); ++d) {
+            const DeviceInfo &info = platforms[p].devices[d];
+            oss << "\n  platform " << p << " device " << d << " '" << info.name << "': " << query.mismatch(info);
+        }
+    }
+    throw DeviceNotFound(oss.str());
+}
+
+}
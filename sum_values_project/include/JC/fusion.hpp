@@ -0,0 +1,612 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/bufferPool.hpp>
+#include <JC/matrixExprCL.hpp>
+#include <JC/trace.hpp>
+
+// Fuses a chain of elementwise stages over arrays, and optionally a
+// trailing reduction, into one generated kernel. Each stage assigns an
+// OpenCL C expression to an array or to a temporary:
+//
+//     jc::FusedPipeline<float> p;
+//     p.input("x").inout("y").scalar("a", 2.0f)
+//      .stage("y", "a * x + y")
+//      .reduce("y");                                   // y = a*x + y; s = sum(y)
+//     float s = p.run(queue, { { "x", x }, { "y", y } }, n).value;
+//
+//     q.input("x").output("z").stage("t", "g(x)").stage("z", "f(t)");   // z = f(g(x))
+//
+// The fused kernel loads every array it needs once, keeps temporaries in
+// registers and stores only the arrays assigned by a stage, so the global
+// memory traffic of k stages drops to about that of one. runUnfused() runs
+// the same pipeline as one kernel per stage plus a separate reduction, with
+// temporaries in global memory, and benchmarkFusion() compares the two.
+//
+// The fused kernel follows the argument layout of JC/outOfCore.hpp (arrays,
+// then partial and scratch for a reduction, scalars, ulong n last), so it can
+// also be handed to OutOfCoreExecutor or MultiDeviceExecutor.
+
+namespace jc {
+
+enum FusionReduce { FUSE_SUM, FUSE_MIN, FUSE_MAX };
+
+// work-groups of the reductions
+const size_t FUSION_GROUPS = 256;
+
+template <typename T>
+struct PipelineRun {
+    T value;            // the reduction (its identity for n == 0), T() without one
+    double seconds;     // enqueue to finish, host clock
+    size_t bytes;       // global memory moved by the kernels
+    size_t kernels;     // launches
+};
+
+namespace fusion_detail {
+
+// identifiers in an OpenCL C expression
+inline std::set<std::string> identifiers(const std::string &expr)
+{
+    std::set<std::string> names;
+    for (size_t i = 0; i < expr.size();) {
+        if (std::isalpha((unsigned char)expr[i]) || expr[i] == '_') {
+            size_t j = i;
+            while (j < expr.size() && (std::isalnum((unsigned char)expr[j]) || expr[j] == '_')) ++j;
+            names.insert(expr.substr(i, j - i));
+            i = j;
+        }
+        else if (std::isdigit((unsigned char)expr[i]) || expr[i] == '.') {
+            // skip numbers with their suffixes, 1.5f, 2e-3
+            while (i < expr.size() && (std::isalnum((unsigned char)expr[i]) || expr[i] == '.')) ++i;
+        }
+        else {
+            ++i;
+        }
+    }
+    return names;
+}
+
+}
+
+template <typename T>
+class FusedPipeline {
+public:
+    FusedPipeline() : reduce_(false), op_(FUSE_SUM) {}
+
+    // array read by the stages
+    FusedPipeline &input(const std::string &name)
+    {
+        return array(name, INPUT);
+    }
+
+    // array read by the stages and stored back if a stage assigns it
+    FusedPipeline &inout(const std::string &name)
+    {
+        return array(name, INOUT);
+    }
+
+    // array only written, by a stage
+    FusedPipeline &output(const std::string &name)
+    {
+        return array(name, OUTPUT);
+    }
+
+    FusedPipeline &scalar(const std::string &name, T value)
+    {
+        declare(name);
+        scalars_.push_back(std::make_pair(name, value));
+        return *this;
+    }
+
+    // target = expr for every element; a target that is not an array is a temporary
+    FusedPipeline &stage(const std::string &target, const std::string &expr)
+    {
+        if (reduce_) {
+            throw std::logic_error("jc::FusedPipeline: stages cannot follow the reduction");
+        }
+        const Array *a = find(target);
+        if (a && a->kind == INPUT) {
+            throw std::invalid_argument("jc::FusedPipeline: stage assigns the input " + target);
+        }
+        if (!a && isScalar(target)) {
+            throw std::invalid_argument("jc::FusedPipeline: stage assigns the scalar " + target);
+        }
+        Stage s = { target, expr };
+        stages_.push_back(s);
+        return *this;
+    }
+
+    // reduces name (an array or a temporary) after the last stage
+    FusedPipeline &reduce(const std::string &name, FusionReduce op = FUSE_SUM)
+    {
+        reduce_ = true;
+        reduced_ = name;
+        op_ = op;
+        return *this;
+    }
+
+    // the fused kernel
+    std::string source(const std::string &name = "fusedPipeline") const
+    {
+        std::ostringstream oss;
+        preamble(oss);
+        oss << "__kernel void " << name << "(";
+        bool first = true;
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            param(oss, first, arrays_[k].kind == INPUT ? "__global const " : "__global ", "* g_" + arrays_[k].name);
+        }
+        if (reduce_) {
+            param(oss, first, "__global ", "* partial");
+            param(oss, first, "__local ", "* scratch");
+        }
+        for (size_t k = 0; k < scalars_.size(); ++k) {
+            param(oss, first, "", " " + scalars_[k].first);
+        }
+        param(oss, first, "", "", "ulong n");
+        oss << ")\n{\n";
+        if (reduce_) oss << "\t" << type() << " acc = " << identity() << ";\n";
+        oss << "\tfor (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n";
+
+        std::set<std::string> used = usedNames();
+        std::set<std::string> declared;
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            const Array &a = arrays_[k];
+            if (a.kind != OUTPUT && used.count(a.name)) {
+                oss << "\t\t" << type() << " " << a.name << " = g_" << a.name << "[i];\n";
+                declared.insert(a.name);
+            }
+        }
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            oss << "\t\t" << (declared.count(stages_[s].target) ? "" : std::string(type()) + " ")
+                << stages_[s].target << " = " << stages_[s].expr << ";\n";
+            declared.insert(stages_[s].target);
+        }
+        std::set<std::string> stored = assigned();
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            if (stored.count(arrays_[k].name)) {
+                oss << "\t\tg_" << arrays_[k].name << "[i] = " << arrays_[k].name << ";\n";
+            }
+        }
+        if (reduce_) oss << "\t\tacc = " << combine("acc", reduced_) << ";\n";
+        oss << "\t}\n";
+        if (reduce_) epilogue(oss);
+        oss << "}\n";
+        return oss.str();
+    }
+
+    // one kernel per stage ("stage0", "stage1", ...) and "reduceStage", with
+    // temporaries in global memory; temporaries are listed after the arrays
+    std::string unfusedSource() const
+    {
+        std::ostringstream oss;
+        preamble(oss);
+        std::vector<std::string> globals = unfusedArrays();
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            std::set<std::string> refs = fusion_detail::identifiers(stages_[s].expr);
+            oss << "__kernel void stage" << s << "(";
+            bool first = true;
+            for (size_t k = 0; k < globals.size(); ++k) {
+                param(oss, first, "__global ", "* g_" + globals[k]);
+            }
+            for (size_t k = 0; k < scalars_.size(); ++k) {
+                param(oss, first, "", " " + scalars_[k].first);
+            }
+            param(oss, first, "", "", "ulong n");
+            oss << ")\n{\n\tsize_t i = get_global_id(0);\n\tif (i >= n)\n\t\treturn;\n";
+            for (size_t k = 0; k < globals.size(); ++k) {
+                if (refs.count(globals[k])) {
+                    oss << "\t" << type() << " " << globals[k] << " = g_" << globals[k] << "[i];\n";
+                }
+            }
+            oss << "\tg_" << stages_[s].target << "[i] = " << stages_[s].expr << ";\n}\n\n";
+        }
+        if (reduce_) {
+            oss << "__kernel void reduceStage(__global const " << type() << "* g_" << reduced_
+                << ", __global " << type() << "* partial, __local " << type() << "* scratch, ulong n)\n{\n";
+            oss << "\t" << type() << " acc = " << identity() << ";\n";
+            oss << "\tfor (size_t i = get_global_id(0); i < n; i += get_global_size(0))\n";
+            oss << "\t\tacc = " << combine("acc", "g_" + reduced_ + "[i]") << ";\n";
+            epilogue(oss);
+            oss << "}\n";
+        }
+        return oss.str();
+    }
+
+    // Runs the fused kernel over n elements. buffers maps the array names to
+    // device buffers of at least n elements.
+    PipelineRun<T> run(const cl::CommandQueue &queue, const std::map<std::string, cl::Buffer> &buffers, size_t n) const
+    {
+        if (n == 0) {
+            return emptyRun();
+        }
+        cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+        cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        cl::Kernel kernel = cachedKernel(context, device, source(), "fusedPipeline");
+        size_t local = localSize(device);
+
+        cl_uint arg = 0;
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            kernel.setArg<cl::Buffer>(arg++, bufferOf(buffers, arrays_[k].name));
+        }
+        PooledBuffer partial;
+        if (reduce_) {
+            partial = defaultBufferPool().acquire(context, FUSION_GROUPS * sizeof(T), CL_MEM_WRITE_ONLY);
+            kernel.setArg<cl::Buffer>(arg++, partial);
+            kernel.setArg(arg++, local * sizeof(T), NULL);
+        }
+        for (size_t k = 0; k < scalars_.size(); ++k) {
+            kernel.setArg<T>(arg++, scalars_[k].second);
+        }
+        kernel.setArg<cl_ulong>(arg++, (cl_ulong)n);
+
+        TracedQueue traced(queue);
+        PipelineRun<T> result = PipelineRun<T>();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t global = reduce_ ? FUSION_GROUPS * local : (n + local - 1) / local * local;
+        traced.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), cl::NDRange(local));
+        result.kernels = 1;
+        if (reduce_) result.value = readPartials(traced, partial);
+        queue.finish();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.bytes = fusedBytes(n);
+        return result;
+    }
+
+    // the same pipeline, one kernel per stage
+    PipelineRun<T> runUnfused(const cl::CommandQueue &queue, const std::map<std::string, cl::Buffer> &buffers,
+                              size_t n) const
+    {
+        if (n == 0) {
+            return emptyRun();
+        }
+        cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+        cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        std::string src = unfusedSource();
+        size_t local = localSize(device);
+
+        // temporaries live in global memory here
+        std::vector<std::string> globals = unfusedArrays();
+        std::vector<PooledBuffer> temps;
+        std::map<std::string, cl::Buffer> all = buffers;
+        for (size_t k = arrays_.size(); k < globals.size(); ++k) {
+            temps.push_back(defaultBufferPool().acquire(context, n * sizeof(T)));
+            all[globals[k]] = temps.back();
+        }
+
+        TracedQueue traced(queue);
+        PipelineRun<T> result = PipelineRun<T>();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            cl::Kernel kernel = cachedKernel(context, device, src, "stage" + std::to_string(s));
+            cl_uint arg = 0;
+            for (size_t k = 0; k < globals.size(); ++k) {
+                kernel.setArg<cl::Buffer>(arg++, bufferOf(all, globals[k]));
+            }
+            for (size_t k = 0; k < scalars_.size(); ++k) {
+                kernel.setArg<T>(arg++, scalars_[k].second);
+            }
+            kernel.setArg<cl_ulong>(arg++, (cl_ulong)n);
+            traced.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange((n + local - 1) / local * local),
+                                        cl::NDRange(local));
+            ++result.kernels;
+        }
+        PooledBuffer partial;
+        if (reduce_) {
+            partial = defaultBufferPool().acquire(context, FUSION_GROUPS * sizeof(T), CL_MEM_WRITE_ONLY);
+            cl::Kernel kernel = cachedKernel(context, device, src, "reduceStage");
+            kernel.setArg<cl::Buffer>(0, bufferOf(all, reduced_));
+            kernel.setArg<cl::Buffer>(1, partial);
+            kernel.setArg(2, local * sizeof(T), NULL);
+            kernel.setArg<cl_ulong>(3, (cl_ulong)n);
+            traced.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(FUSION_GROUPS * local), cl::NDRange(local));
+            ++result.kernels;
+            result.value = readPartials(traced, partial);
+        }
+        queue.finish();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.bytes = unfusedBytes(n);
+        return result;
+    }
+
+    // global memory moved by the fused kernel: each needed array read once,
+    // each assigned array written once
+    size_t fusedBytes(size_t n) const
+    {
+        std::set<std::string> used = usedNames(), stored = assigned();
+        size_t words = 0;
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            if (arrays_[k].kind != OUTPUT && used.count(arrays_[k].name)) ++words;
+            if (stored.count(arrays_[k].name)) ++words;
+        }
+        return words * n * sizeof(T) + (reduce_ ? FUSION_GROUPS * sizeof(T) : 0);
+    }
+
+    // ... and by the unfused kernels: every stage reads its operands and
+    // writes its target, the reduction reads its array again
+    size_t unfusedBytes(size_t n) const
+    {
+        std::vector<std::string> globals = unfusedArrays();
+        size_t words = 0;
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            std::set<std::string> refs = fusion_detail::identifiers(stages_[s].expr);
+            for (size_t k = 0; k < globals.size(); ++k) {
+                if (refs.count(globals[k])) ++words;
+            }
+            ++words;
+        }
+        if (reduce_) ++words;
+        return words * n * sizeof(T) + (reduce_ ? FUSION_GROUPS * sizeof(T) : 0);
+    }
+
+private:
+    enum Kind { INPUT, INOUT, OUTPUT };
+
+    struct Array {
+        std::string name;
+        Kind kind;
+    };
+
+    struct Stage {
+        std::string target;
+        std::string expr;
+    };
+
+    FusedPipeline &array(const std::string &name, Kind kind)
+    {
+        if (!stages_.empty()) {
+            throw std::logic_error("jc::FusedPipeline: arrays must be declared before the stages");
+        }
+        declare(name);
+        Array a = { name, kind };
+        arrays_.push_back(a);
+        return *this;
+    }
+
+    void declare(const std::string &name)
+    {
+        if (find(name) || isScalar(name)) {
+            throw std::invalid_argument("jc::FusedPipeline: " + name + " is declared twice");
+        }
+    }
+
+    const Array *find(const std::string &name) const
+    {
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            if (arrays_[k].name == name) return &arrays_[k];
+        }
+        return NULL;
+    }
+
+    bool isScalar(const std::string &name) const
+    {
+        for (size_t k = 0; k < scalars_.size(); ++k) {
+            if (scalars_[k].first == name) return true;
+        }
+        return false;
+    }
+
+    static const char *type()
+    {
+        return CLTypeName<T>::get();
+    }
+
+    // the value the reduction starts from
+    T identityValue() const
+    {
+        typedef std::numeric_limits<T> limits;
+        if (op_ == FUSE_SUM) return T();
+        if (op_ == FUSE_MIN) return limits::has_infinity ? limits::infinity() : limits::max();
+        return limits::has_infinity ? -limits::infinity() : limits::lowest();
+    }
+
+    // ... as OpenCL C
+    std::string identity() const
+    {
+        T v = identityValue();
+        if (std::numeric_limits<T>::has_infinity && v == std::numeric_limits<T>::infinity()) return "INFINITY";
+        if (std::numeric_limits<T>::has_infinity && v == -std::numeric_limits<T>::infinity()) return "-INFINITY";
+        // the cast keeps e.g. -2147483648, a long in OpenCL C, an int
+        return std::string("(") + type() + ")" + std::to_string((long long)v);
+    }
+
+    std::string combine(const std::string &a, const std::string &b) const
+    {
+        if (op_ == FUSE_SUM) return a + " + " + b;
+        bool real = std::is_floating_point<T>::value;
+        std::string f = op_ == FUSE_MIN ? (real ? "fmin" : "min") : (real ? "fmax" : "max");
+        return f + "(" + a + ", " + b + ")";
+    }
+
+    T combineHost(T a, T b) const
+    {
+        if (op_ == FUSE_SUM) return a + b;
+        return op_ == FUSE_MIN ? std::min(a, b) : std::max(a, b);
+    }
+
+    void preamble(std::ostringstream &oss) const
+    {
+        if (std::is_same<T, double>::value) {
+            oss << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+        }
+    }
+
+    void param(std::ostringstream &oss, bool &first, const std::string &qualifier, const std::string &rest,
+               const std::string &whole = "") const
+    {
+        oss << (first ? "" : ", ");
+        first = false;
+        if (!whole.empty()) oss << whole;
+        else oss << qualifier << type() << rest;
+    }
+
+    // tree reduction of acc over the work-group into partial[group]
+    void epilogue(std::ostringstream &oss) const
+    {
+        oss << "\tsize_t lid = get_local_id(0);\n";
+        oss << "\tscratch[lid] = acc;\n";
+        oss << "\tbarrier(CLK_LOCAL_MEM_FENCE);\n";
+        oss << "\tfor (size_t s = get_local_size(0) / 2; s > 0; s >>= 1) {\n";
+        oss << "\t\tif (lid < s)\n";
+        oss << "\t\t\tscratch[lid] = " << combine("scratch[lid]", "scratch[lid + s]") << ";\n";
+        oss << "\t\tbarrier(CLK_LOCAL_MEM_FENCE);\n";
+        oss << "\t}\n";
+        oss << "\tif (lid == 0)\n";
+        oss << "\t\tpartial[get_group_id(0)] = scratch[0];\n";
+    }
+
+    // names read by a stage or the reduction
+    std::set<std::string> usedNames() const
+    {
+        std::set<std::string> used;
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            std::set<std::string> refs = fusion_detail::identifiers(stages_[s].expr);
+            used.insert(refs.begin(), refs.end());
+        }
+        if (reduce_) used.insert(reduced_);
+        return used;
+    }
+
+    // arrays some stage assigns
+    std::set<std::string> assigned() const
+    {
+        std::set<std::string> stored;
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            if (find(stages_[s].target)) stored.insert(stages_[s].target);
+        }
+        return stored;
+    }
+
+    // the arrays, then the temporaries
+    std::vector<std::string> unfusedArrays() const
+    {
+        std::vector<std::string> names;
+        for (size_t k = 0; k < arrays_.size(); ++k) {
+            names.push_back(arrays_[k].name);
+        }
+        for (size_t s = 0; s < stages_.size(); ++s) {
+            if (std::find(names.begin(), names.end(), stages_[s].target) == names.end()) {
+                names.push_back(stages_[s].target);
+            }
+        }
+        return names;
+    }
+
+    static const cl::Buffer &bufferOf(const std::map<std::string, cl::Buffer> &buffers, const std::string &name)
+    {
+        auto it = buffers.find(name);
+        if (it == buffers.end()) {
+            throw std::invalid_argument("jc::FusedPipeline: no buffer for " + name);
+        }
+        return it->second;
+    }
+
+    static size_t localSize(const cl::Device &device)
+    {
+        size_t local = std::min<size_t>(256, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        // the reductions need a power of two
+        while (local & (local - 1)) local &= local - 1;
+        return local;
+    }
+
+    // nothing to run: the reduction of no element is the identity
+    PipelineRun<T> emptyRun() const
+    {
+        PipelineRun<T> result = PipelineRun<T>();
+        if (reduce_) result.value = identityValue();
+        return result;
+    }
+
+    T readPartials(const TracedQueue &queue, const cl::Buffer &partial) const
+    {
+        std::vector<T> sums(FUSION_GROUPS);
+        queue.enqueueReadBuffer(partial, CL_TRUE, 0, FUSION_GROUPS * sizeof(T), sums.data());
+        T result = sums[0];
+        for (size_t g = 1; g < FUSION_GROUPS; ++g) {
+            result = combineHost(result, sums[g]);
+        }
+        return result;
+    }
+
+    std::vector<Array> arrays_;
+    std::vector<std::pair<std::string, T> > scalars_;
+    std::vector<Stage> stages_;
+    bool reduce_;
+    std::string reduced_;
+    FusionReduce op_;
+};
+
+template <typename T>
+struct FusionBenchmark {
+    PipelineRun<T> fused, unfused;  // the fastest of the repeats
+
+    double speedup() const
+    {
+        return fused.seconds > 0 ? unfused.seconds / fused.seconds : 0;
+    }
+    double trafficRatio() const
+    {
+        return fused.bytes ? (double)unfused.bytes / fused.bytes : 0;
+    }
+};
+
+template <typename T>
+std::ostream &operator<<(std::ostream &os, const FusionBenchmark<T> &b)
+{
+    os << std::fixed << std::setprecision(3)
+       << "unfused: " << b.unfused.kernels << " kernels, " << b.unfused.bytes / 1e6 << " MB, "
+       << 1e3 * b.unfused.seconds << " ms\n"
+       << "fused:   " << b.fused.kernels << " kernel, " << b.fused.bytes / 1e6 << " MB, "
+       << 1e3 * b.fused.seconds << " ms\n"
+       << std::setprecision(2) << "traffic " << b.trafficRatio() << "x less, " << b.speedup() << "x faster";
+    return os << std::defaultfloat << std::setprecision(6);
+}
+
+// Runs the pipeline fused and unfused, repeats times each, restoring the
+// arrays it writes before every run so that all runs see the same data.
+template <typename T>
+FusionBenchmark<T> benchmarkFusion(const FusedPipeline<T> &pipeline, const cl::CommandQueue &queue,
+                                   const std::map<std::string, cl::Buffer> &buffers, size_t n, int repeats = 5)
+{
+    cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+    TracedQueue traced(queue);
+    std::vector<std::pair<cl::Buffer, PooledBuffer> > saved;
+    for (auto it = buffers.begin(); it != buffers.end(); ++it) {
+        PooledBuffer copy = defaultBufferPool().acquire(context, std::max<size_t>(n, 1) * sizeof(T));
+        if (n > 0) traced.enqueueCopyBuffer(it->second, copy, 0, 0, n * sizeof(T));
+        saved.push_back(std::make_pair(it->second, std::move(copy)));
+    }
+    auto restore = [&]() {
+        for (size_t k = 0; k < saved.size() && n > 0; ++k) {
+            traced.enqueueCopyBuffer(saved[k].second, saved[k].first, 0, 0, n * sizeof(T));
+        }
+        queue.finish();
+    };
+
+    FusionBenchmark<T> b;
+    for (int r = 0; r < std::max(repeats, 1); ++r) {
+        restore();
+        PipelineRun<T> u = pipeline.runUnfused(queue, buffers, n);
+        restore();
+        PipelineRun<T> f = pipeline.run(queue, buffers, n);
+        if (r == 0 || u.seconds < b.unfused.seconds) b.unfused = u;
+        if (r == 0 || f.seconds < b.fused.seconds) b.fused = f;
+    }
+    return b;
+}
+
+}
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include <JC/threadPool.hpp>
+
+// Cache-blocked matrix multiplication for row-major data, following the
+// usual Goto/BLIS structure:
+//   - B is packed into kc x NR column panels that stay in L1 during a sweep
+//   - A is packed into MR x kc row panels, one mc x kc block per task (L2)
+//   - a register-blocked MR x NR micro-kernel does the arithmetic
+// The blocks of C are distributed over a ThreadPool.
+
+namespace jc {
+
+namespace gemm_detail {
+
+    // portable micro-kernel: ab = a_panel * b_panel, the compiler vectorizes
+    // the inner loop over NR
+    template <typename T>
+    struct MicroKernel {
+        static const size_t MR = 4;
+        static const size_t NR = 8;
+
+        static void run(size_t kc, const T *a, const T *b, T *ab)
+        {
+            T acc[MR][NR] = {};
+            for (size_t p = 0; p < kc; ++p) {
+                for (size_t i = 0; i < MR; ++i) {
+                    T ai = a[p*MR + i];
+                    for (size_t j = 0; j < NR; ++j) {
+                        acc[i][j] += ai * b[p*NR + j];
+                    }
+                }
+            }
+            for (size_t i = 0; i < MR; ++i) {
+                for (size_t j = 0; j < NR; ++j) {
+                    ab[i*NR + j] = acc[i][j];
+                }
+            }
+        }
+    };
+
+#if defined(__AVX512F__)
+    template <>
+    struct MicroKernel<float> {
+        static const size_t MR = 6;
+        static const size_t NR = 32;
+
+        static void run(size_t kc, const float *a, const float *b, float *ab)
+        {
+            __m512 c[MR][2];
+            for (size_t i = 0; i < MR; ++i) {
+                c[i][0] = _mm512_setzero_ps();
+                c[i][1] = _mm512_setzero_ps();
+            }
+            for (size_t p = 0; p < kc; ++p) {
+                __m512 b0 = _mm512_loadu_ps(b + p*NR);
+                __m512 b1 = _mm512_loadu_ps(b + p*NR + 16);
+                for (size_t i = 0; i < MR; ++i) {
+                    __m512 ai = _mm512_set1_ps(a[p*MR + i]);
+                    c[i][0] = _mm512_fmadd_ps(ai, b0, c[i][0]);
+                    c[i][1] = _mm512_fmadd_ps(ai, b1, c[i][1]);
+                }
+            }
+            for (size_t i = 0; i < MR; ++i) {
+                _mm512_storeu_ps(ab + i*NR, c[i][0]);
+                _mm512_storeu_ps(ab + i*NR + 16, c[i][1]);
+            }
+        }
+    };
+
+    template <>
+    struct MicroKernel<double> {
+        static const size_t MR = 6;
+        static const size_t NR = 16;
+
+        static void run(size_t kc, const double *a, const double *b, double *ab)
+        {
+            __m512d c[MR][2];
+            for (size_t i = 0; i < MR; ++i) {
+                c[i][0] = _mm512_setzero_pd();
+                c[i][1] = _mm512_setzero_pd();
+            }
+            for (size_t p = 0; p < kc; ++p) {
+                __m512d b0 = _mm512_loadu_pd(b + p*NR);
+                __m512d b1 = _mm512_loadu_pd(b + p*NR + 8);
+                for (size_t i = 0; i < MR; ++i) {
+                    __m512d ai = _mm512_set1_pd(a[p*MR + i]);
+                    c[i][0] = _mm512_fmadd_pd(ai, b0, c[i][0]);
+                    c[i][1] = _mm512_fmadd_pd(ai, b1, c[i][1]);
+                }
+            }
+            for (size_t i = 0; i < MR; ++i) {
+                _mm512_storeu_pd(ab + i*NR, c[i][0]);
+                _mm512_storeu_pd(ab + i*NR + 8, c[i][1]);
+            }
+        }
+    };
+#elif defined(__AVX2__) && defined(__FMA__)
+    template <>
+    struct MicroKernel<float> {
+        static const size_t MR = 6;
+        static const size_t NR = 16;
+
+        static void run(size_t kc, const float *a, const float *b, float *ab)
+        {
+            __m256 c[MR][2];
+            for (size_t i = 0; i < MR; ++i) {
+                c[i][0] = _mm256_setzero_ps();
+                c[i][1] = _mm256_setzero_ps();
+            }
+            for (size_t p = 0; p < kc; ++p) {
+                __m256 b0 = _mm256_loadu_ps(b + p*NR);
+                __m256 b1 = _mm256_loadu_ps(b + p*NR + 8);
+                for (size_t i = 0; i < MR; ++i) {
+                    __m256 ai = _mm256_broadcast_ss(a + p*MR + i);
+                    c[i][0] = _mm256_fmadd_ps(ai, b0, c[i][0]);
+                    c[i][1] = _mm256_fmadd_ps(ai, b1, c[i][1]);
+                }
+            }
+            for (size_t i = 0; i < MR; ++i) {
+                _mm256_storeu_ps(ab + i*NR, c[i][0]);
+                _mm256_storeu_ps(ab + i*NR + 8, c[i][1]);
+            }
+        }
+    };
+
+    template <>
+    struct MicroKernel<double> {
+        static const size_t MR = 6;
+        static const size_t NR = 8;
+
+        static void run(size_t kc, const double *a, const double *b, double *ab)
+        {
+            __m256d c[MR][2];
+            for (size_t i = 0; i < MR; ++i) {
+                c[i][0] = _mm256_setzero_pd();
+                c[i][1] = _mm256_setzero_pd();
+            }
+            for (size_t p = 0; p < kc; ++p) {
+                __m256d b0 = _mm256_loadu_pd(b + p*NR);
+                __m256d b1 = _mm256_loadu_pd(b + p*NR + 4);
+                for (size_t i = 0; i < MR; ++i) {
+                    __m256d ai = _mm256_broadcast_sd(a + p*MR + i);
+                    c[i][0] = _mm256_fmadd_pd(ai, b0, c[i][0]);
+                    c[i][1] = _mm256_fmadd_pd(ai, b1, c[i][1]);
+                }
+            }
+            for (size_t i = 0; i < MR; ++i) {
+                _mm256_storeu_pd(ab + i*NR, c[i][0]);
+                _mm256_storeu_pd(ab + i*NR + 4, c[i][1]);
+            }
+        }
+    };
+#endif
+
+    // blocking parameters: KC*NR elements of B fit in L1, MC*KC of A in L2
+    template <typename T>
+    struct Blocking {
+        static const size_t MR = MicroKernel<T>::MR;
+        static const size_t NR = MicroKernel<T>::NR;
+        static const size_t KC = 256;
+        static const size_t MC = MR * 16;
+        static const size_t NC = NR * 128;
+    };
+
+    // packs the mc x kc block of A at (row, col) into MR-row panels,
+    // zero-padding the last panel
+    template <typename T>
+    void packA(const T *A, size_t lda, size_t row, size_t col, size_t mc, size_t kc, T *Ap)
+    {
+        const size_t MR = Blocking<T>::MR;
+        for (size_t ir = 0; ir < mc; ir += MR) {
+            size_t rows = std::min(MR, mc - ir);
+            T *panel = Ap + ir * kc;
+            for (size_t p = 0; p < kc; ++p) {
+                for (size_t i = 0; i < rows; ++i) {
+                    panel[p*MR + i] = A[(row + ir + i) * lda + col + p];
+                }
+                for (size_t i = rows; i < MR; ++i) {
+                    panel[p*MR + i] = T(0);
+                }
+            }
+        }
+    }
+
+    // packs the kc x nc block of B at (row, col) into NR-column panels
+    template <typename T>
+    void packBPanel(const T *B, size_t ldb, size_t row, size_t col, size_t kc, size_t cols, T *panel)
+    {
+        const size_t NR = Blocking<T>::NR;
+        for (size_t p = 0; p < kc; ++p) {
+            const T *src = B + (row + p) * ldb + col;
+            for (size_t j = 0; j < cols; ++j) {
+                panel[p*NR + j] = src[j];
+            }
+            for (size_t j = cols; j < NR; ++j) {
+                panel[p*NR + j] = T(0);
+            }
+        }
+    }
+
+    // C_tile = alpha * ab + beta * C_tile, only the valid rows x cols part
+    template <typename T>
+    void updateTile(const T *ab, size_t rows, size_t cols, T alpha, T beta, T *C, size_t ldc)
+    {
+        const size_t NR = Blocking<T>::NR;
+        for (size_t i = 0; i < rows; ++i) {
+            T *c = C + i * ldc;
+            const T *r = ab + i * NR;
+            if (beta == T(0)) {
+                for (size_t j = 0; j < cols; ++j) c[j] = alpha * r[j];
+            }
+            else {
+                for (size_t j = 0; j < cols; ++j) c[j] = alpha * r[j] + beta * c[j];
+            }
+        }
+    }
+
+    template <typename T>
+    void scale(size_t m, size_t n, T beta, T *C, size_t ldc)
+    {
+        for (size_t i = 0; i < m; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                C[i*ldc + j] = beta == T(0) ? T(0) : beta * C[i*ldc + j];
+            }
+        }
+    }
+
+// packing buffer for A of the calling thread, reused by every task it runs
+template <typename T>
+T *threadPackBuffer(size_t size)
+{
+    static thread_local std::vector<T> buffer;
+    if (buffer.size() < size) {
+        buffer.resize(size);
+    }
+    return buffer.data();
+}
+
+} // namespace gemm_detail
+
+// C = alpha * A * B + beta * C with A m x k, B k x n and C m x n, all row-major
+// with leading dimensions lda, ldb and ldc. C must not overlap A or B.
+template <typename T>
+void gemm(size_t m, size_t n, size_t k,
+          T alpha, const T *A, size_t lda, const T *B, size_t ldb,
+          T beta, T *C, size_t ldc,
+          ThreadPool &pool = defaultThreadPool())
+{
+    using namespace gemm_detail;
+    // local copies, std::min takes its arguments by reference
+    const size_t MR = Blocking<T>::MR, NR = Blocking<T>::NR;
+    const size_t KC = Blocking<T>::KC, MC = Blocking<T>::MC, NC = Blocking<T>::NC;
+
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0 || alpha == T(0)) {
+        scale(m, n, beta, C, ldc);
+        return;
+    }
+
+    std::vector<T> Bp(KC * ((std::min(n, NC) + NR - 1) / NR) * NR);
+
+    for (size_t jc = 0; jc < n; jc += NC) {
+        size_t nc = std::min(NC, n - jc);
+        size_t nbrPanels = (nc + NR - 1) / NR;
+
+        for (size_t pc = 0; pc < k; pc += KC) {
+            size_t kc = std::min(KC, k - pc);
+            T betaBlock = pc == 0 ? beta : T(1);
+
+            pool.parallelFor(nbrPanels, [&](size_t panel) {
+                size_t jr = panel * NR;
+                packBPanel(B, ldb, pc, jc + jr, kc, std::min(NR, nc - jr), &Bp[jr * kc]);
+            });
+
+            // split the C block into (row block x panel group) tasks so that
+            // narrow-but-wide products still keep every thread busy
+            size_t rowBlocks = (m + MC - 1) / MC;
+            size_t panelGroups = (2 * pool.size() + rowBlocks - 1) / rowBlocks;
+            panelGroups = std::max<size_t>(1, std::min(panelGroups, nbrPanels));
+            size_t panelsPerGroup = (nbrPanels + panelGroups - 1) / panelGroups;
+            panelGroups = (nbrPanels + panelsPerGroup - 1) / panelsPerGroup;
+
+            pool.parallelFor(rowBlocks * panelGroups, [&](size_t task) {
+                size_t ic = (task / panelGroups) * MC;
+                size_t firstPanel = (task % panelGroups) * panelsPerGroup;
+                size_t lastPanel = std::min(nbrPanels, firstPanel + panelsPerGroup);
+                size_t mc = std::min(MC, m - ic);
+
+                T *Ap = threadPackBuffer<T>(MC * KC);
+                T ab[MR * NR];
+                packA(A, lda, ic, pc, mc, kc, Ap);
+
+                for (size_t panel = firstPanel; panel < lastPanel; ++panel) {
+                    size_t jr = panel * NR;
+                    size_t cols = std::min(NR, nc - jr);
+                    for (size_t ir = 0; ir < mc; ir += MR) {
+                        size_t rows = std::min(MR, mc - ir);
+                        MicroKernel<T>::run(kc, &Ap[ir * kc], &Bp[jr * kc], ab);
+                        updateTile(ab, rows, cols, alpha, betaBlock,
+                                   C + (ic + ir) * ldc + jc + jr, ldc);
+                    }
+                }
+            });
+        }
+    }
+}
+
+// C = A * B for contiguous row-major operands
+template <typename T>
+void gemm(size_t m, size_t n, size_t k, const T *A, const T *B, T *C)
+{
+    gemm<T>(m, n, k, T(1), A, k, B, n, T(0), C, n);
+}
+
+}
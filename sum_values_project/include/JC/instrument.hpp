@@ -0,0 +1,349 @@
+#pragma once
+
+// Scoped timers and counters for host hot paths:
+//
+//     void acquire()
+//     {
+//         JC_TIMED_SCOPE("pool acquire");     // time from here to the end of the scope
+//         JC_COUNT("pool bytes", bytes);      // a value to histogram
+//         ...
+//     }
+//     jc::instrumentation().report(std::cout);
+//
+// An event costs a time stamp counter read and an update of the calling
+// thread's own histogram of the site (count, sum, min, max and power-of-two
+// buckets): no lock, no shared cache line with other threads, and nothing
+// to drain, so no event is ever lost. snapshot() and report() merge the
+// histograms of all threads. Building with JC_INSTRUMENTATION=0 (CMake
+// option JC_INSTRUMENTATION) turns the macros into nothing.
+
+#ifndef JC_INSTRUMENTATION
+#define JC_INSTRUMENTATION 1
+#endif
+
+#define JC_INSTRUMENT_CAT2(a, b) a##b
+#define JC_INSTRUMENT_CAT(a, b) JC_INSTRUMENT_CAT2(a, b)
+
+#if JC_INSTRUMENTATION
+
+#define JC_TIMED_SCOPE(name)                                                                        \
+    static const unsigned int JC_INSTRUMENT_CAT(jcSite, __LINE__) =                                 \
+        ::jc::instrumentation().site(name, ::jc::InstrumentSite::TIMER);                            \
+    ::jc::ScopedTimer JC_INSTRUMENT_CAT(jcTimer, __LINE__)(JC_INSTRUMENT_CAT(jcSite, __LINE__))
+
+#define JC_COUNT(name, value)                                                                       \
+    do {                                                                                            \
+        static const unsigned int jcSite = ::jc::instrumentation().site(name, ::jc::InstrumentSite::COUNTER); \
+        ::jc::instrument_detail::record(jcSite, (uint64_t)(value));                                 \
+    } while (0)
+
+#else
+
+#define JC_TIMED_SCOPE(name) do {} while (0)
+#define JC_COUNT(name, value) do {} while (0)
+
+#endif
+
+#if JC_INSTRUMENTATION
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <JC/perfCounters.hpp>
+
+namespace jc {
+
+struct InstrumentSite {
+    enum Kind { TIMER, COUNTER };
+};
+
+// the merged statistics of one site
+struct SiteStats {
+    static const int BUCKETS = 65;  // bucket b holds values in [2^(b-1), 2^b), bucket 0 the zeros
+
+    std::string name;
+    InstrumentSite::Kind kind;
+    uint64_t count;
+    uint64_t sum;               // ns for timers
+    uint64_t min, max;
+    uint64_t buckets[BUCKETS];
+
+    double mean() const
+    {
+        return count ? (double)sum / count : 0;
+    }
+
+    // upper bound of the bucket holding the q-quantile, 0 <= q <= 1
+    uint64_t quantile(double q) const
+    {
+        uint64_t rank = (uint64_t)(q * count), seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen > rank || seen == count) {
+                return b == 0 ? 0 : std::min(max, b == 64 ? ~(uint64_t)0 : ((uint64_t)1 << b) - 1);
+            }
+        }
+        return max;
+    }
+};
+
+namespace instrument_detail {
+
+const size_t MAX_SITES = 256;
+
+inline int bucket(uint64_t v)
+{
+    int b = 0;
+    while (v) {
+        ++b;
+        v >>= 1;
+    }
+    return b;
+}
+
+// the histogram of one site in one thread. Only the owning thread writes,
+// so an update is a relaxed load and store per field, not an atomic
+// read-modify-write; snapshot() may read a field one event behind.
+struct Cell {
+    Cell() : count(0), sum(0), min(~(uint64_t)0), max(0)
+    {
+        for (int b = 0; b < SiteStats::BUCKETS; ++b) buckets[b].store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> count, sum, min, max;
+    std::atomic<uint64_t> buckets[SiteStats::BUCKETS];
+
+    static void bump(std::atomic<uint64_t> &field, uint64_t by)
+    {
+        field.store(field.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    void add(uint64_t v)
+    {
+        bump(count, 1);
+        bump(sum, v);
+        if (v < min.load(std::memory_order_relaxed)) min.store(v, std::memory_order_relaxed);
+        if (v > max.load(std::memory_order_relaxed)) max.store(v, std::memory_order_relaxed);
+        bump(buckets[bucket(v)], 1);
+    }
+
+    void mergeInto(SiteStats &st) const
+    {
+        st.count += count.load(std::memory_order_relaxed);
+        st.sum += sum.load(std::memory_order_relaxed);
+        st.min = std::min(st.min, min.load(std::memory_order_relaxed));
+        st.max = std::max(st.max, max.load(std::memory_order_relaxed));
+        for (int b = 0; b < SiteStats::BUCKETS; ++b) st.buckets[b] += buckets[b].load(std::memory_order_relaxed);
+    }
+};
+
+// the cells of one thread, one per site, allocated on the site's first
+// event in the thread
+struct Table {
+    explicit Table(double ns) : nsPerTick(ns)
+    {
+        for (size_t s = 0; s < MAX_SITES; ++s) cells[s].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~Table()
+    {
+        for (size_t s = 0; s < MAX_SITES; ++s) delete cells[s].load(std::memory_order_relaxed);
+    }
+
+    Table(const Table &) = delete;
+    Table& operator=(const Table &) = delete;
+
+    void add(uint32_t site, uint64_t value)
+    {
+        Cell *cell = cells[site].load(std::memory_order_relaxed);
+        if (!cell) {
+            cell = new Cell();
+            cells[site].store(cell, std::memory_order_release);
+        }
+        cell->add(value);
+    }
+
+    const double nsPerTick;     // TSC ticks to ns for timers
+    std::atomic<Cell*> cells[MAX_SITES];
+};
+
+Table &threadTable();
+
+inline void record(uint32_t site, uint64_t value)
+{
+    threadTable().add(site, value);
+}
+
+inline uint64_t ticks()
+{
+    if (perf_detail::hasTsc()) {
+        return perf_detail::tsc();
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+class Instrumentation {
+public:
+    // TSC ticks per ns are measured once, over a millisecond, when the
+    // first site registers
+    Instrumentation()
+        : nsPerTick_(perf_detail::hasTsc() ? calibrate() : 1)
+    {
+    }
+
+    Instrumentation(const Instrumentation &) = delete;
+    Instrumentation& operator=(const Instrumentation &) = delete;
+
+    // id of the site called name, registered on first use
+    unsigned int site(const std::string &name, InstrumentSite::Kind kind)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t s = 0; s < stats_.size(); ++s) {
+            if (stats_[s].name == name && stats_[s].kind == kind) return (unsigned int)s;
+        }
+        if (stats_.size() == instrument_detail::MAX_SITES) {
+            throw std::length_error("jc::Instrumentation: too many sites");
+        }
+        SiteStats st = SiteStats();
+        st.name = name;
+        st.kind = kind;
+        st.min = ~(uint64_t)0;
+        stats_.push_back(st);
+        return (unsigned int)(stats_.size() - 1);
+    }
+
+    std::shared_ptr<instrument_detail::Table> addTable()
+    {
+        std::shared_ptr<instrument_detail::Table> table = std::make_shared<instrument_detail::Table>(nsPerTick_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        tables_.push_back(table);
+        return table;
+    }
+
+    // folds the table of an exiting thread into the totals
+    void retire(const std::shared_ptr<instrument_detail::Table> &table)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        merge(*table, stats_);
+        tables_.erase(std::remove(tables_.begin(), tables_.end(), table), tables_.end());
+    }
+
+    // the statistics of every site, merged over all threads
+    std::vector<SiteStats> snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<SiteStats> stats = stats_;
+        for (size_t t = 0; t < tables_.size(); ++t) {
+            merge(*tables_[t], stats);
+        }
+        return stats;
+    }
+
+    void report(std::ostream &os)
+    {
+        std::vector<SiteStats> stats = snapshot();
+        os << "    ***** Site *****             | count     | mean      | p50 <=    | p99 <=    | max       |\n";
+        for (size_t s = 0; s < stats.size(); ++s) {
+            const SiteStats &st = stats[s];
+            if (!st.count) continue;
+            const char *unit = st.kind == InstrumentSite::TIMER ? " ns" : "   ";
+            os << std::left << std::setw(32) << st.name.substr(0, 32) << " | " << std::right
+               << std::setw(9) << st.count << " | "
+               << std::fixed << std::setprecision(0) << std::setw(6) << st.mean() << unit << " | "
+               << std::setw(6) << st.quantile(0.5) << unit << " | "
+               << std::setw(6) << st.quantile(0.99) << unit << " | "
+               << std::setw(6) << st.max << unit << " |\n";
+        }
+        os << std::defaultfloat << std::setprecision(6);
+    }
+
+private:
+    static double calibrate()
+    {
+        uint64_t t0 = instrument_detail::ticks();
+        std::chrono::steady_clock::time_point c0 = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - c0).count();
+        return ns / std::max<uint64_t>(instrument_detail::ticks() - t0, 1);
+    }
+
+    // with mutex_ held
+    static void merge(const instrument_detail::Table &table, std::vector<SiteStats> &stats)
+    {
+        for (size_t s = 0; s < stats.size(); ++s) {
+            const instrument_detail::Cell *cell = table.cells[s].load(std::memory_order_acquire);
+            if (cell) cell->mergeInto(stats[s]);
+        }
+    }
+
+    std::mutex mutex_;
+    const double nsPerTick_;
+    std::vector<SiteStats> stats_;  // every site, with the events of exited threads
+    std::vector<std::shared_ptr<instrument_detail::Table> > tables_;
+};
+
+// process-wide instrumentation
+inline Instrumentation& instrumentation()
+{
+    static Instrumentation instance;
+    return instance;
+}
+
+namespace instrument_detail {
+
+// registers the table of a thread on its first event, retires it at thread exit
+struct TableOwner {
+    TableOwner() : table(instrumentation().addTable()) {}
+    ~TableOwner()
+    {
+        instrumentation().retire(table);
+    }
+    std::shared_ptr<Table> table;
+};
+
+inline Table &threadTable()
+{
+    thread_local TableOwner owner;
+    return *owner.table;
+}
+
+}
+
+// records the time from its construction to its destruction under site
+class ScopedTimer {
+public:
+    // the table is looked up first so that registering it is not timed
+    explicit ScopedTimer(unsigned int site)
+        : table_(instrument_detail::threadTable()), site_(site), start_(instrument_detail::ticks())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        table_.add(site_, (uint64_t)((instrument_detail::ticks() - start_) * table_.nsPerTick));
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer& operator=(const ScopedTimer &) = delete;
+
+private:
+    instrument_detail::Table &table_;
+    unsigned int site_;
+    uint64_t start_;
+};
+
+}
+
+#endif
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/trace.hpp>
+
+// A kernel with its argument types fixed at compile time, called like a
+// function:
+//
+//     jc::KernelFn<cl::Buffer, cl::Buffer, cl_float, cl_ulong> saxpy(program, "saxpy");
+//     for (...) {
+//         saxpy(queue, cl::NDRange(global), cl::NDRange(256), x, y, a, (cl_ulong)len);
+//     }
+//
+// Construction checks the number of arguments against the kernel and, when
+// the program was built with -cl-kernel-arg-info, the type name and address
+// space of each one; a mismatch throws std::invalid_argument. The last value
+// of every argument is kept and clSetKernelArg is only called for the ones
+// that changed, so in the loop above only len is set after the first call.
+// That assumes the KernelFn is the only one setting the arguments of its
+// cl::Kernel (copies of a cl::Kernel share them). Buffers are compared by
+// handle; the KernelFn holds a reference to the last one, so its handle
+// cannot be reused by a new buffer in the meantime.
+
+namespace jc {
+
+// size of a __local argument, set with clSetKernelArg(.., bytes, NULL)
+struct LocalMemory {
+    explicit LocalMemory(size_t bytes = 0) : bytes(bytes) {}
+    size_t bytes;
+};
+
+// OpenCL C name of a host argument type, NULL when it is not checked
+template <typename T>
+struct KernelArgType {
+    static const char *name() { return NULL; }
+};
+
+#define JC_KERNEL_ARG_TYPE(T, N) \
+    template <> struct KernelArgType<T> { static const char *name() { return N; } }
+
+JC_KERNEL_ARG_TYPE(cl_char, "char");
+JC_KERNEL_ARG_TYPE(cl_uchar, "uchar");
+JC_KERNEL_ARG_TYPE(cl_short, "short");
+JC_KERNEL_ARG_TYPE(cl_ushort, "ushort");
+JC_KERNEL_ARG_TYPE(cl_int, "int");
+JC_KERNEL_ARG_TYPE(cl_uint, "uint");
+JC_KERNEL_ARG_TYPE(cl_long, "long");
+JC_KERNEL_ARG_TYPE(cl_ulong, "ulong");
+JC_KERNEL_ARG_TYPE(cl_float, "float");
+JC_KERNEL_ARG_TYPE(cl_double, "double");
+JC_KERNEL_ARG_TYPE(cl_int2, "int2");
+JC_KERNEL_ARG_TYPE(cl_int4, "int4");
+JC_KERNEL_ARG_TYPE(cl_uint2, "uint2");
+JC_KERNEL_ARG_TYPE(cl_uint4, "uint4");
+JC_KERNEL_ARG_TYPE(cl_float2, "float2");
+JC_KERNEL_ARG_TYPE(cl_float4, "float4");
+
+#undef JC_KERNEL_ARG_TYPE
+
+namespace kernel_fn_detail {
+
+enum Kind { VALUE, MEMORY, LOCAL };
+
+template <typename T>
+Kind kindOf()
+{
+    return std::is_base_of<cl::Memory, T>::value ? MEMORY : std::is_same<T, LocalMemory>::value ? LOCAL : VALUE;
+}
+
+// true when v is the value the argument was last set to
+template <typename T>
+typename std::enable_if<std::is_base_of<cl::Memory, T>::value, bool>::type
+same(const T &last, const T &v)
+{
+    return last() == v();
+}
+
+inline bool same(const LocalMemory &last, const LocalMemory &v)
+{
+    return last.bytes == v.bytes;
+}
+
+template <typename T>
+typename std::enable_if<!std::is_base_of<cl::Memory, T>::value, bool>::type
+same(const T &last, const T &v)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "jc::KernelFn: kernel arguments are buffers, jc::LocalMemory or plain values");
+    return memcmp(&last, &v, sizeof(T)) == 0;
+}
+
+template <typename T>
+void setArg(cl::Kernel &kernel, cl_uint index, const T &v)
+{
+    kernel.setArg<T>(index, v);
+}
+
+inline void setArg(cl::Kernel &kernel, cl_uint index, const LocalMemory &v)
+{
+    kernel.setArg(index, v.bytes, NULL);
+}
+
+inline std::string argInfoString(std::string s)
+{
+    while (!s.empty() && s.back() == '\0') s.pop_back();
+    return s;
+}
+
+}
+
+template <typename... Args>
+class KernelFn {
+public:
+    KernelFn() : redundant_(0) {}
+
+    explicit KernelFn(const cl::Kernel &kernel)
+        : kernel_(kernel), redundant_(0)
+    {
+        check();
+    }
+
+    KernelFn(const cl::Program &program, const std::string &name)
+        : kernel_(program, name.c_str()), redundant_(0)
+    {
+        check();
+    }
+
+    // sets the arguments that changed since the last call
+    KernelFn& setArgs(const Args&... args)
+    {
+        setFrom<0>(args...);
+        return *this;
+    }
+
+    // sets the arguments and enqueues the kernel
+    cl::Event operator()(const cl::CommandQueue &queue, const cl::NDRange &global, const cl::NDRange &local,
+                         const Args&... args)
+    {
+        setArgs(args...);
+        cl::Event evt;
+        uint64_t enqueued = defaultTracer().now();
+        queue.enqueueNDRangeKernel(kernel_, cl::NullRange, global, local, 0, &evt);
+        defaultTracer().kernel(queue, kernel_, evt, enqueued);
+        return evt;
+    }
+
+    // the kernel with the arguments of the last call, e.g. for jc::runAndTimeKernel
+    const cl::Kernel& kernel() const
+    {
+        return kernel_;
+    }
+
+    // clSetKernelArg calls skipped because the value had not changed
+    size_t redundantSets() const
+    {
+        return redundant_;
+    }
+
+private:
+    // checks the host types against the kernel, as far as the driver tells
+    void check()
+    {
+        const char *types[] = { NULL, KernelArgType<Args>::name()... };
+        kernel_fn_detail::Kind kinds[] = { kernel_fn_detail::VALUE, kernel_fn_detail::kindOf<Args>()... };
+        std::string name = kernel_.getInfo<CL_KERNEL_FUNCTION_NAME>();
+        name = kernel_fn_detail::argInfoString(name);
+        cl_uint count = kernel_.getInfo<CL_KERNEL_NUM_ARGS>();
+        if (count != sizeof...(Args)) {
+            std::ostringstream oss;
+            oss << "jc::KernelFn: " << name << " takes " << count << " arguments, not " << sizeof...(Args);
+            throw std::invalid_argument(oss.str());
+        }
+        for (cl_uint i = 0; i < count; ++i) {
+            std::string type;
+            cl_kernel_arg_address_qualifier space;
+            try {
+                type = kernel_fn_detail::argInfoString(kernel_.getArgInfo<CL_KERNEL_ARG_TYPE_NAME>(i));
+                space = kernel_.getArgInfo<CL_KERNEL_ARG_ADDRESS_QUALIFIER>(i);
+            }
+            catch (cl::Error &) {
+                return;     // built without -cl-kernel-arg-info
+            }
+            const char *expected = NULL;
+            bool ok = true;
+            switch (kinds[i + 1]) {
+            case kernel_fn_detail::MEMORY:
+                ok = (space == CL_KERNEL_ARG_ADDRESS_GLOBAL || space == CL_KERNEL_ARG_ADDRESS_CONSTANT)
+                     && !type.empty() && type.back() == '*';
+                expected = "a __global or __constant pointer";
+                break;
+            case kernel_fn_detail::LOCAL:
+                ok = space == CL_KERNEL_ARG_ADDRESS_LOCAL;
+                expected = "a __local pointer";
+                break;
+            case kernel_fn_detail::VALUE:
+                expected = types[i + 1];
+                ok = space == CL_KERNEL_ARG_ADDRESS_PRIVATE && (!expected || type == expected);
+                if (!expected) expected = "a value";
+                break;
+            }
+            if (!ok) {
+                std::ostringstream oss;
+                oss << "jc::KernelFn: argument " << i << " of " << name << " is " << type
+                    << ", the host passes " << expected;
+                throw std::invalid_argument(oss.str());
+            }
+        }
+    }
+
+    template <size_t I>
+    void setFrom()
+    {
+    }
+
+    template <size_t I, typename T, typename... Rest>
+    void setFrom(const T &v, const Rest&... rest)
+    {
+        if (set_[I] && kernel_fn_detail::same(std::get<I>(last_), v)) {
+            ++redundant_;
+        }
+        else {
+            kernel_fn_detail::setArg(kernel_, (cl_uint)I, v);
+            std::get<I>(last_) = v;
+            set_[I] = true;
+        }
+        setFrom<I + 1>(rest...);
+    }
+
+    cl::Kernel kernel_;
+    std::tuple<Args...> last_;
+    bool set_[sizeof...(Args) + 1] = {};
+    size_t redundant_;
+};
+
+}
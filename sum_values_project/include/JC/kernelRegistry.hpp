@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+// Kernel files compiled into the executable by jc_embed_kernels
+// (src/cmake/EmbedKernels.cmake), optionally with their SPIR-V:
+//
+//     jc_embed_kernels(myApp SOURCES ../array_kernels.ocl SPIRV ../array_kernels.ocl)
+//
+// jc::fileToString returns the embedded text of a file with the same name
+// instead of reading it from disk, and jc::buildProgram creates the program
+// from the SPIR-V when there is one and every device takes it (OpenCL 2.1),
+// so the OpenCL C compiler is not run. SPIR-V is compiled without -D
+// options, so kernels that need them at build time only embed the source.
+// Entries are added during static initialization and only read afterwards.
+
+namespace jc {
+
+struct EmbeddedKernel {
+    const char *source;
+    size_t sourceSize;
+    const unsigned char *spirv;     // NULL when not precompiled
+    size_t spirvSize;
+};
+
+class KernelRegistry {
+public:
+    void add(const std::string &name, const EmbeddedKernel &kernel)
+    {
+        kernels_[name] = kernel;
+    }
+
+    // the kernel file with the file name of path, NULL when it is not embedded
+    const EmbeddedKernel* find(const std::string &path) const
+    {
+        size_t slash = path.find_last_of("/\\");
+        std::map<std::string, EmbeddedKernel>::const_iterator it =
+            kernels_.find(slash == std::string::npos ? path : path.substr(slash + 1));
+        return it == kernels_.end() ? NULL : &it->second;
+    }
+
+    std::vector<std::string> names() const
+    {
+        std::vector<std::string> result;
+        for (std::map<std::string, EmbeddedKernel>::const_iterator it = kernels_.begin(); it != kernels_.end(); ++it) {
+            result.push_back(it->first);
+        }
+        return result;
+    }
+
+private:
+    std::map<std::string, EmbeddedKernel> kernels_;
+};
+
+inline KernelRegistry& kernelRegistry()
+{
+    static KernelRegistry registry;
+    return registry;
+}
+
+// one per embedded file in the generated source
+struct KernelRegistration {
+    KernelRegistration(const char *name, const unsigned char *source, size_t sourceSize,
+                       const unsigned char *spirv = NULL, size_t spirvSize = 0)
+    {
+        EmbeddedKernel kernel = { reinterpret_cast<const char *>(source), sourceSize, spirv, spirvSize };
+        kernelRegistry().add(name, kernel);
+    }
+};
+
+// Builds the embedded SPIR-V of the kernel file path for devices into
+// program. False, with program untouched, when there is none, a device is
+// older than OpenCL 2.1 or the build fails; the caller then compiles the
+// source.
+inline bool buildEmbeddedSpirv(const std::string &path, const cl::Context &context,
+                               const std::vector<cl::Device> &devices, const char *options, cl::Program &program)
+{
+    const EmbeddedKernel *kernel = kernelRegistry().find(path);
+    if (!kernel || !kernel->spirv) {
+        return false;
+    }
+#ifdef CL_VERSION_2_1
+    for (size_t d = 0; d < devices.size(); ++d) {
+        // "OpenCL <major>.<minor> <vendor specific>"
+        std::string version = devices[d].getInfo<CL_DEVICE_VERSION>();
+        if (version.compare(0, 10, "OpenCL 2.1") < 0) {
+            return false;
+        }
+    }
+    cl_int err;
+    cl_program il = clCreateProgramWithIL(context(), kernel->spirv, kernel->spirvSize, &err);
+    if (err != CL_SUCCESS) {
+        return false;
+    }
+    cl::Program result(il);
+    try {
+        result.build(devices, options);
+    }
+    catch (cl::Error &) {
+        return false;
+    }
+    program = result;
+    return true;
+#else
+    (void)context;
+    (void)devices;
+    (void)options;
+    (void)program;
+    return false;
+#endif
+}
+
+}
@@ -5,10 +5,16 @@
 #include <time.h>
 
 #include <algorithm>
+#include <cfloat>
+#include <iostream>
 #include <memory>
-#ifdef _WIN32
 #include <stdexcept>
-#endif
+#include <type_traits>
+
+#include <JC/allocator.hpp>
+#include <JC/gemm.hpp>
+#include <JC/transpose.hpp>
+#include <JC/verify.hpp>
 
 namespace jc {
 
@@ -18,24 +24,60 @@ namespace jc {
             std::runtime_error("jc::Matrix: " + message) {}
     };
 
+    // base of the lazy expression nodes in JC/matrixExpr.hpp
+    template <typename E>
+    class MatrixExpr {
+    public:
+        const E &self() const { return static_cast<const E&>(*this); }
+    };
+
+    // Storage comes from a jc::Allocator (cache-line aligned by default) and
+    // is padded to a whole number of alignment units.
     template <typename T>
     class Matrix {
+        static_assert(std::is_trivially_copyable<T>::value, "jc::Matrix holds plain values only");
+
     public:
+        typedef T value_type;
 
         Matrix();
-        Matrix(unsigned int, unsigned int);
+        Matrix(unsigned int, unsigned int, Allocator &allocator = defaultAllocator());
 
         // copies the data pointed to, not the pointer
-        Matrix(T *data, unsigned int, unsigned int);
+        Matrix(T *data, unsigned int, unsigned int, Allocator &allocator = defaultAllocator());
+        // wraps memory kept alive by owner (e.g. a mapped file, see
+        // JC/dataset.hpp) without copying it; the matrix switches to storage
+        // of its own allocator when it has to grow
+        Matrix(T *data, unsigned int, unsigned int, std::shared_ptr<void> owner);
+        // uses the allocator of other
         Matrix(const Matrix &);
+        // leaves other as an empty 0 x 0 matrix
+        Matrix(Matrix &&other);
         ~Matrix();
 
-        // only assigning to uninitialized matrices is allowed
-        // an uninitialized matrix is one with data_ == nullptr
+        // reuses the existing allocation when it is large enough and keeps
+        // this matrix' allocator
         Matrix& operator=(const Matrix &);
+        Matrix& operator=(Matrix &&other);
+
+        // evaluate a lazy expression such as a * b + c in one pass
+        template <typename E>
+        Matrix(const MatrixExpr<E> &expr);
+        template <typename E>
+        Matrix& operator=(const MatrixExpr<E> &expr);
 
         unsigned int rows() const { return rows_;  }
         unsigned int cols() const { return cols_;  }
+        size_t capacity() const { return capacity_; }
+        Allocator &allocator() const { return *allocator_; }
+        // whether the storage is borrowed from an owner
+        bool borrowed() const { return owner_ != nullptr; }
+
+        // makes room for n elements, keeping the current ones
+        void reserve(size_t n);
+        // changes the shape to m x n; the first min(old, new) elements keep
+        // their row-major values, the rest are uninitialized
+        void resize(unsigned int m, unsigned int n);
         
         T *data() { return data_;  }
         const T *data() const  { return data_; }
@@ -46,6 +88,9 @@ namespace jc {
         void fill(const T& value = 0);
         
         Matrix transpose() const;
+
+        // square matrices are transposed without extra storage
+        void transposeInPlace();
         
         bool isIdentity() const;
 
@@ -57,28 +102,35 @@ namespace jc {
         const_iterator cend()   const { return &data_[rows_*cols_]; }
 
     private:
+        void grow(size_t n, bool preserve);
+        void release();
+
         T *data_;
         unsigned int rows_;
         unsigned int cols_;
+        size_t capacity_;
+        Allocator *allocator_;
+        std::shared_ptr<void> owner_;
     };
 
     // implementation
 
     template <typename T>
-    Matrix<T>::Matrix() : rows_(0), cols_(0), data_(nullptr) {}
+    Matrix<T>::Matrix()
+        : data_(nullptr), rows_(0), cols_(0), capacity_(0), allocator_(&defaultAllocator()) {}
 
     template <typename T>
-    Matrix<T>::Matrix(unsigned int m, unsigned int n)
-        : rows_(m), cols_(n)
+    Matrix<T>::Matrix(unsigned int m, unsigned int n, Allocator &allocator)
+        : data_(nullptr), rows_(m), cols_(n), capacity_(0), allocator_(&allocator)
     {
-        data_ = new T[m*n];
+        grow((size_t)m*n, false);
     }
 
     template <typename T>
-    Matrix<T>::Matrix(T* data, unsigned int m, unsigned int n)
-        : rows_(m), cols_(n)
+    Matrix<T>::Matrix(T* data, unsigned int m, unsigned int n, Allocator &allocator)
+        : data_(nullptr), rows_(m), cols_(n), capacity_(0), allocator_(&allocator)
     {
-        data_ = new T[m*n];
+        grow((size_t)m*n, false);
 #ifdef _WIN32
         std::copy<T*>(data, data + m*n, stdext::make_checked_array_iterator(begin(), m*n));
 #else
@@ -86,43 +138,116 @@ namespace jc {
 #endif
     }
 
+    template <typename T>
+    Matrix<T>::Matrix(T* data, unsigned int m, unsigned int n, std::shared_ptr<void> owner)
+        : data_(data), rows_(m), cols_(n), capacity_((size_t)m*n), allocator_(&defaultAllocator()),
+          owner_(owner)
+    {}
+
     template <typename T>
     Matrix<T>::Matrix(const Matrix<T> &other)
-        : rows_(other.rows_), cols_(other.cols_)
+        : data_(nullptr), rows_(other.rows_), cols_(other.cols_), capacity_(0), allocator_(other.allocator_)
     {
-        data_ = new T[rows_*cols_];
+        grow((size_t)rows_*cols_, false);
 #ifdef _WIN32
         // must be a bug in the windows library
         std::copy<T*>(const_cast<T*>(other.cbegin()), const_cast<T*>(other.cend()),
             stdext::make_checked_array_iterator(begin(), rows_*cols_));
 #else
-        std::copy<T*>(other.cbegin(), other.cend(), begin());
+        std::copy(other.cbegin(), other.cend(), begin());
 #endif
     }
 
+    template <typename T>
+    Matrix<T>::Matrix(Matrix<T> &&other)
+        : data_(other.data_), rows_(other.rows_), cols_(other.cols_), capacity_(other.capacity_),
+          allocator_(other.allocator_), owner_(std::move(other.owner_))
+    {
+        other.data_ = nullptr;
+        other.rows_ = other.cols_ = 0;
+        other.capacity_ = 0;
+    }
+
     template <typename T>
     Matrix<T>& Matrix<T>::operator=(const Matrix<T> &other) 
     {
-        if (data_ != nullptr) {
-            throw MatrixException("Assigning to initialized matrix");
+        if (this == &other) {
+            return *this;
         }
+        grow((size_t)other.rows_*other.cols_, false);
         rows_ = other.rows_;
         cols_ = other.cols_;
-        data_ = new T[other.rows_*other.cols_];
 #ifdef _WIN32
         // must be a bug in the windows library
         std::copy<T*>(const_cast<T*>(other.cbegin()), const_cast<T*>(other.cend()),
             stdext::make_checked_array_iterator(begin(), rows_*cols_));
 #else
-        std::copy<T*>(other.cbegin(), other.cend(), begin());
+        std::copy(other.cbegin(), other.cend(), begin());
 #endif
         return *this;
     }
 
+    template <typename T>
+    Matrix<T>& Matrix<T>::operator=(Matrix<T> &&other)
+    {
+        if (this != &other) {
+            std::swap(data_, other.data_);
+            std::swap(rows_, other.rows_);
+            std::swap(cols_, other.cols_);
+            std::swap(capacity_, other.capacity_);
+            std::swap(allocator_, other.allocator_);
+            std::swap(owner_, other.owner_);
+            other.rows_ = other.cols_ = 0;
+        }
+        return *this;
+    }
+
     template <typename T>
     Matrix<T>::~Matrix()
     {
-        delete[] data_;
+        release();
+    }
+
+    template <typename T>
+    void Matrix<T>::release()
+    {
+        if (owner_) {
+            owner_.reset();
+        }
+        else {
+            allocator_->deallocate(data_, capacity_ * sizeof(T));
+        }
+    }
+
+    template <typename T>
+    void Matrix<T>::grow(size_t n, bool preserve)
+    {
+        if (n <= capacity_ && data_ != nullptr) {
+            return;
+        }
+        size_t capacity = allocator_->paddedCount(n, sizeof(T));
+        T *data = static_cast<T*>(allocator_->allocate(capacity * sizeof(T)));
+        std::fill(data + n, data + capacity, T());
+        if (preserve && data_ != nullptr) {
+            std::copy(data_, data_ + (size_t)rows_*cols_, data);
+        }
+        release();
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    template <typename T>
+    void Matrix<T>::reserve(size_t n)
+    {
+        grow(n, true);
+    }
+
+    template <typename T>
+    void Matrix<T>::resize(unsigned int m, unsigned int n)
+    {
+        grow((size_t)m*n, true);
+        rows_ = m;
+        cols_ = n;
     }
 
     template <typename T>
@@ -144,7 +269,7 @@ namespace jc {
     }
 
     template <typename T>
-    void Matrix<T>::fill(const T &value = 0)
+    void Matrix<T>::fill(const T &value)
     {
         for (auto &e : *this) e = value;
     }
@@ -152,15 +277,23 @@ namespace jc {
     template <typename T>
     Matrix<T> Matrix<T>::transpose() const
     {
-        Matrix<T> t(cols_, rows_);
-        for (unsigned int i = 0; i < rows_; ++i) {
-            for (unsigned int j = 0; j < cols_; ++j) {
-                t.at(j, i) = data_[i*cols_ + j];
-            }
-        }
+        Matrix<T> t;
+        transpose_into(t, *this);
         return t;
     }
 
+    template <typename T>
+    void Matrix<T>::transposeInPlace()
+    {
+        if (rows_ == cols_) {
+            jc::transposeInPlace(data_, rows_);
+            return;
+        }
+        Matrix<T> t;
+        transpose_into(t, *this);
+        *this = std::move(t);
+    }
+
     // uses a comparison method suggested by KNUTH 
     template <typename T>
     bool Matrix<T>::isIdentity() const
@@ -209,48 +342,78 @@ namespace jc {
 
     }
 
-    // used a comparison method suggested by KNUTH 
-    // now uses nearlyEqual
+    // floating point elements may differ by a relative 1e-5 (the bound
+    // nearlyEqual used), integers must be equal
     template <typename T>
     bool operator==(const Matrix<T> &a, const Matrix<T> &b)
     {
-        T e = static_cast<T>(0.00001);
         if (a.rows() != b.rows() || a.cols() != b.cols()) {
             return false;
         }
-        for (unsigned int i = 0; i < a.rows(); ++i) {
-            for (unsigned int j = 0; j < a.cols(); ++j) {
-                T u = a.at(i, j);
-                T v = b.at(i, j);
-                if (!nearlyEqual<T>(u, v, e)) {
-                    std::cerr << "FAILED: @ (";
-                    std::cerr << i << "," << j << "): ";
-                    std::cerr << u << " vs " << v << std::endl;
-                    return false;
-                }
-            }
+        Tolerance tolerance = std::is_floating_point<T>::value ? Tolerance::relative(0.00001)
+                                                               : Tolerance::exact();
+        VerifyResult r = verify(a.data(), b.data(), (size_t)a.rows() * a.cols(), tolerance, 1);
+        if (!r.ok()) {
+            unsigned int i = (unsigned int)(r.first[0] / a.cols());
+            unsigned int j = (unsigned int)(r.first[0] % a.cols());
+            std::cerr << "FAILED: @ (";
+            std::cerr << i << "," << j << "): ";
+            std::cerr << a.data()[r.first[0]] << " vs " << b.data()[r.first[0]] << std::endl;
         }
-        return true;
+        return r.ok();
     }
 
+    // t = transpose of a, reusing the storage of t when it is large enough
     template <typename T>
-    Matrix<T> operator*(const Matrix<T> &a, const Matrix<T> &b)
+    void transpose_into(Matrix<T> &t, const Matrix<T> &a)
+    {
+        if (&t == &a) {
+            t.transposeInPlace();
+            return;
+        }
+        t.resize(a.cols(), a.rows());
+        jc::transpose(a.data(), t.data(), a.rows(), a.cols());
+    }
+
+    // below this many multiply-adds the packing overhead of gemm is not worth it
+    const unsigned long long GEMM_MIN_FLOPS = 32 * 32 * 32;
+
+    // c = a * b, reusing the storage of c when it is large enough.
+    // c may be one of the operands, the product then goes through a temporary.
+    template <typename T>
+    void multiply_into(Matrix<T> &c, const Matrix<T> &a, const Matrix<T> &b)
     {
         if (a.cols() != b.rows()) {
             throw MatrixException("cannot multiply matrices of these dimensions");
         }
+        if (&c == &a || &c == &b) {
+            Matrix<T> product;
+            multiply_into(product, a, b);
+            c = std::move(product);
+            return;
+        }
 
-        Matrix<T> c(a.rows(), b.cols());
-        for (unsigned int i = 0; i < c.rows(); ++i) {
-            for (unsigned int j = 0; j < c.cols(); ++j) {
-                c.at(i, j) = 0;
-                for (unsigned int x = 0; x < a.cols(); ++x) {
-                    c.at(i, j) += a.at(i, x) * b.at(x, j);
+        c.resize(a.rows(), b.cols());
+        unsigned long long flops = (unsigned long long)a.rows() * b.cols() * a.cols();
+        if (flops >= GEMM_MIN_FLOPS) {
+            gemm<T>(a.rows(), b.cols(), a.cols(), a.data(), b.data(), c.data());
+            return;
+        }
+
+        // simple path for tiny matrices, i-k-j order keeps b row-wise
+        const T *pa = a.data();
+        const T *pb = b.data();
+        T *pc = c.data();
+        unsigned int m = a.rows(), n = b.cols(), k = a.cols();
+        std::fill(pc, pc + m*n, T(0));
+        for (unsigned int i = 0; i < m; ++i) {
+            for (unsigned int x = 0; x < k; ++x) {
+                T aix = pa[i*k + x];
+                for (unsigned int j = 0; j < n; ++j) {
+                    pc[i*n + j] += aix * pb[x*n + j];
                 }
             }
         }
-
-        return c;
     }
 
     template <typename T>
@@ -264,4 +427,7 @@ namespace jc {
         }
         return oss;
     }
-}
\ No newline at end of file
+}
+
+// the arithmetic operators (+, -, *, ...) build lazy expressions
+#include <JC/matrixExpr.hpp>
@@ -0,0 +1,81 @@
+#pragma once
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/matrix.hpp>
+
+// Host wrappers for the kernels in matrix_kernels.ocl. The program passed
+// in must have been built from that file. Embedded into the executable with
+//     jc_embed_kernels(myApp SOURCES matrix_kernels.ocl)      (CMake)
+// it is found in the kernel registry (JC/kernelRegistry.hpp), wherever the
+// executable runs from:
+//     cl::Program program = jc::buildProgram("matrix_kernels.ocl", context, device);
+
+namespace jc {
+
+// work-group edge, must match TILE_DIM in matrix_kernels.ocl
+const unsigned int MATRIX_TILE_DIM = 16;
+
+inline cl::NDRange tiledRange(unsigned int width, unsigned int height)
+{
+    const unsigned int t = MATRIX_TILE_DIM;
+    return cl::NDRange((width + t - 1) / t * t, (height + t - 1) / t * t);
+}
+
+// out (cols x rows) = transpose of in (rows x cols)
+inline cl::Event transposeOnDevice(const cl::CommandQueue &queue, const cl::Program &program,
+                                   const cl::Buffer &in, const cl::Buffer &out,
+                                   unsigned int rows, unsigned int cols)
+{
+    cl::Kernel kernel(program, "transpose");
+    kernel.setArg<cl::Buffer>(0, in);
+    kernel.setArg<cl::Buffer>(1, out);
+    kernel.setArg<cl_uint>(2, rows);
+    kernel.setArg<cl_uint>(3, cols);
+
+    cl::Event evt;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, tiledRange(cols, rows),
+                               cl::NDRange(MATRIX_TILE_DIM, MATRIX_TILE_DIM), 0, &evt);
+    return evt;
+}
+
+// transposes the n x n matrix in buffer a in place
+inline cl::Event transposeInPlaceOnDevice(const cl::CommandQueue &queue, const cl::Program &program,
+                                          const cl::Buffer &a, unsigned int n)
+{
+    cl::Kernel kernel(program, "transposeSquareInPlace");
+    kernel.setArg<cl::Buffer>(0, a);
+    kernel.setArg<cl_uint>(1, n);
+
+    cl::Event evt;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, tiledRange(n, n),
+                               cl::NDRange(MATRIX_TILE_DIM, MATRIX_TILE_DIM), 0, &evt);
+    return evt;
+}
+
+// Buffer using the elements of m in place (CL_MEM_USE_HOST_PTR), see the
+// Data version in JC/dataCL.hpp; m must outlive the buffer and not grow.
+template <typename T>
+cl::Buffer hostPtrBuffer(const cl::Context &context, Matrix<T> &m, cl_mem_flags flags = CL_MEM_READ_ONLY)
+{
+    return cl::Buffer(context, flags | CL_MEM_USE_HOST_PTR, (size_t)m.rows() * m.cols() * sizeof(T), m.data());
+}
+
+// uploads m, transposes it on the device and reads the result back
+inline Matrix<float> transposeOnDevice(const Matrix<float> &m, const cl::Context &context,
+                                       const cl::CommandQueue &queue, const cl::Program &program)
+{
+    size_t bytes = sizeof(float) * m.rows() * m.cols();
+    Matrix<float> t(m.cols(), m.rows());
+    if (bytes == 0) {
+        return t;
+    }
+    cl::Buffer in(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, const_cast<float*>(m.data()));
+    cl::Buffer out(context, CL_MEM_WRITE_ONLY, bytes);
+    transposeOnDevice(queue, program, in, out, m.rows(), m.cols());
+    queue.enqueueReadBuffer(out, CL_TRUE, 0, bytes, t.data());
+    return t;
+}
+
+}
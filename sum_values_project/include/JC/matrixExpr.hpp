@@ -0,0 +1,490 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <JC/matrix.hpp>
+#include <JC/threadPool.hpp>
+
+// Lazy matrix arithmetic. The operators below do not compute anything,
+// they build a small tree of expression nodes that is evaluated in a single
+// pass when it is assigned to a Matrix:
+//
+//     jc::Matrix<float> z;
+//     z = alpha * a * x + y;   // one gemm with beta = 1, no temporaries
+//     z = 2.0f * a + b - c;    // one fused elementwise loop
+//
+// Nodes hold references to the matrices they read, so an expression must not
+// outlive its operands (don't keep one in an 'auto' variable past the
+// statement that uses it).
+//
+// Every node provides
+//     rows(), cols()           shape of the result
+//     operator[](i)            i-th element in row-major order
+//     prepare()                evaluates nested matrix products into caches
+//     clSource(args)           OpenCL C expression for element i (see matrixExprCL.hpp)
+
+namespace jc {
+
+    // buffers and scalars referenced by a generated OpenCL kernel
+    template <typename T>
+    struct ExprCLArgs {
+        std::vector<const Matrix<T> *> matrices;
+        std::vector<T> scalars;
+
+        std::string matrix(const Matrix<T> &m)
+        {
+            size_t k = 0;
+            while (k < matrices.size() && matrices[k] != &m) ++k;
+            if (k == matrices.size()) matrices.push_back(&m);
+            return "m" + std::to_string(k) + "[i]";
+        }
+
+        std::string scalar(T value)
+        {
+            scalars.push_back(value);
+            return "s" + std::to_string(scalars.size() - 1);
+        }
+    };
+
+    // leaf: an existing matrix
+    template <typename T>
+    class MatrixRef : public MatrixExpr<MatrixRef<T> > {
+    public:
+        typedef T value_type;
+
+        explicit MatrixRef(const Matrix<T> &m) : m_(m) {}
+
+        unsigned int rows() const { return m_.rows(); }
+        unsigned int cols() const { return m_.cols(); }
+        T operator[](size_t i) const { return m_.data()[i]; }
+        void prepare() const {}
+        const Matrix<T> &matrix() const { return m_; }
+
+        std::string clSource(ExprCLArgs<T> &args) const { return args.matrix(m_); }
+
+    private:
+        const Matrix<T> &m_;
+    };
+
+    // alpha * e
+    template <typename E>
+    class ScaleExpr : public MatrixExpr<ScaleExpr<E> > {
+    public:
+        typedef typename E::value_type value_type;
+
+        ScaleExpr(value_type alpha, const E &e) : alpha_(alpha), e_(e) {}
+
+        unsigned int rows() const { return e_.rows(); }
+        unsigned int cols() const { return e_.cols(); }
+        value_type operator[](size_t i) const { return alpha_ * e_[i]; }
+        void prepare() const { e_.prepare(); }
+        value_type alpha() const { return alpha_; }
+        const E &operand() const { return e_; }
+
+        std::string clSource(ExprCLArgs<value_type> &args) const
+        {
+            std::string s = args.scalar(alpha_);
+            return "(" + s + " * " + e_.clSource(args) + ")";
+        }
+
+    private:
+        value_type alpha_;
+        E e_;
+    };
+
+    // elementwise binary operations
+    struct AddOp {
+        template <typename T> static T apply(T a, T b) { return a + b; }
+        static const char *cl() { return " + "; }
+    };
+    struct SubOp {
+        template <typename T> static T apply(T a, T b) { return a - b; }
+        static const char *cl() { return " - "; }
+    };
+    struct MulOp {
+        template <typename T> static T apply(T a, T b) { return a * b; }
+        static const char *cl() { return " * "; }
+    };
+    struct DivOp {
+        template <typename T> static T apply(T a, T b) { return a / b; }
+        static const char *cl() { return " / "; }
+    };
+
+    template <typename L, typename R, typename Op>
+    class BinaryExpr : public MatrixExpr<BinaryExpr<L, R, Op> > {
+    public:
+        typedef typename L::value_type value_type;
+        static_assert(std::is_same<value_type, typename R::value_type>::value,
+                      "jc::Matrix: mixing element types in one expression");
+
+        BinaryExpr(const L &l, const R &r) : l_(l), r_(r)
+        {
+            if (l.rows() != r.rows() || l.cols() != r.cols()) {
+                throw MatrixException("elementwise operation on matrices of different dimensions");
+            }
+        }
+
+        unsigned int rows() const { return l_.rows(); }
+        unsigned int cols() const { return l_.cols(); }
+        value_type operator[](size_t i) const { return Op::apply(l_[i], r_[i]); }
+        void prepare() const { l_.prepare(); r_.prepare(); }
+        const L &left() const { return l_; }
+        const R &right() const { return r_; }
+
+        std::string clSource(ExprCLArgs<value_type> &args) const
+        {
+            std::string l = l_.clSource(args);
+            return "(" + l + Op::cl() + r_.clSource(args) + ")";
+        }
+
+    private:
+        L l_;
+        R r_;
+    };
+
+    // elementwise unary operations; cl<T>() is the OpenCL C function for
+    // operands of type T
+    struct NegOp {
+        template <typename T> static T apply(T a) { return -a; }
+        template <typename T> static const char *cl() { return "-"; }
+    };
+    struct AbsOp {
+        template <typename T> static T apply(T a) { return std::abs(a); }
+        template <typename T> static const char *cl() { return std::is_integral<T>::value ? "abs" : "fabs"; }
+    };
+    struct SqrtOp {
+        template <typename T> static T apply(T a) { return std::sqrt(a); }
+        template <typename T> static const char *cl()
+        {
+            static_assert(std::is_floating_point<T>::value, "jc::Matrix: OpenCL C has no sqrt of integers");
+            return "sqrt";
+        }
+    };
+    struct ExpOp {
+        template <typename T> static T apply(T a) { return std::exp(a); }
+        template <typename T> static const char *cl()
+        {
+            static_assert(std::is_floating_point<T>::value, "jc::Matrix: OpenCL C has no exp of integers");
+            return "exp";
+        }
+    };
+
+    template <typename E, typename Op>
+    class UnaryExpr : public MatrixExpr<UnaryExpr<E, Op> > {
+    public:
+        typedef typename E::value_type value_type;
+
+        explicit UnaryExpr(const E &e) : e_(e) {}
+
+        unsigned int rows() const { return e_.rows(); }
+        unsigned int cols() const { return e_.cols(); }
+        value_type operator[](size_t i) const { return Op::apply(e_[i]); }
+        void prepare() const { e_.prepare(); }
+
+        std::string clSource(ExprCLArgs<value_type> &args) const
+        {
+            return std::string(Op::template cl<value_type>()) + "(" + e_.clSource(args) + ")";
+        }
+
+    private:
+        E e_;
+    };
+
+    // l * r as a matrix product. On its own (or added to another expression)
+    // it is evaluated by gemm directly into the destination; nested deeper it
+    // is computed once into a cache by prepare().
+    template <typename L, typename R>
+    class MatMulExpr : public MatrixExpr<MatMulExpr<L, R> > {
+    public:
+        typedef typename L::value_type value_type;
+        static_assert(std::is_same<value_type, typename R::value_type>::value,
+                      "jc::Matrix: mixing element types in one expression");
+
+        MatMulExpr(const L &l, const R &r) : l_(l), r_(r)
+        {
+            if (l.cols() != r.rows()) {
+                throw MatrixException("cannot multiply matrices of these dimensions");
+            }
+        }
+
+        unsigned int rows() const { return l_.rows(); }
+        unsigned int cols() const { return r_.cols(); }
+        value_type operator[](size_t i) const { return cache_.data()[i]; }
+        void prepare() const { gemmInto(cache_, value_type(0)); }
+        const L &left() const { return l_; }
+        const R &right() const { return r_; }
+
+        std::string clSource(ExprCLArgs<value_type> &args) const { return args.matrix(cache_); }
+
+        // c = l * r + beta * c, c must already have the right shape if beta != 0
+        void gemmInto(Matrix<value_type> &c, value_type beta) const;
+
+        // true if computing the product reads m
+        bool reads(const Matrix<value_type> &m) const;
+
+    private:
+        L l_;
+        R r_;
+        mutable Matrix<value_type> cache_;
+    };
+
+    // ** gemm operands **
+    // A plain matrix or a scaled matrix can be handed to gemm as is;
+    // anything else is evaluated into a temporary first.
+
+    template <typename T>
+    struct GemmOperand {
+        const T *data;
+        T alpha;
+        Matrix<T> storage;
+    };
+
+    template <typename E>
+    void toGemmOperand(const E &e, GemmOperand<typename E::value_type> &op)
+    {
+        op.storage = e;
+        op.data = op.storage.data();
+        op.alpha = typename E::value_type(1);
+    }
+
+    template <typename T>
+    void toGemmOperand(const MatrixRef<T> &e, GemmOperand<T> &op)
+    {
+        op.data = e.matrix().data();
+        op.alpha = T(1);
+    }
+
+    template <typename T>
+    void toGemmOperand(const ScaleExpr<MatrixRef<T> > &e, GemmOperand<T> &op)
+    {
+        op.data = e.operand().matrix().data();
+        op.alpha = e.alpha();
+    }
+
+    template <typename E, typename T>
+    bool exprReads(const E &, const Matrix<T> &) { return true; }  // conservative
+    template <typename T>
+    bool exprReads(const MatrixRef<T> &e, const Matrix<T> &m) { return &e.matrix() == &m; }
+    template <typename T>
+    bool exprReads(const ScaleExpr<MatrixRef<T> > &e, const Matrix<T> &m) { return &e.operand().matrix() == &m; }
+
+    template <typename L, typename R>
+    bool MatMulExpr<L, R>::reads(const Matrix<value_type> &m) const
+    {
+        return exprReads(l_, m) || exprReads(r_, m);
+    }
+
+    template <typename L, typename R>
+    void MatMulExpr<L, R>::gemmInto(Matrix<value_type> &c, value_type beta) const
+    {
+        GemmOperand<value_type> a, b;
+        toGemmOperand(l_, a);
+        toGemmOperand(r_, b);
+        if (beta == value_type(0)) {
+            c.resize(rows(), cols());
+        }
+        size_t k = l_.cols();
+        gemm<value_type>(rows(), cols(), k, a.alpha * b.alpha, a.data, k, b.data, cols(),
+                         beta, c.data(), cols());
+    }
+
+    // ** evaluation **
+
+    // below this many elements the fused loop runs on the calling thread
+    const size_t EXPR_PARALLEL_MIN = 1 << 16;
+
+    // generic case: one fused elementwise pass
+    template <typename T, typename E>
+    void evaluate_into(Matrix<T> &dst, const E &e)
+    {
+        e.prepare();
+        dst.resize(e.rows(), e.cols());
+        size_t n = (size_t)e.rows() * e.cols();
+        T *d = dst.data();
+        auto loop = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                d[i] = e[i];
+            }
+        };
+        if (n < EXPR_PARALLEL_MIN) {
+            loop(0, n);
+        }
+        else {
+            defaultThreadPool().parallelForRange(n, EXPR_PARALLEL_MIN / 4, loop);
+        }
+    }
+
+    // the gemm-based cases below write into dst directly; when the product
+    // reads dst itself they go through a fresh temporary instead
+
+    // dst = l * r
+    template <typename T, typename L, typename R>
+    void evaluate_into(Matrix<T> &dst, const MatMulExpr<L, R> &e)
+    {
+        if (e.reads(dst)) {
+            Matrix<T> product;
+            e.gemmInto(product, T(0));
+            dst = std::move(product);
+            return;
+        }
+        e.gemmInto(dst, T(0));
+    }
+
+    // dst = c + l * r: c is written to dst first and gemm accumulates on it
+    template <typename T, typename C, typename L, typename R>
+    void addProduct(Matrix<T> &dst, const C &c, const MatMulExpr<L, R> &p)
+    {
+        if (p.reads(dst)) {
+            Matrix<T> result;
+            evaluate_into(result, c);
+            p.gemmInto(result, T(1));
+            dst = std::move(result);
+            return;
+        }
+        evaluate_into(dst, c);
+        p.gemmInto(dst, T(1));
+    }
+
+    template <typename T, typename L, typename R, typename C>
+    void evaluate_into(Matrix<T> &dst, const BinaryExpr<MatMulExpr<L, R>, C, AddOp> &e)
+    {
+        addProduct(dst, e.right(), e.left());
+    }
+
+    template <typename T, typename C, typename L, typename R>
+    void evaluate_into(Matrix<T> &dst, const BinaryExpr<C, MatMulExpr<L, R>, AddOp> &e)
+    {
+        addProduct(dst, e.left(), e.right());
+    }
+
+    template <typename T, typename L1, typename R1, typename L2, typename R2>
+    void evaluate_into(Matrix<T> &dst, const BinaryExpr<MatMulExpr<L1, R1>, MatMulExpr<L2, R2>, AddOp> &e)
+    {
+        addProduct(dst, e.left(), e.right());
+    }
+
+    template <typename T>
+    template <typename E>
+    Matrix<T>::Matrix(const MatrixExpr<E> &expr)
+        : data_(nullptr), rows_(0), cols_(0), capacity_(0), allocator_(&defaultAllocator())
+    {
+        evaluate_into(*this, expr.self());
+    }
+
+    template <typename T>
+    template <typename E>
+    Matrix<T>& Matrix<T>::operator=(const MatrixExpr<E> &expr)
+    {
+        evaluate_into(*this, expr.self());
+        return *this;
+    }
+
+    // materializes an expression, e.g. to print or compare it
+    template <typename E>
+    Matrix<typename E::value_type> eval(const MatrixExpr<E> &expr)
+    {
+        return Matrix<typename E::value_type>(expr);
+    }
+
+    // ** operators **
+
+    template <typename X>
+    struct ExprOf {
+        typedef X type;
+        static const bool value = std::is_base_of<MatrixExpr<X>, X>::value;
+        static const X &get(const X &x) { return x; }
+    };
+
+    template <typename T>
+    struct ExprOf<Matrix<T> > {
+        typedef MatrixRef<T> type;
+        static const bool value = true;
+        static MatrixRef<T> get(const Matrix<T> &m) { return MatrixRef<T>(m); }
+    };
+
+    template <typename L, typename R, typename Result>
+    struct EnableIfOperands
+        : std::enable_if<ExprOf<L>::value && ExprOf<R>::value, Result> {};
+
+    template <typename X, typename Result>
+    struct EnableIfOperand : std::enable_if<ExprOf<X>::value, Result> {};
+
+#define JC_MATRIX_BINARY_OPERATOR(NAME, OP)                                                   \
+    template <typename L, typename R>                                                         \
+    typename EnableIfOperands<L, R,                                                           \
+        BinaryExpr<typename ExprOf<L>::type, typename ExprOf<R>::type, OP> >::type            \
+    NAME(const L &l, const R &r)                                                              \
+    {                                                                                         \
+        return BinaryExpr<typename ExprOf<L>::type, typename ExprOf<R>::type, OP>(            \
+            ExprOf<L>::get(l), ExprOf<R>::get(r));                                            \
+    }
+
+    JC_MATRIX_BINARY_OPERATOR(operator+, AddOp)
+    JC_MATRIX_BINARY_OPERATOR(operator-, SubOp)
+    // elementwise (Hadamard) product and quotient
+    JC_MATRIX_BINARY_OPERATOR(elementwiseMul, MulOp)
+    JC_MATRIX_BINARY_OPERATOR(elementwiseDiv, DivOp)
+
+#undef JC_MATRIX_BINARY_OPERATOR
+
+#define JC_MATRIX_UNARY_FUNCTION(NAME, OP)                                                    \
+    template <typename X>                                                                     \
+    typename EnableIfOperand<X, UnaryExpr<typename ExprOf<X>::type, OP> >::type               \
+    NAME(const X &x)                                                                          \
+    {                                                                                         \
+        return UnaryExpr<typename ExprOf<X>::type, OP>(ExprOf<X>::get(x));                    \
+    }
+
+    JC_MATRIX_UNARY_FUNCTION(operator-, NegOp)
+    JC_MATRIX_UNARY_FUNCTION(elementwiseAbs, AbsOp)
+    JC_MATRIX_UNARY_FUNCTION(elementwiseSqrt, SqrtOp)
+    JC_MATRIX_UNARY_FUNCTION(elementwiseExp, ExpOp)
+
+#undef JC_MATRIX_UNARY_FUNCTION
+
+    // matrix product
+    template <typename L, typename R>
+    typename EnableIfOperands<L, R,
+        MatMulExpr<typename ExprOf<L>::type, typename ExprOf<R>::type> >::type
+    operator*(const L &l, const R &r)
+    {
+        return MatMulExpr<typename ExprOf<L>::type, typename ExprOf<R>::type>(
+            ExprOf<L>::get(l), ExprOf<R>::get(r));
+    }
+
+    // scaling
+    template <typename X>
+    typename EnableIfOperand<X, ScaleExpr<typename ExprOf<X>::type> >::type
+    operator*(typename ExprOf<X>::type::value_type alpha, const X &x)
+    {
+        return ScaleExpr<typename ExprOf<X>::type>(alpha, ExprOf<X>::get(x));
+    }
+
+    template <typename X>
+    typename EnableIfOperand<X, ScaleExpr<typename ExprOf<X>::type> >::type
+    operator*(const X &x, typename ExprOf<X>::type::value_type alpha)
+    {
+        return ScaleExpr<typename ExprOf<X>::type>(alpha, ExprOf<X>::get(x));
+    }
+
+    template <typename X>
+    typename EnableIfOperand<X, ScaleExpr<typename ExprOf<X>::type> >::type
+    operator/(const X &x, typename ExprOf<X>::type::value_type alpha)
+    {
+        typedef typename ExprOf<X>::type::value_type T;
+        static_assert(std::is_floating_point<T>::value, "jc::Matrix: use elementwiseDiv for integer division");
+        return ScaleExpr<typename ExprOf<X>::type>(T(1) / alpha, ExprOf<X>::get(x));
+    }
+
+    template <typename E>
+    std::ostream& operator<<(std::ostream &oss, const MatrixExpr<E> &e)
+    {
+        return oss << eval(e);
+    }
+
+}
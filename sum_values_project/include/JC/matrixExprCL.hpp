@@ -0,0 +1,146 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/matrix.hpp>
+
+// Evaluation of lazy matrix expressions (JC/matrixExpr.hpp) on an OpenCL
+// device. The elementwise part of the expression is turned into the source
+// of a single kernel, e.g. for z = 2*x + y - c
+//
+//     __kernel void fusedExpr(__global float* out, __global const float* m0,
+//                             __global const float* m1, __global const float* m2,
+//                             float s0, uint n)
+//     {
+//         uint i = get_global_id(0);
+//         if (i < n)
+//             out[i] = (((s0 * m0[i]) + m1[i]) - m2[i]);
+//     }
+//
+// so every input is read once and no intermediate results reach global
+// memory. Matrix products inside the expression are computed on the host
+// first and enter the kernel as an ordinary input.
+
+namespace jc {
+
+template <typename T> struct CLTypeName;
+template <> struct CLTypeName<float>        { static const char *get() { return "float"; } };
+template <> struct CLTypeName<double>       { static const char *get() { return "double"; } };
+template <> struct CLTypeName<int>          { static const char *get() { return "int"; } };
+template <> struct CLTypeName<unsigned int> { static const char *get() { return "uint"; } };
+
+// OpenCL source computing out[i] = expr(i). The matrices and scalars the
+// kernel reads are collected in args, in argument order after 'out'.
+template <typename E>
+std::string fusedKernelSource(const MatrixExpr<E> &expr, ExprCLArgs<typename E::value_type> &args,
+                              const std::string &name = "fusedExpr")
+{
+    typedef typename E::value_type T;
+    const char *t = CLTypeName<T>::get();
+
+    expr.self().prepare();
+    std::string body = expr.self().clSource(args);
+
+    std::ostringstream oss;
+    if (std::is_same<T, double>::value) {
+        oss << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+    }
+    oss << "__kernel void " << name << "(__global " << t << "* out";
+    for (size_t k = 0; k < args.matrices.size(); ++k) {
+        oss << ", __global const " << t << "* m" << k;
+    }
+    for (size_t k = 0; k < args.scalars.size(); ++k) {
+        oss << ", " << t << " s" << k;
+    }
+    oss << ", uint n)\n{\n";
+    oss << "\tuint i = get_global_id(0);\n";
+    oss << "\tif (i < n)\n";
+    oss << "\t\tout[i] = " << body << ";\n";
+    oss << "}\n";
+    return oss.str();
+}
+
+// builds (once per context, device and source) and returns the named kernel;
+// the program is built for device only, so device is part of the key
+inline cl::Kernel cachedKernel(const cl::Context &context, const cl::Device &device,
+                               const std::string &source, const std::string &name)
+{
+    typedef std::tuple<cl_context, cl_device_id, std::string> Key;
+    static std::mutex mutex;
+    static std::map<Key, cl::Program> programs;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Key key(context(), device(), source);
+    auto it = programs.find(key);
+    if (it == programs.end()) {
+        cl::Program::Sources sources;
+        sources.push_back(std::make_pair(source.c_str(), source.size()));
+        cl::Program program(context, sources);
+        std::vector<cl::Device> devices(1, device);
+        try {
+            program.build(devices);
+        }
+        catch (cl::Error &e) {
+            std::string msg;
+            program.getBuildInfo<std::string>(device, CL_PROGRAM_BUILD_LOG, &msg);
+            std::cerr << "Generated kernel failed to compile" << std::endl;
+            std::cerr << "----------------------------------" << std::endl;
+            std::cerr << source << std::endl << msg;
+            throw e;
+        }
+        it = programs.insert(std::make_pair(key, program)).first;
+    }
+    return cl::Kernel(it->second, name.c_str());
+}
+
+// dst = expr, computed by one generated kernel on the device of queue
+template <typename T, typename E>
+void evaluateOnDevice(Matrix<T> &dst, const MatrixExpr<E> &expr,
+                      const cl::Context &context, const cl::CommandQueue &queue)
+{
+    ExprCLArgs<T> args;
+    std::string source = fusedKernelSource(expr, args);
+    const E &e = expr.self();
+    size_t n = (size_t)e.rows() * e.cols();
+    size_t bytes = n * sizeof(T);
+    if (n == 0) {
+        dst.resize(e.rows(), e.cols());
+        return;
+    }
+
+    // inputs are uploaded before dst is touched, dst may be one of them
+    std::vector<cl::Buffer> inputs;
+    for (size_t k = 0; k < args.matrices.size(); ++k) {
+        T *data = const_cast<T*>(args.matrices[k]->data());
+        inputs.push_back(cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, data));
+    }
+    dst.resize(e.rows(), e.cols());
+    cl::Buffer out(context, CL_MEM_WRITE_ONLY, bytes);
+
+    cl::Kernel kernel = cachedKernel(context, queue.getInfo<CL_QUEUE_DEVICE>(), source, "fusedExpr");
+    cl_uint arg = 0;
+    kernel.setArg<cl::Buffer>(arg++, out);
+    for (size_t k = 0; k < inputs.size(); ++k) {
+        kernel.setArg<cl::Buffer>(arg++, inputs[k]);
+    }
+    for (size_t k = 0; k < args.scalars.size(); ++k) {
+        kernel.setArg<T>(arg++, args.scalars[k]);
+    }
+    kernel.setArg<cl_uint>(arg++, (cl_uint)n);
+
+    const size_t wg = 64;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange((n + wg - 1) / wg * wg), cl::NDRange(wg));
+    queue.enqueueReadBuffer(out, CL_TRUE, 0, bytes, dst.data());
+}
+
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/outOfCore.hpp>
+#include <JC/trace.hpp>
+
+// Splits a 1D range of work over several devices, possibly of different
+// platforms, and runs the parts concurrently. Each device gets a contiguous
+// slice of the streams (see JC/outOfCore.hpp), sized in proportion to its
+// measured throughput:
+//
+//     jc::MultiDeviceExecutor executor(jc::allDevices());
+//     executor.build(jc::fileToString("array_kernels.ocl"));  // embedded, see JC/kernelRegistry.hpp
+//     executor.forEach("saxpy", n, streams, [&](cl::Kernel &k) { k.setArg<cl_float>(2, a); });
+//
+// The kernels use the argument layout of OutOfCoreExecutor: slice buffers
+// first, n (the slice length) last, with partial and scratch after the
+// buffers for reductions. Every run measures each device (transfers
+// included) and updates its throughput, so the split converges to one that
+// makes the devices finish together. Until every device has been measured
+// the split follows a first guess from compute units and clock.
+
+namespace jc {
+
+class MultiDeviceExecutor {
+public:
+    explicit MultiDeviceExecutor(const std::vector<cl::Device> &devices)
+        : devices_(devices), groups_(256)
+    {
+        if (devices.empty()) {
+            throw std::invalid_argument("jc::MultiDeviceExecutor: no devices");
+        }
+        // one context per platform, one queue per device
+        std::map<cl_platform_id, std::vector<cl::Device> > byPlatform;
+        for (size_t d = 0; d < devices.size(); ++d) {
+            byPlatform[devices[d].getInfo<CL_DEVICE_PLATFORM>()].push_back(devices[d]);
+        }
+        std::map<cl_platform_id, cl::Context> contexts;
+        for (auto it = byPlatform.begin(); it != byPlatform.end(); ++it) {
+            contexts[it->first] = cl::Context(it->second);
+        }
+        for (size_t d = 0; d < devices.size(); ++d) {
+            cl::Context context = contexts[devices[d].getInfo<CL_DEVICE_PLATFORM>()];
+            contexts_.push_back(context);
+            queues_.push_back(cl::CommandQueue(context, devices[d], CL_QUEUE_PROFILING_ENABLE));
+
+            size_t local = std::min<size_t>(256, devices[d].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+            while (local & (local - 1)) local &= local - 1;
+            local_.push_back(local);
+
+            // first guess until a run has been measured
+            guess_.push_back((double)devices[d].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+                             * devices[d].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>());
+            throughput_.push_back(0);
+            measured_.push_back(false);
+        }
+    }
+
+    size_t deviceCount() const
+    {
+        return devices_.size();
+    }
+
+    const cl::Device &device(size_t d) const
+    {
+        return devices_[d];
+    }
+
+    // builds source for every device, once per context
+    void build(const std::string &source, const std::string &options = "")
+    {
+        programs_.clear();
+        std::map<cl_context, cl::Program> built;
+        for (size_t d = 0; d < devices_.size(); ++d) {
+            cl_context key = contexts_[d]();
+            if (built.find(key) == built.end()) {
+                cl::Program::Sources sources(1, std::make_pair(source.c_str(), source.size()));
+                cl::Program program(contexts_[d], sources);
+                std::vector<cl::Device> members = contexts_[d].getInfo<CL_CONTEXT_DEVICES>();
+                program.build(members, options.c_str());
+                built[key] = program;
+            }
+            programs_.push_back(built[key]);
+        }
+    }
+
+    // elements per second of each device, as last measured; 0 for a device
+    // that has not been measured yet
+    const std::vector<double> &throughput() const
+    {
+        return throughput_;
+    }
+
+    // slice lengths for n elements: proportional to the throughput and, but
+    // for the last non-empty one, multiples of the device's work-group size.
+    // Guesses and measurements are in different units, so the guesses are
+    // used for every device until each one has been measured.
+    std::vector<size_t> split(size_t n) const
+    {
+        bool all = std::find(measured_.begin(), measured_.end(), false) == measured_.end();
+        const std::vector<double> &weight = all ? throughput_ : guess_;
+        double total = 0;
+        for (size_t d = 0; d < weight.size(); ++d) {
+            total += weight[d];
+        }
+        std::vector<size_t> parts(devices_.size(), 0);
+        size_t assigned = 0;
+        size_t last = 0;
+        for (size_t d = 0; d < devices_.size(); ++d) {
+            size_t part = (size_t)(n * (weight[d] / total));
+            part = part / local_[d] * local_[d];
+            part = std::min(part, n - assigned);
+            parts[d] = part;
+            assigned += part;
+            if (weight[d] > 0) last = d;
+        }
+        parts[last] += n - assigned;
+        return parts;
+    }
+
+    // runs the elementwise kernel name over the n elements of the streams;
+    // setArgs sets the user arguments of each device's kernel
+    void forEach(const std::string &name, size_t n, const std::vector<Stream> &streams,
+                 const std::function<void(cl::Kernel&)> &setArgs = std::function<void(cl::Kernel&)>())
+    {
+        run(name, n, streams, setArgs, 0);
+    }
+
+    // runs the reduction kernel name and combines the per-work-group
+    // partials with combine, in device order. Only the partials of
+    // work-groups that visited at least one element are combined, so a
+    // device with an empty slice, or a slice shorter than its grid, adds
+    // nothing and min or max kernels need no identity value.
+    template <typename T, typename Combine>
+    T reduce(const std::string &name, size_t n, const std::vector<Stream> &streams, T init, Combine combine,
+             const std::function<void(cl::Kernel&)> &setArgs = std::function<void(cl::Kernel&)>())
+    {
+        run(name, n, streams, setArgs, sizeof(T));
+        const T *p = reinterpret_cast<const T*>(partials_.data());
+        T result = init;
+        for (size_t d = 0; d < devices_.size(); ++d) {
+            for (size_t g = 0; g < usedGroups_[d]; ++g) {
+                result = combine(result, p[d * groups_ + g]);
+            }
+        }
+        return result;
+    }
+
+private:
+    struct Slice {
+        size_t begin;
+        size_t length;
+        std::vector<cl::Buffer> buffers;
+        cl::Buffer partial;
+        std::vector<cl::Event> events;
+    };
+
+    void run(const std::string &name, size_t n, const std::vector<Stream> &streams,
+             const std::function<void(cl::Kernel&)> &setArgs, size_t partialBytes)
+    {
+        if (programs_.empty()) {
+            throw std::logic_error("jc::MultiDeviceExecutor: build() was not called");
+        }
+        partials_.assign(partialBytes * groups_ * devices_.size(), 0);
+        usedGroups_.assign(devices_.size(), 0);
+        std::vector<size_t> parts = split(n);
+        std::vector<Slice> slices(devices_.size());
+
+        // enqueue everything first, so that the devices work concurrently
+        size_t begin = 0;
+        for (size_t d = 0; d < devices_.size(); ++d) {
+            Slice &s = slices[d];
+            s.begin = begin;
+            s.length = parts[d];
+            begin += parts[d];
+            if (s.length == 0) {
+                continue;
+            }
+            TracedQueue queue(queues_[d]);
+            for (size_t k = 0; k < streams.size(); ++k) {
+                size_t bytes = s.length * streams[k].elementSize;
+                char *host = static_cast<char*>(streams[k].host) + s.begin * streams[k].elementSize;
+                s.buffers.push_back(cl::Buffer(contexts_[d], CL_MEM_READ_WRITE, bytes));
+                if (streams[k].access & READ) {
+                    s.events.push_back(cl::Event());
+                    queue.enqueueWriteBuffer(s.buffers[k], CL_FALSE, 0, bytes, host, 0, &s.events.back());
+                }
+            }
+
+            cl::Kernel kernel(programs_[d], name.c_str());
+            if (setArgs) setArgs(kernel);
+            cl_uint arg = 0;
+            for (size_t k = 0; k < streams.size(); ++k) {
+                kernel.setArg<cl::Buffer>(arg++, s.buffers[k]);
+            }
+            size_t global;
+            if (partialBytes) {
+                s.partial = cl::Buffer(contexts_[d], CL_MEM_WRITE_ONLY, groups_ * partialBytes);
+                kernel.setArg<cl::Buffer>(arg++, s.partial);
+                kernel.setArg(arg++, local_[d] * partialBytes, NULL);
+                global = groups_ * local_[d];
+                // with the grid stride, group g visits element g * local first
+                usedGroups_[d] = std::min(groups_, (s.length + local_[d] - 1) / local_[d]);
+            }
+            else {
+                global = (s.length + local_[d] - 1) / local_[d] * local_[d];
+            }
+            kernel.setArg<cl_ulong>(kernel.getInfo<CL_KERNEL_NUM_ARGS>() - 1, (cl_ulong)s.length);
+            s.events.push_back(cl::Event());
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), cl::NDRange(local_[d]),
+                                       0, &s.events.back());
+
+            for (size_t k = 0; k < streams.size(); ++k) {
+                if (streams[k].access & WRITE) {
+                    char *host = static_cast<char*>(streams[k].host) + s.begin * streams[k].elementSize;
+                    s.events.push_back(cl::Event());
+                    queue.enqueueReadBuffer(s.buffers[k], CL_FALSE, 0, s.length * streams[k].elementSize, host,
+                                            0, &s.events.back());
+                }
+            }
+            if (partialBytes) {
+                s.events.push_back(cl::Event());
+                queue.enqueueReadBuffer(s.partial, CL_FALSE, 0, groups_ * partialBytes,
+                                        &partials_[d * groups_ * partialBytes], 0, &s.events.back());
+            }
+        }
+
+        // gather, and measure each device from its first command's start to
+        // its last command's end
+        for (size_t d = 0; d < devices_.size(); ++d) {
+            queues_[d].finish();
+            const Slice &s = slices[d];
+            if (s.length == 0) {
+                continue;
+            }
+            cl_ulong start = s.events.front().getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            cl_ulong end = s.events.back().getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            if (end > start) {
+                double measured = s.length / ((end - start) * 1e-9);
+                // smoothed, so that one noisy run does not throw the split off
+                throughput_[d] = measured_[d] ? 0.5 * throughput_[d] + 0.5 * measured : measured;
+                measured_[d] = true;
+            }
+        }
+    }
+
+    std::vector<cl::Device> devices_;
+    std::vector<cl::Context> contexts_;
+    std::vector<cl::CommandQueue> queues_;
+    std::vector<cl::Program> programs_;
+    std::vector<size_t> local_;
+    std::vector<double> guess_;  // compute units times MHz
+    std::vector<double> throughput_;
+    std::vector<bool> measured_;  // throughput_ holds a measurement
+    std::vector<char> partials_;
+    std::vector<size_t> usedGroups_;  // partials of the last run that saw elements, per device
+    size_t groups_;  // work-groups of a reduction kernel, per device
+};
+
+}
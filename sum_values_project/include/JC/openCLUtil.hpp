@@ -4,11 +4,19 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <stdexcept>
 #include <stdio.h>  /* defines FILENAME_MAX */
+#include <string>
+#include <vector>
 
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
 
+#include <JC/deviceInfo.hpp>
+#include <JC/deviceSelect.hpp>
+#include <JC/kernelRegistry.hpp>
+#include <JC/trace.hpp>
+
 using namespace std;
 
 namespace jc {
@@ -37,6 +45,11 @@ const char *readableStatus(cl_int status);
 string fileToString(const string& file_name) {
     string file_text;
 
+	// kernels embedded at build time need no file, see JC/kernelRegistry.hpp
+	const EmbeddedKernel *embedded = kernelRegistry().find(file_name);
+	if (embedded)
+		return string(embedded->source, embedded->sourceSize);
+
     ifstream file_stream(file_name.c_str());
     if (!file_stream) {
 		//string file_name_up("..\\");
@@ -79,26 +92,31 @@ cl::Program stringToProgram(const string& source_code, const cl::Context& contex
     return program;
 }
 
-cl::Program buildProgram(const string& file_name, const cl::Context& context, const cl::Device& device)
-{
-	vector<cl::Device> devices;
-	devices.push_back(device);
-	string source_code = jc::fileToString(file_name);
-	return stringToProgram(source_code, context, devices);
-}
-
 cl::Program buildProgram(const string& file_name, const cl::Context& context, const vector<cl::Device>& devices)
 {
+	cl::Program program;
+	if (buildEmbeddedSpirv(file_name, context, devices, "-cl-opt-disable", program))
+		return program;
     string source_code = jc::fileToString(file_name);
     return stringToProgram(source_code, context, devices);
 }
 
-// returns run time in nanoseconds
+cl::Program buildProgram(const string& file_name, const cl::Context& context, const cl::Device& device)
+{
+	vector<cl::Device> devices;
+	devices.push_back(device);
+	return buildProgram(file_name, context, devices);
+}
+
+// returns run time in nanoseconds; blocks until the kernel is done, see
+// jc::runKernelAsync (JC/asyncKernel.hpp) for a variant that does not
 cl_ulong runAndTimeKernel(const cl::Kernel& kernel, const cl::CommandQueue& queue, const cl::NDRange global, const cl::NDRange& local=cl::NullRange)
 {
     cl_ulong t1, t2;
     cl::Event evt;
+    uint64_t enqueued = defaultTracer().now();
     queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, 0, &evt);
+    defaultTracer().kernel(queue, kernel, evt, enqueued);
     evt.wait();
     evt.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &t1);
     evt.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_END, &t2);
@@ -107,18 +125,13 @@ cl_ulong runAndTimeKernel(const cl::Kernel& kernel, const cl::CommandQueue& queu
 }
 
 int numberPlatforms() {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	return platforms.size();
+	return platformInfos().size();
 }
 int numberDevices(int platformID) {
-	vector<cl::Platform> platforms;
-	vector<cl::Device> devices;
-	cl::Platform::get(&platforms);
-	if (platformID >= platforms.size() || platformID < 0)
+	const vector<PlatformInfo>& platforms = platformInfos();
+	if (platformID >= (int)platforms.size() || platformID < 0)
 		return 0;
-	platforms[platformID].getDevices(CL_DEVICE_TYPE_ALL, &devices);
-	return devices.size();
+	return platforms[platformID].devices.size();
 }
 
 const char *readableCacheType(cl_device_mem_cache_type ct)
@@ -176,12 +189,21 @@ const char *readableDeviceType(cl_device_type dt)
 
 void showPlatformAndDeviceInfo(const cl::Platform& platform, int platform_id, const cl::Device& device, int device_id)
 {
-	string platformName, platformVendor, platformProfile, platformVersion, platformExtensions;
-	platform.getInfo(CL_PLATFORM_NAME, &platformName);
-	platform.getInfo(CL_PLATFORM_VENDOR, &platformVendor);
-	platform.getInfo(CL_PLATFORM_PROFILE, &platformProfile);
-	platform.getInfo(CL_PLATFORM_VERSION, &platformVersion);
-	platform.getInfo(CL_PLATFORM_EXTENSIONS, &platformExtensions);
+	const DeviceInfo& info = deviceInfo(device);
+	string platformName, platformVendor, platformProfile, platformVersion;
+	if (info.platformIndex >= 0) {
+		const PlatformInfo& p = platformInfos()[info.platformIndex];
+		platformName = p.name;
+		platformVendor = p.vendor;
+		platformProfile = p.profile;
+		platformVersion = p.version;
+	}
+	else {
+		platform.getInfo(CL_PLATFORM_NAME, &platformName);
+		platform.getInfo(CL_PLATFORM_VENDOR, &platformVendor);
+		platform.getInfo(CL_PLATFORM_PROFILE, &platformProfile);
+		platform.getInfo(CL_PLATFORM_VERSION, &platformVersion);
+	}
 
 	cout << "Platform " << platform_id << endl;
 	cout << "    Name:       " << platformName << endl;
@@ -190,146 +212,77 @@ void showPlatformAndDeviceInfo(const cl::Platform& platform, int platform_id, co
 	cout << "    Version:    " << platformVersion << endl;
 	cout << endl;
 
-    string deviceName, openCLCVersion, openCLExtensions;
-    size_t image2dMaxHeight, image2dMaxWidth;
-    size_t image3dMaxDepth, image3dMaxHeight, image3dMaxWidth;
-    size_t maxWorkGroupSize, timerResolution;
-    cl_ulong maxSize, localMemSize;
-    cl_uint  nativeVectorWidthFloat, clockFrequency;
-    device.getInfo<string>(CL_DEVICE_NAME, &deviceName);
-    device.getInfo<string>(CL_DEVICE_OPENCL_C_VERSION, &openCLCVersion);
-    device.getInfo<string>(CL_DEVICE_EXTENSIONS, &openCLExtensions);
-    device.getInfo<cl_ulong>(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxSize); 
-
-    //device.getInfo<size_t>(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &image2dMaxHeight);
-    //device.getInfo<size_t>(CL_DEVICE_IMAGE2D_MAX_WIDTH, &image2dMaxWidth);
-    //device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_DEPTH, &image3dMaxDepth);
-    //device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_HEIGHT, &image3dMaxHeight);
-    //device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_WIDTH, &image3dMaxWidth);
-
-    device.getInfo<cl_ulong>(CL_DEVICE_LOCAL_MEM_SIZE, &localMemSize);
-    device.getInfo<size_t>(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
-    device.getInfo<cl_uint>(CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, &nativeVectorWidthFloat);
-    device.getInfo<size_t>(CL_DEVICE_PROFILING_TIMER_RESOLUTION, &timerResolution);
-
-	cl_ulong globalMemSize, globalMemCacheSize;
-	device.getInfo<cl_ulong>(0x101F, &globalMemSize);  // see cl.h for the code
-	device.getInfo<cl_ulong>(0x101E, &globalMemCacheSize);
-
-	// CL_DRIVER_VERSION = JOCLDeviceQuery.getString(device, 0x102D);
-
-    device.getInfo<cl_uint>(CL_DEVICE_MAX_CLOCK_FREQUENCY, &clockFrequency);
-
     cout << "    Device " << device_id << endl;
-    cout << "        Name                    : " << deviceName << endl;
-    cout << "        OpenCL C Version        : " << openCLCVersion << endl;
-    //cout << "        2D Image limits         : " 
-    //          << image2dMaxHeight << "x" << image2dMaxWidth << endl;
-    //cout << "        3D Image limits         : " 
-    //          << image3dMaxDepth << "x" << image3dMaxHeight << "x" 
-    //          << image2dMaxWidth << endl;
-	cout << "        Global memory size [MB] : " << globalMemSize / (1024 * 1024) << endl;
-	cout << "        Global memory cache size [KB] : " << globalMemCacheSize / 1024 << endl;
-    cout << "        Local memory size [KB]  : "<< localMemSize/1024 << endl;
-	cout << "        Maximum buffer size [MB]: " << maxSize / (1024 * 1024) << endl;
-	cout << "        Maximum workgroup size  : " << maxWorkGroupSize << endl;
-    cout << "        Native vector width     : " << nativeVectorWidthFloat << endl;
-    cout << "        Timer resolution        : " << timerResolution << endl;
-    cout << "        Clock frequency [MHz]   : " << clockFrequency << endl;
+    cout << "        Name                    : " << info.name << endl;
+    cout << "        OpenCL C Version        : " << info.openCLCVersion << endl;
+	cout << "        Global memory size [MB] : " << info.globalMemSize / (1024 * 1024) << endl;
+	cout << "        Global memory cache size [KB] : " << info.globalMemCacheSize / 1024 << endl;
+    cout << "        Local memory size [KB]  : "<< info.localMemSize / 1024 << endl;
+	cout << "        Maximum buffer size [MB]: " << info.maxMemAllocSize / (1024 * 1024) << endl;
+	cout << "        Maximum workgroup size  : " << info.maxWorkGroupSize << endl;
+    cout << "        Native vector width     : " << info.nativeVectorWidthFloat << endl;
+    cout << "        Timer resolution        : " << info.timerResolution << endl;
+    cout << "        Clock frequency [MHz]   : " << info.clockFrequency << endl;
     cout << endl;
 }
 
 
 void showDevice(const cl::Device& device, int i)
 {
-	string deviceName, openCLCVersion, openCLExtensions;
-	size_t image2dMaxHeight, image2dMaxWidth;
-	size_t image3dMaxDepth, image3dMaxHeight, image3dMaxWidth;
-	size_t maxWorkGroupSize, timerResolution;
-	cl_ulong maxSize, localMemSize;
-	cl_uint nbrComputeUnits, nativeVectorWidthFloat, clockFrequency;
-	device.getInfo<string>(CL_DEVICE_NAME, &deviceName);
-	cl_device_type dt;
-	device.getInfo(CL_DEVICE_TYPE, &dt);
-	device.getInfo<cl_uint>(CL_DEVICE_MAX_COMPUTE_UNITS, &nbrComputeUnits);
-	device.getInfo<string>(CL_DEVICE_OPENCL_C_VERSION, &openCLCVersion);
-	device.getInfo<string>(CL_DEVICE_EXTENSIONS, &openCLExtensions);
-	device.getInfo<cl_ulong>(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxSize);
-	cl_ulong globalMemSize, globalMemCacheSize;
-	device.getInfo<cl_ulong>(0x101F, &globalMemSize);  // see cl.h for the code
-	device.getInfo<cl_ulong>(0x101E, &globalMemCacheSize);
-
-	// CL_DRIVER_VERSION = JOCLDeviceQuery.getString(device, 0x102D);
-
-	device.getInfo<size_t>(CL_DEVICE_IMAGE2D_MAX_HEIGHT, &image2dMaxHeight);
-	device.getInfo<size_t>(CL_DEVICE_IMAGE2D_MAX_WIDTH, &image2dMaxWidth);
-	device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_DEPTH, &image3dMaxDepth);
-	device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_HEIGHT, &image3dMaxHeight);
-	device.getInfo<size_t>(CL_DEVICE_IMAGE3D_MAX_WIDTH, &image3dMaxWidth);
-
-	device.getInfo<cl_ulong>(CL_DEVICE_LOCAL_MEM_SIZE, &localMemSize);
-	device.getInfo<size_t>(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
-	device.getInfo<cl_uint>(CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, &nativeVectorWidthFloat);
-	device.getInfo<size_t>(CL_DEVICE_PROFILING_TIMER_RESOLUTION, &timerResolution);
-
-	device.getInfo<cl_uint>(CL_DEVICE_MAX_CLOCK_FREQUENCY, &clockFrequency);
-
-	cl_device_mem_cache_type ct;
-	device.getInfo(CL_DEVICE_GLOBAL_MEM_CACHE_TYPE, &ct);
-
+	const DeviceInfo& info = deviceInfo(device);
 
 	cout << "    Device: " << i << endl;
-	cout << "        Name                    : " << deviceName << endl;
-	cout << "        Device Type             : " << readableDeviceType(dt) << endl;
-	cout << "        OpenCL C Version        : " << openCLCVersion << endl;
-	cout << "        #Compute Units (cores)  : " << nbrComputeUnits << endl;
-	cout << "        Native vector width     : " << nativeVectorWidthFloat << endl;
-	cout << "        2D Image limits         : " << image2dMaxHeight << "x" << image2dMaxWidth << endl;
-	cout << "        3D Image limits         : " << image3dMaxDepth << "x" << image3dMaxHeight << "x" << image2dMaxWidth << endl;
-	cout << "        Global memory size [MB] : " << globalMemSize / (1024 * 1024) << endl;
-	cout << "        Global memory cache size [KB] : " << globalMemCacheSize / 1024 << endl;
-	cout << "        Local memory size [KB]  : " << localMemSize / 1024 << endl;
-	cout << "        Maximum buffer size [MB]: " << maxSize / (1024 * 1024) << endl;
-	cout << "        Maximum workgroup size  : " << maxWorkGroupSize << endl;
-	cout << "        Timer resolution        : " << timerResolution << endl;
-	cout << "        Clock frequency  [MHz]  : " << clockFrequency << endl;
-	cout << "        Cache Type              : " << readableCacheType(ct) << endl;
+	cout << "        Name                    : " << info.name << endl;
+	cout << "        Device Type             : " << readableDeviceType(info.type) << endl;
+	cout << "        OpenCL C Version        : " << info.openCLCVersion << endl;
+	cout << "        #Compute Units (cores)  : " << info.computeUnits << endl;
+	cout << "        Native vector width     : " << info.nativeVectorWidthFloat << endl;
+	cout << "        2D Image limits         : " << info.image2dMaxHeight << "x" << info.image2dMaxWidth << endl;
+	cout << "        3D Image limits         : " << info.image3dMaxDepth << "x" << info.image3dMaxHeight << "x" << info.image3dMaxWidth << endl;
+	cout << "        Global memory size [MB] : " << info.globalMemSize / (1024 * 1024) << endl;
+	cout << "        Global memory cache size [KB] : " << info.globalMemCacheSize / 1024 << endl;
+	cout << "        Local memory size [KB]  : " << info.localMemSize / 1024 << endl;
+	cout << "        Maximum buffer size [MB]: " << info.maxMemAllocSize / (1024 * 1024) << endl;
+	cout << "        Maximum workgroup size  : " << info.maxWorkGroupSize << endl;
+	cout << "        Timer resolution        : " << info.timerResolution << endl;
+	cout << "        Clock frequency  [MHz]  : " << info.clockFrequency << endl;
+	cout << "        Cache Type              : " << readableCacheType(info.globalMemCacheType) << endl;
+	cout << "        fp64 / fp16             : " << (info.fp64 ? "yes" : "no") << " / " << (info.fp16 ? "yes" : "no") << endl;
+	cout << "        Peak estimate [GFLOP/s] : " << info.peakFlops / 1e9 << endl;
+	cout << "        Bandwidth estimate [GB/s]: " << info.peakBandwidth / 1e9 << endl;
 	cout << endl;
 }
 
-void showPlatform(const cl::Platform& platform, int i)
+void showPlatform(const PlatformInfo& platform, int i)
 {
-    string platformName, platformVendor, platformProfile, platformVersion, platformExtensions;
-    platform.getInfo(CL_PLATFORM_NAME, &platformName);
-    platform.getInfo(CL_PLATFORM_VENDOR, &platformVendor);
-    platform.getInfo(CL_PLATFORM_PROFILE, &platformProfile);
-    platform.getInfo(CL_PLATFORM_VERSION, &platformVersion);
-    platform.getInfo(CL_PLATFORM_EXTENSIONS, &platformExtensions);
-
     cout << "Platform " << i << endl;
-    cout << "    Name:       " << platformName << endl;
-    cout << "    Vendor:     " << platformVendor << endl;
-    cout << "    Profile:    " << platformProfile << endl;
-    cout << "    Version:    " << platformVersion << endl;
+    cout << "    Name:       " << platform.name << endl;
+    cout << "    Vendor:     " << platform.vendor << endl;
+    cout << "    Profile:    " << platform.profile << endl;
+    cout << "    Version:    " << platform.version << endl;
     cout << endl;
 
-    vector<cl::Device> devices;
-    platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-    for (int i = 0; i < devices.size(); ++i) {
-        showDevice(devices[i], i);
+    for (int d = 0; d < (int)platform.devices.size(); ++d) {
+        showDevice(platform.devices[d].device, d);
     }
 }
 
+void showPlatform(const cl::Platform& platform, int i)
+{
+	const vector<PlatformInfo>& platforms = platformInfos();
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		if (platforms[p].platform() == platform()) {
+			showPlatform(platforms[p], i);
+			return;
+		}
+	}
+}
+
 void showAllOpenCLDevices()
 {
 	try {
-
-
-		vector<cl::Platform> platforms;
-		vector<cl::Device> devices;
-		cl::Platform::get(&platforms);
-
-		for (int i = 0; i < platforms.size(); ++i) {
+		const vector<PlatformInfo>& platforms = platformInfos();
+		for (int i = 0; i < (int)platforms.size(); ++i) {
 			showPlatform(platforms[i], i);
 		}
 	}
@@ -352,45 +305,12 @@ void showAllOpenCLDevices()
 
 void showAllGPUs() {
 	try {
-
-		vector<cl::Platform> platforms;
-		vector<cl::Device> devices;
-		cl::Platform::get(&platforms);
-
-		for (int i = 0; i < platforms.size(); ++i) {
-			cl::Platform platform = platforms[i];
-			string platformName, platformVendor;
-			platform.getInfo(CL_PLATFORM_NAME, &platformName);
-			platform.getInfo(CL_PLATFORM_VENDOR, &platformVendor);
-
-			vector<cl::Device> devices;
-			platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
-			for (int j = 0; j < devices.size(); ++j) {
-				cl::Device device = devices[j];
-				string deviceName, openCLCVersion, openCLExtensions;
-				
-				size_t maxWorkGroupSize, timerResolution;
-				cl_ulong maxSize, localMemSize;
-				cl_uint nativeVectorWidthFloat, clockFrequency, nbrComputeUnits;
-				device.getInfo<string>(CL_DEVICE_NAME, &deviceName);
-				device.getInfo<string>(CL_DEVICE_OPENCL_C_VERSION, &openCLCVersion);
-				device.getInfo<string>(CL_DEVICE_EXTENSIONS, &openCLExtensions);
-				device.getInfo<cl_ulong>(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxSize);
-				device.getInfo<cl_uint>(CL_DEVICE_MAX_COMPUTE_UNITS, &nbrComputeUnits);
-				device.getInfo<size_t>(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
-				device.getInfo<cl_uint>(CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, &nativeVectorWidthFloat);
-				device.getInfo<size_t>(CL_DEVICE_PROFILING_TIMER_RESOLUTION, &timerResolution);
-
-				device.getInfo<cl_uint>(CL_DEVICE_MAX_CLOCK_FREQUENCY, &clockFrequency);
-
-				cout << " - " << deviceName << " on " << platformName<<": " << nbrComputeUnits <<" cores " << clockFrequency <<
-					"MHz " << " vector width="<< nativeVectorWidthFloat <<endl;
-				//cout << "        OpenCL C Version        :" << openCLCVersion << endl;
-				//cout << "        Maximum workgroup size  :" << maxWorkGroupSize << endl;
-				//cout << "        Native vector width     :" << nativeVectorWidthFloat << endl;
-				//cout << "        Timer resolution        :" << timerResolution << endl;
-				//cout << "        Clock frequency         :" << clockFrequency << endl;
-				//cout << endl;
+		const vector<PlatformInfo>& platforms = platformInfos();
+		for (size_t i = 0; i < platforms.size(); ++i) {
+			for (size_t j = 0; j < platforms[i].devices.size(); ++j) {
+				const DeviceInfo& info = platforms[i].devices[j];
+				cout << " - " << info.name << " on " << platforms[i].name << ": " << info.computeUnits << " cores " << info.clockFrequency <<
+					"MHz " << " vector width=" << info.nativeVectorWidthFloat << endl;
 			}
 		}
 	}
@@ -410,53 +330,66 @@ void showAllGPUs() {
 }
 
 string deviceName(cl::Device device) {
-	string deviceName;
-	device.getInfo<string>(CL_DEVICE_NAME, &deviceName);
-	return deviceName;
+	return deviceInfo(device).name;
 }
 string deviceName(int platformID, int deviceID) {
-	vector<cl::Platform> platforms;
-	vector<cl::Device> devices;
-	cl::Platform::get(&platforms);
-	if (platformID >= platforms.size() || platformID < 0)
-		return string("");
-	platforms[platformID].getDevices(CL_DEVICE_TYPE_ALL, &devices);
-	if (deviceID >= devices.size() || deviceID < 0)
-		return string("");
-	cl::Device device = devices[deviceID];
-	string deviceName;
-	device.getInfo<string>(CL_DEVICE_NAME, &deviceName);
-	return deviceName;
+	const DeviceInfo* info = deviceInfo(platformID, deviceID);
+	return info ? info->name : string("");
 }
 
-cl::Device getDevice(int PLATFORM_ID, int DEVICE_ID, bool PRESS_KEY_TO_CLOSE_WINDOW) {
+// the device by index; throws jc::DeviceNotFound when there is none, see
+// jc::selectDevice (JC/deviceSelect.hpp) to pick one by capabilities instead
+cl::Device getDevice(int PLATFORM_ID, int DEVICE_ID) {
 	
-	vector<cl::Platform> platforms;
-	vector<cl::Device> devices;
-	cl::Platform::get(&platforms);
-	if (PLATFORM_ID >= platforms.size()) {
-		cerr << "Platform " << PLATFORM_ID << " does not exist on this computer" << endl;
-		cerr << "OpenCL platforms & devices on this computer: " << endl;
-		jc::showAllOpenCLDevices();
-		if (PRESS_KEY_TO_CLOSE_WINDOW) { cout << endl << "Press ENTER to close window..."; char c = cin.get(); }
-		exit(-1);
+	ostringstream oss;
+	if (PLATFORM_ID >= numberPlatforms() || PLATFORM_ID < 0) {
+		oss << "Platform " << PLATFORM_ID << " does not exist on this computer";
 	}
-
-	platforms[PLATFORM_ID].getDevices(CL_DEVICE_TYPE_ALL, &devices); // or CL_DEVICE_TYPE_GPU
-	if (DEVICE_ID >= devices.size()) {
-		cerr << "Device " << DEVICE_ID << " of platform " << PLATFORM_ID << " does not exist on this computer (#=" << devices.size() << ")" << endl;
-		cerr << "OpenCL platforms & devices on this computer: " << endl;
-		jc::showAllOpenCLDevices();
-		if (PRESS_KEY_TO_CLOSE_WINDOW) { cout << endl << "Press ENTER to close window..."; char c = cin.get(); }
-		exit(-1);
+	else if (!deviceInfo(PLATFORM_ID, DEVICE_ID)) {
+		oss << "Device " << DEVICE_ID << " of platform " << PLATFORM_ID << " does not exist on this computer (#=" << numberDevices(PLATFORM_ID) << ")";
+	}
+	else {
+		return deviceInfo(PLATFORM_ID, DEVICE_ID)->device;
+	}
+	// the devices there are, as jc::selectDevice lists them
+	const vector<PlatformInfo>& platforms = platformInfos();
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		for (size_t d = 0; d < platforms[p].devices.size(); ++d) {
+			oss << "\n  platform " << p << " device " << d << " '" << platforms[p].devices[d].name << "'";
+		}
+	}
+	throw DeviceNotFound(oss.str());
+}
+// every device of every platform, in platform order
+vector<cl::Device> allDevices(cl_device_type type = CL_DEVICE_TYPE_ALL) {
+	const vector<PlatformInfo>& platforms = platformInfos();
+	vector<cl::Device> all;
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		for (size_t d = 0; d < platforms[p].devices.size(); ++d) {
+			if (platforms[p].devices[d].type & type)
+				all.push_back(platforms[p].devices[d].device);
+		}
 	}
-	return devices[DEVICE_ID];
+	return all;
+}
+
+// splits device into count sub-devices with equal numbers of compute units,
+// e.g. to test multi-device code with the CPU device of PoCL
+vector<cl::Device> subDevices(const cl::Device& device, unsigned int count) {
+	cl_uint units = deviceInfo(device).computeUnits;
+	if (count == 0 || units < count)
+		throw runtime_error("cannot split a device with " + to_string(units) + " compute units into " + to_string(count));
+	cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(units / count), 0 };
+	vector<cl::Device> devices;
+	device.createSubDevices(properties, &devices);
+	if (devices.size() > count)
+		devices.resize(count);
+	return devices;
 }
+
 // in MHz
 unsigned int clockFrequency(cl::Device device) {
-	cl_uint clockFrequency;
-	device.getInfo<cl_uint>(CL_DEVICE_MAX_CLOCK_FREQUENCY, &clockFrequency);
-	return (unsigned int)clockFrequency;
+	return (unsigned int)deviceInfo(device).clockFrequency;
 }
 const char *readableStatus(cl_int status)
 {
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/dataCL.hpp>
+#include <JC/trace.hpp>
+
+// Runs a kernel over host arrays of any length (in memory or a mapped
+// jc::MappedDataset) in chunks that fit the device. Chunks alternate between
+// two sets of buffers, each on its own queue, so the transfers of one chunk
+// overlap the kernel of the other.
+//
+// Kernel argument layout:
+//     elementwise:  (chunk buffers..., user args..., ulong n)
+//     reduction:    (chunk buffers..., __global T* partial, __local T* scratch,
+//                    user args..., ulong n)
+// The executor sets the buffers, partial, scratch and n; the user arguments
+// are set on the kernel beforehand. n is the length of the current chunk and
+// the buffers hold the chunk's elements from index 0. A reduction kernel
+// writes one partial result per work-group (see sumReduce in
+// array_kernels.ocl); the partials of all chunks are combined on the host in
+// chunk order, so the result does not depend on timing.
+
+namespace jc {
+
+// one host array streamed through the kernel
+struct Stream {
+    void *host;
+    size_t elementSize;
+    Access access;  // READ: uploaded, WRITE: downloaded, READ_WRITE: both
+};
+
+template <typename T>
+Stream streamIn(const T *host)
+{
+    Stream s = { const_cast<T*>(host), sizeof(T), READ };
+    return s;
+}
+
+template <typename T>
+Stream streamOut(T *host)
+{
+    Stream s = { host, sizeof(T), WRITE };
+    return s;
+}
+
+template <typename T>
+Stream streamInOut(T *host)
+{
+    Stream s = { host, sizeof(T), READ_WRITE };
+    return s;
+}
+
+class OutOfCoreExecutor {
+public:
+    // memoryBudget is the device memory the executor may use in bytes, 0 for
+    // half of the global memory
+    OutOfCoreExecutor(const cl::Context &context, const cl::CommandQueue &queue, size_t memoryBudget = 0)
+        : context_(context), chunk_(0), lastChunk_(0), groups_(256)
+    {
+        cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+        queues_[0] = queue;
+        queues_[1] = cl::CommandQueue(context, device);
+        maxAlloc_ = (size_t)device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        budget_ = memoryBudget ? memoryBudget : (size_t)(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 2);
+        local_ = std::min<size_t>(256, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        // the reductions need a power of two
+        while (local_ & (local_ - 1)) local_ &= local_ - 1;
+    }
+
+    // Forces the chunk length in elements, 0 to derive it from the budget.
+    // Also lowered automatically when allocating the buffers fails.
+    void setChunk(size_t elements)
+    {
+        chunk_ = elements;
+    }
+
+    // elements per chunk used by the last run
+    size_t chunk() const
+    {
+        return lastChunk_;
+    }
+
+    // runs an elementwise kernel over the n elements of the streams
+    void forEach(cl::Kernel &kernel, size_t n, const std::vector<Stream> &streams)
+    {
+        run(kernel, n, streams, 0, 0);
+        finish();
+    }
+
+    // Runs a reduction kernel over the n elements of the streams and
+    // combines the per-work-group partials with combine, starting from init.
+    template <typename T, typename Combine>
+    T reduce(cl::Kernel &kernel, size_t n, const std::vector<Stream> &streams, T init, Combine combine)
+    {
+        partials_.clear();
+        run(kernel, n, streams, sizeof(T), sizeof(T));
+        finish();
+        const T *p = reinterpret_cast<const T*>(partials_.data());
+        size_t count = partials_.size() / sizeof(T);
+        T result = init;
+        for (size_t i = 0; i < count; ++i) {
+            result = combine(result, p[i]);
+        }
+        return result;
+    }
+
+    template <typename T>
+    T sum(cl::Kernel &kernel, size_t n, const std::vector<Stream> &streams)
+    {
+        return reduce(kernel, n, streams, T(0), std::plus<T>());
+    }
+
+private:
+    void finish()
+    {
+        queues_[0].finish();
+        queues_[1].finish();
+    }
+
+    // chunk length from the budget: both buffer sets must fit in it and no
+    // buffer may exceed the largest single allocation
+    size_t chunkFor(const std::vector<Stream> &streams, size_t n) const
+    {
+        size_t bytesPerElement = 0, largest = 1;
+        for (size_t k = 0; k < streams.size(); ++k) {
+            bytesPerElement += streams[k].elementSize;
+            largest = std::max(largest, streams[k].elementSize);
+        }
+        size_t chunk = chunk_ ? chunk_ : budget_ / (2 * std::max<size_t>(bytesPerElement, 1));
+        chunk = std::min(chunk, maxAlloc_ / largest);
+        chunk = std::min(chunk, n);
+        return std::max<size_t>(chunk, 1);
+    }
+
+    struct BufferSet {
+        std::vector<cl::Buffer> buffers;
+        cl::Buffer partial;
+    };
+
+    // allocates both buffer sets, halving the chunk until the device accepts them
+    void allocate(const std::vector<Stream> &streams, size_t &chunk, size_t partialBytes, BufferSet sets[2])
+    {
+        for (;;) {
+            try {
+                for (int s = 0; s < 2; ++s) {
+                    sets[s].buffers.clear();
+                    for (size_t k = 0; k < streams.size(); ++k) {
+                        cl_mem_flags flags = streams[k].access == READ ? CL_MEM_READ_ONLY
+                                           : streams[k].access == WRITE ? CL_MEM_WRITE_ONLY : CL_MEM_READ_WRITE;
+                        sets[s].buffers.push_back(cl::Buffer(context_, flags, chunk * streams[k].elementSize));
+                    }
+                    if (partialBytes) {
+                        sets[s].partial = cl::Buffer(context_, CL_MEM_WRITE_ONLY, groups_ * partialBytes);
+                    }
+                }
+                return;
+            }
+            catch (cl::Error &e) {
+                bool outOfMemory = e.err() == CL_MEM_OBJECT_ALLOCATION_FAILURE || e.err() == CL_OUT_OF_RESOURCES
+                                   || e.err() == CL_OUT_OF_HOST_MEMORY || e.err() == CL_INVALID_BUFFER_SIZE;
+                if (!outOfMemory || chunk <= local_) {
+                    throw;
+                }
+                chunk /= 2;
+            }
+        }
+    }
+
+    void run(cl::Kernel &kernel, size_t n, const std::vector<Stream> &streams, size_t partialBytes,
+             size_t scratchBytes)
+    {
+        if (n == 0) {
+            return;
+        }
+        size_t chunk = chunkFor(streams, n);
+        BufferSet sets[2];
+        allocate(streams, chunk, partialBytes, sets);
+        lastChunk_ = chunk;
+
+        cl_uint countArg = kernel.getInfo<CL_KERNEL_NUM_ARGS>() - 1;
+        size_t chunks = (n + chunk - 1) / chunk;
+        if (partialBytes) {
+            partials_.resize(chunks * groups_ * partialBytes);
+        }
+
+        for (size_t c = 0; c < chunks; ++c) {
+            BufferSet &set = sets[c % 2];
+            TracedQueue queue(queues_[c % 2]);
+            size_t begin = c * chunk;
+            size_t len = std::min(chunk, n - begin);
+
+            for (size_t k = 0; k < streams.size(); ++k) {
+                if (streams[k].access & READ) {
+                    const char *host = static_cast<const char*>(streams[k].host) + begin * streams[k].elementSize;
+                    queue.enqueueWriteBuffer(set.buffers[k], CL_FALSE, 0, len * streams[k].elementSize, host);
+                }
+            }
+
+            // the arguments are captured when the kernel is enqueued, so one
+            // kernel object serves both buffer sets
+            cl_uint arg = 0;
+            for (size_t k = 0; k < streams.size(); ++k) {
+                kernel.setArg<cl::Buffer>(arg++, set.buffers[k]);
+            }
+            size_t global;
+            if (partialBytes) {
+                kernel.setArg<cl::Buffer>(arg++, set.partial);
+                kernel.setArg(arg++, local_ * scratchBytes, NULL);
+                global = groups_ * local_;
+            }
+            else {
+                global = (len + local_ - 1) / local_ * local_;
+            }
+            kernel.setArg<cl_ulong>(countArg, (cl_ulong)len);
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), cl::NDRange(local_));
+
+            for (size_t k = 0; k < streams.size(); ++k) {
+                if (streams[k].access & WRITE) {
+                    char *host = static_cast<char*>(streams[k].host) + begin * streams[k].elementSize;
+                    queue.enqueueReadBuffer(set.buffers[k], CL_FALSE, 0, len * streams[k].elementSize, host);
+                }
+            }
+            if (partialBytes) {
+                queue.enqueueReadBuffer(set.partial, CL_FALSE, 0, groups_ * partialBytes,
+                                        &partials_[c * groups_ * partialBytes]);
+            }
+        }
+    }
+
+    cl::Context context_;
+    cl::CommandQueue queues_[2];
+    size_t maxAlloc_;
+    size_t budget_;
+    size_t local_;
+    size_t chunk_;
+    size_t lastChunk_;
+    size_t groups_;  // work-groups of a reduction kernel
+    std::vector<char> partials_;
+};
+
+// y = a * x + y over arrays of any length, with saxpy from array_kernels.ocl
+inline void saxpyOutOfCore(OutOfCoreExecutor &executor, const cl::Program &program,
+                           float a, const float *x, float *y, size_t n)
+{
+    cl::Kernel kernel(program, "saxpy");
+    kernel.setArg<cl_float>(2, a);
+    std::vector<Stream> streams;
+    streams.push_back(streamIn(x));
+    streams.push_back(streamInOut(y));
+    executor.forEach(kernel, n, streams);
+}
+
+// sum of x over arrays of any length, with sumReduce from array_kernels.ocl
+inline float sumOutOfCore(OutOfCoreExecutor &executor, const cl::Program &program, const float *x, size_t n)
+{
+    cl::Kernel kernel(program, "sumReduce");
+    return executor.sum<float>(kernel, n, std::vector<Stream>(1, streamIn(x)));
+}
+
+}
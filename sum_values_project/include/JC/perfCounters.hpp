@@ -0,0 +1,279 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Hardware counters around a region of host code, through perf_event_open on
+// Linux:
+//
+//     jc::PerfCounters counters;
+//     jc::CounterSample s = counters.measure([&] { cpuReference(data); });
+//     std::cout << s.ipc() << " IPC, " << s.mpki() << " cache misses per 1000 instructions, "
+//               << s.bound() << "-bound\n";
+//
+// Counters the kernel refuses (perf_event_paranoid, containers, VMs without a
+// PMU, other systems) are marked invalid and the sample falls back to the
+// steady clock, with cycles from the time stamp counter when there is one;
+// TSC ticks run at a constant rate, so IPC and the frequency derived from
+// them are approximations. Only user-space events of the thread calling
+// start() are counted. The counters form one group, scheduled together;
+// when the kernel multiplexes it, the values are scaled to the full time.
+
+namespace jc {
+
+enum Counter {
+    CYCLES,
+    INSTRUCTIONS,
+    CACHE_REFERENCES,
+    CACHE_MISSES,
+    BRANCHES,
+    BRANCH_MISSES,
+    NBR_COUNTERS
+};
+
+struct CounterSample {
+    double seconds;                 // steady clock
+    uint64_t value[NBR_COUNTERS];
+    bool valid[NBR_COUNTERS];
+    bool tscCycles;                 // value[CYCLES] counts TSC ticks, not core cycles
+
+    double ratio(Counter a, Counter b) const
+    {
+        return valid[a] && valid[b] && value[b] ? (double)value[a] / value[b] : 0;
+    }
+
+    double ipc() const
+    {
+        return ratio(INSTRUCTIONS, CYCLES);
+    }
+
+    double cpi() const
+    {
+        return ratio(CYCLES, INSTRUCTIONS);
+    }
+
+    // effective clock in GHz
+    double ghz() const
+    {
+        return valid[CYCLES] && seconds > 0 ? value[CYCLES] / seconds / 1e9 : 0;
+    }
+
+    // last level cache misses per 1000 instructions
+    double mpki() const
+    {
+        return 1000 * ratio(CACHE_MISSES, INSTRUCTIONS);
+    }
+
+    double cacheMissRate() const
+    {
+        return ratio(CACHE_MISSES, CACHE_REFERENCES);
+    }
+
+    double branchMissRate() const
+    {
+        return ratio(BRANCH_MISSES, BRANCHES);
+    }
+
+    // A rule of thumb: a region missing the last level cache more than about
+    // 10 times per 1000 instructions while retiring less than one instruction
+    // per cycle waits on memory. "unknown" without the counters to tell.
+    const char *bound() const
+    {
+        if (tscCycles || !valid[CYCLES] || !valid[INSTRUCTIONS] || !valid[CACHE_MISSES]) {
+            return "unknown";
+        }
+        return mpki() > 10 && ipc() < 1 ? "memory" : "compute";
+    }
+};
+
+inline std::ostream &operator<<(std::ostream &os, const CounterSample &s)
+{
+    os << std::fixed << std::setprecision(3) << 1e6 * s.seconds << " us";
+    if (s.valid[CYCLES]) os << ", " << s.value[CYCLES] << (s.tscCycles ? " TSC ticks" : " cycles") << " (" << s.ghz() << " GHz)";
+    if (s.valid[INSTRUCTIONS]) os << ", " << s.value[INSTRUCTIONS] << " instructions, IPC " << s.ipc() << ", CPI " << s.cpi();
+    if (s.valid[CACHE_MISSES]) os << ", " << s.mpki() << " LLC MPKI";
+    if (s.valid[BRANCH_MISSES]) os << ", " << 100 * s.branchMissRate() << "% branch misses";
+    os << ", " << s.bound() << "-bound";
+    return os << std::defaultfloat << std::setprecision(6);
+}
+
+namespace perf_detail {
+
+inline uint64_t tsc()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+inline bool hasTsc()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+}
+
+class PerfCounters {
+public:
+    PerfCounters()
+        : opened_(false), leader_(-1), members_(0), tsc_(0)
+    {
+        for (int c = 0; c < NBR_COUNTERS; ++c) fd_[c] = -1;
+    }
+
+    ~PerfCounters()
+    {
+        closeAll();
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters& operator=(const PerfCounters &) = delete;
+
+    // true when at least cycles and instructions are real counters; opens
+    // the counters for the calling thread
+    bool available()
+    {
+        open();
+        return fd_[CYCLES] >= 0 && fd_[INSTRUCTIONS] >= 0;
+    }
+
+    // Counts from here on the calling thread. The counters belong to the
+    // thread that opened them, so they are reopened when start() is called
+    // from another thread than the last time.
+    void start()
+    {
+        open();
+#ifdef __linux__
+        if (leader_ >= 0) {
+            ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+        tsc_ = perf_detail::tsc();
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    CounterSample stop()
+    {
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        uint64_t tsc = perf_detail::tsc();
+        CounterSample s;
+        memset(&s, 0, sizeof(s));
+#ifdef __linux__
+        if (leader_ >= 0) {
+            ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+            // number of events, time enabled, time running, one value per event
+            uint64_t data[3 + NBR_COUNTERS];
+            size_t bytes = (3 + members_) * sizeof(uint64_t);
+            if (read(leader_, data, bytes) == (ssize_t)bytes && data[0] == members_ && data[2] != 0) {
+                for (size_t m = 0; m < members_; ++m) {
+                    Counter c = order_[m];
+                    s.value[c] = data[2] < data[1] ? (uint64_t)((double)data[3 + m] * data[1] / data[2]) : data[3 + m];
+                    s.valid[c] = true;
+                }
+            }
+        }
+#endif
+        s.seconds = std::chrono::duration<double>(end - start_).count();
+        if (!s.valid[CYCLES] && perf_detail::hasTsc()) {
+            s.value[CYCLES] = tsc - tsc_;
+            s.valid[CYCLES] = true;
+            s.tscCycles = true;
+        }
+        return s;
+    }
+
+    template <typename F>
+    CounterSample measure(F f)
+    {
+        start();
+        f();
+        return stop();
+    }
+
+private:
+    // One group led by cycles (or the first counter the kernel accepts), so
+    // that all counters run over exactly the same instructions and a
+    // multiplexed group is scaled as a whole. A counter that cannot join is
+    // left out.
+    void open()
+    {
+        if (opened_ && owner_ == std::this_thread::get_id()) {
+            return;
+        }
+        closeAll();
+        opened_ = true;
+        owner_ = std::this_thread::get_id();
+#ifdef __linux__
+        static const uint64_t configs[NBR_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int c = 0; c < NBR_COUNTERS; ++c) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[c];
+            attr.disabled = leader_ < 0 ? 1 : 0;    // the members follow the leader
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // pid 0, cpu -1: the calling thread on any CPU
+            fd_[c] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader_, 0);
+            if (fd_[c] < 0) continue;
+            if (leader_ < 0) leader_ = fd_[c];
+            order_[members_++] = (Counter)c;
+        }
+#endif
+    }
+
+    void closeAll()
+    {
+#ifdef __linux__
+        // members before the leader
+        for (int c = NBR_COUNTERS - 1; c >= 0; --c) {
+            if (fd_[c] >= 0) close(fd_[c]);
+        }
+#endif
+        for (int c = 0; c < NBR_COUNTERS; ++c) fd_[c] = -1;
+        leader_ = -1;
+        members_ = 0;
+        opened_ = false;
+    }
+
+    bool opened_;
+    std::thread::id owner_;         // the thread counted
+    int fd_[NBR_COUNTERS];
+    int leader_;
+    Counter order_[NBR_COUNTERS];   // the counters in the order of a group read
+    size_t members_;
+    uint64_t tsc_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+}
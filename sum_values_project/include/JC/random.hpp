@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include <JC/threadPool.hpp>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al., "Parallel
+// random numbers: as easy as 1, 2, 3", SC 2011). Value i of a stream is a
+// pure function of (seed, i), so any range of a stream can be generated
+// independently: filling in parallel gives the same result as filling
+// sequentially, for every number of threads, and a kernel can produce the
+// same numbers on a device.
+//
+// Element i of a stream of T uses the 32-bit words of block i / E, where
+// E = 4 / W elements fit in a 128-bit block and W = 2 words per element for
+// 64-bit types, 1 otherwise.
+
+namespace jc {
+
+const uint64_t DEFAULT_SEED = 0x853c49e6748fea9bULL;
+
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+
+// one Philox4x32-10 block: ctr is replaced by the four output words
+inline void philox4x32(uint32_t ctr[4], const uint32_t key[2])
+{
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int r = 0; r < 10; ++r) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[0] = c0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = c2;
+        ctr[3] = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+namespace random_detail {
+
+// blocks generated together; the rounds run over the batch in structure of
+// arrays form so the compiler can vectorize them
+const size_t BATCH = 16;
+
+// words of the blocks [block, block + BATCH), out[4 * j + lane]
+inline void philoxBatch(uint64_t seed, uint64_t block, uint32_t out[4 * BATCH])
+{
+    uint32_t c0[BATCH], c1[BATCH], c2[BATCH], c3[BATCH];
+    for (size_t j = 0; j < BATCH; ++j) {
+        c0[j] = (uint32_t)(block + j);
+        c1[j] = (uint32_t)((block + j) >> 32);
+        c2[j] = 0;
+        c3[j] = 0;
+    }
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for (int r = 0; r < 10; ++r) {
+        for (size_t j = 0; j < BATCH; ++j) {
+            uint64_t p0 = (uint64_t)PHILOX_M0 * c0[j];
+            uint64_t p1 = (uint64_t)PHILOX_M1 * c2[j];
+            uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1[j] ^ k0;
+            uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3[j] ^ k1;
+            c0[j] = n0;
+            c1[j] = (uint32_t)p1;
+            c2[j] = n2;
+            c3[j] = (uint32_t)p0;
+        }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    for (size_t j = 0; j < BATCH; ++j) {
+        out[4 * j] = c0[j];
+        out[4 * j + 1] = c1[j];
+        out[4 * j + 2] = c2[j];
+        out[4 * j + 3] = c3[j];
+    }
+}
+
+template <typename T>
+struct Words {
+    static const size_t PER_ELEMENT = sizeof(T) > 4 ? 2 : 1;
+    static const size_t PER_BLOCK = 4 / PER_ELEMENT;  // elements per block
+};
+
+// [0, 1) from the words of one element, exact in T
+inline float unit(const uint32_t *w, float)
+{
+    return (float)(w[0] >> 8) * (1.0f / 16777216.0f);
+}
+
+inline double unit(const uint32_t *w, double)
+{
+    uint64_t bits = ((uint64_t)w[1] << 32) | w[0];
+    return (double)(bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Maps the words of element e of a block to [min, min + range). Floating
+// point values are computed with a single fma so that the result does not
+// depend on whether the compiler contracts min + u * range, and a device
+// using fma() rounds it identically.
+template <typename T, bool Float = std::is_floating_point<T>::value>
+struct Uniform {
+    T min, range;
+
+    T operator()(const uint32_t *block, size_t e) const
+    {
+        return std::fma(unit(block + e * Words<T>::PER_ELEMENT, T()), range, min);
+    }
+};
+
+template <typename T>
+struct Uniform<T, false> {
+    T min, range;
+
+    T operator()(const uint32_t *block, size_t e) const
+    {
+        const uint32_t *w = block + e * Words<T>::PER_ELEMENT;
+        if (sizeof(T) > 4) {
+            uint64_t bits = ((uint64_t)w[1] << 32) | w[0];
+            return range == 0 ? min : (T)(min + (T)(bits % (uint64_t)range));
+        }
+        return (T)(min + (T)(((uint64_t)w[0] * (uint64_t)(uint32_t)range) >> 32));
+    }
+};
+
+// Box-Muller: the words of a block are split into pairs of uniforms, each
+// giving two normal values (cos and sin branch)
+template <typename T>
+struct Normal {
+    T mean, stddev;
+
+    T operator()(const uint32_t *block, size_t e) const
+    {
+        const size_t W = Words<T>::PER_ELEMENT;
+        const uint32_t *w = block + (e / 2) * 2 * W;
+        T u1 = T(1) - unit(w, T());  // (0, 1], keeps log finite
+        T u2 = unit(w + W, T());
+        T r = std::sqrt(T(-2) * std::log(u1));
+        T theta = T(6.283185307179586) * u2;
+        return mean + stddev * r * (e % 2 == 0 ? std::cos(theta) : std::sin(theta));
+    }
+};
+
+// writes the values [first, first + n) of a stream to out, value i being
+// map(words of block i / E, i % E)
+template <typename T, typename Map>
+void generate(uint64_t seed, uint64_t first, size_t n, T *out, const Map &map)
+{
+    const size_t E = Words<T>::PER_BLOCK;
+
+    uint32_t words[4 * BATCH];
+    while (n > 0) {
+        uint64_t block = first / E;
+        size_t skip = (size_t)(first % E);
+        philoxBatch(seed, block, words);
+        size_t count = std::min(n, BATCH * E - skip);
+        for (size_t i = 0; i < count; ++i) {
+            size_t k = skip + i;
+            out[i] = map(words + (k / E) * 4, k % E);
+        }
+        out += count;
+        first += count;
+        n -= count;
+    }
+}
+
+// below this many elements a fill stays on the calling thread
+const size_t RANDOM_PARALLEL_MIN = 1 << 16;
+
+// generate() over the thread pool, same result as a sequential call
+template <typename T, typename Map>
+void generateParallel(uint64_t seed, uint64_t first, size_t n, T *out, const Map &map,
+                      ThreadPool &pool)
+{
+    if (n < RANDOM_PARALLEL_MIN) {
+        generate(seed, first, n, out, map);
+        return;
+    }
+    pool.parallelForRange(n, RANDOM_PARALLEL_MIN / 4, [&](size_t begin, size_t end) {
+        generate(seed, first + begin, end - begin, out + begin, map);
+    });
+}
+
+}
+
+// writes the values [first, first + n) of the uniform stream of seed to out
+template <typename T>
+void generateUniform(uint64_t seed, uint64_t first, size_t n, T min, T max, T *out)
+{
+    random_detail::Uniform<T> map = { min, (T)(max - min) };
+    random_detail::generate(seed, first, n, out, map);
+}
+
+// generateUniform over the thread pool, same result as a sequential call
+template <typename T>
+void generateUniformParallel(uint64_t seed, uint64_t first, size_t n, T min, T max, T *out,
+                             ThreadPool &pool = defaultThreadPool())
+{
+    random_detail::Uniform<T> map = { min, (T)(max - min) };
+    random_detail::generateParallel(seed, first, n, out, map, pool);
+}
+
+// normal values with the given mean and standard deviation; floating point
+// types only. The device kernels use the same transform but their log, sin
+// and cos are not bit-identical to the host ones.
+template <typename T>
+void generateNormal(uint64_t seed, uint64_t first, size_t n, T mean, T stddev, T *out,
+                    ThreadPool &pool = defaultThreadPool())
+{
+    static_assert(std::is_floating_point<T>::value, "normal values must be floating point");
+    random_detail::Normal<T> map = { mean, stddev };
+    random_detail::generateParallel(seed, first, n, out, map, pool);
+}
+
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/data.hpp>
+#include <JC/dataCL.hpp>
+#include <JC/random.hpp>
+
+// Random data generated directly in device buffers by the kernels in
+// random_kernels.ocl, so large inputs need neither host generation nor an
+// upload. The program passed in must have been built from that file; with
+// the file embedded by jc_embed_kernels (JC/kernelRegistry.hpp) that is
+//     cl::Program program = jc::buildProgram("random_kernels.ocl", context, device);
+//
+// A device distribution produces the same stream as the host distribution
+// with the same parameters and seed: bit for bit for the constant and uniform
+// ones, within the accuracy of the device's log, sin and cos for the normal
+// one. Host results can therefore be checked against a host reference.
+
+namespace jc {
+
+template <typename T> struct RandomKernelNames;
+template <> struct RandomKernelNames<float> {
+    static const char *uniform() { return "uniformFloat"; }
+    static const char *normal() { return "normalFloat"; }
+};
+template <> struct RandomKernelNames<double> {
+    static const char *uniform() { return "uniformDouble"; }
+    static const char *normal() { return "normalDouble"; }
+};
+template <> struct RandomKernelNames<int> {
+    static const char *uniform() { return "uniformInt"; }
+};
+template <> struct RandomKernelNames<unsigned int> {
+    static const char *uniform() { return "uniformUint"; }
+};
+
+// device counterpart of Distribution<T>
+template <typename T>
+class DeviceDistribution {
+public:
+    virtual ~DeviceDistribution() {}
+
+    // enqueues writing the next n values to buffer, starting at element offset
+    virtual cl::Event fill_n(const cl::CommandQueue &queue, const cl::Buffer &buffer,
+                             size_t n, size_t offset = 0) = 0;
+};
+
+template <typename T>
+class DeviceConstantDistribution : public DeviceDistribution<T> {
+public:
+    DeviceConstantDistribution(T value) : value_(value) {}
+
+    cl::Event fill_n(const cl::CommandQueue &queue, const cl::Buffer &buffer,
+                     size_t n, size_t offset = 0)
+    {
+        cl::Event evt;
+        queue.enqueueFillBuffer(buffer, value_, offset * sizeof(T), n * sizeof(T), 0, &evt);
+        return evt;
+    }
+
+private:
+    T value_;
+};
+
+// Runs one of the stream kernels; a and b are its two parameters (min and
+// range, or mean and standard deviation). Like the host PhiloxDistribution
+// it keeps its position in the stream, so consecutive fills continue it.
+template <typename T>
+class DevicePhiloxDistribution : public DeviceDistribution<T> {
+public:
+    cl::Event fill_n(const cl::CommandQueue &queue, const cl::Buffer &buffer,
+                     size_t n, size_t offset = 0)
+    {
+        cl::Event evt;
+        if (n == 0) {
+            return evt;
+        }
+        const size_t E = random_detail::Words<T>::PER_BLOCK;
+        const size_t wg = 64;
+        size_t blocks = (size_t)((position_ + n - 1) / E - position_ / E + 1);
+
+        kernel_.setArg<cl::Buffer>(0, buffer);
+        kernel_.setArg<cl_ulong>(1, (cl_ulong)offset);
+        kernel_.setArg<cl_ulong>(2, (cl_ulong)position_);
+        kernel_.setArg<cl_ulong>(3, (cl_ulong)n);
+        kernel_.setArg<cl_uint>(4, (cl_uint)seed_);
+        kernel_.setArg<cl_uint>(5, (cl_uint)(seed_ >> 32));
+        kernel_.setArg<T>(6, a_);
+        kernel_.setArg<T>(7, b_);
+        queue.enqueueNDRangeKernel(kernel_, cl::NullRange, cl::NDRange((blocks + wg - 1) / wg * wg),
+                                   cl::NDRange(wg), 0, &evt);
+        position_ += n;
+        return evt;
+    }
+
+    uint64_t seed() const
+    {
+        return seed_;
+    }
+
+    // index of the next value in the stream
+    uint64_t position() const
+    {
+        return position_;
+    }
+
+protected:
+    DevicePhiloxDistribution(const cl::Program &program, const char *kernelName, T a, T b, uint64_t seed)
+        : kernel_(program, kernelName), a_(a), b_(b), seed_(seed), position_(0)
+    {}
+
+private:
+    cl::Kernel kernel_;
+    T a_;
+    T b_;
+    uint64_t seed_;
+    uint64_t position_;
+};
+
+// same values as UniformDistribution<T>(min, max, seed)
+template <typename T>
+class DeviceUniformDistribution : public DevicePhiloxDistribution<T> {
+public:
+    DeviceUniformDistribution(const cl::Program &program, T min, T max, uint64_t seed = DEFAULT_SEED)
+        : DevicePhiloxDistribution<T>(program, RandomKernelNames<T>::uniform(), min, (T)(max - min), seed)
+    {}
+};
+
+// approximately the values of NormalDistribution<T>(mean, stddev, seed)
+template <typename T>
+class DeviceNormalDistribution : public DevicePhiloxDistribution<T> {
+public:
+    DeviceNormalDistribution(const cl::Program &program, T mean, T stddev, uint64_t seed = DEFAULT_SEED)
+        : DevicePhiloxDistribution<T>(program, RandomKernelNames<T>::normal(), mean, stddev, seed)
+    {}
+};
+
+// fills data on the device only; the host copy is downloaded when it is
+// first read through data.host_view()
+template <typename T>
+cl::Event fillOnDevice(MirroredData<T> &data, const cl::CommandQueue &queue,
+                       DeviceDistribution<T> &distribution)
+{
+    const cl::Buffer &buffer = data.device_buffer(queue, WRITE, 0, data.size());
+    return distribution.fill_n(queue, buffer, data.size());
+}
+
+}
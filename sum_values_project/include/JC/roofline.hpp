@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/bufferPool.hpp>
+#include <JC/deviceInfo.hpp>
+#include <JC/matrixExprCL.hpp>
+#include <JC/trace.hpp>
+
+// Roofline analysis: a kernel doing ops operations on bytes bytes of global
+// memory cannot beat min(peak compute, intensity * peak bandwidth), with
+// intensity = ops / bytes. measureRoofline() measures both peaks of a device
+// with two microbenchmarks, an arithmetic one (independent mad chains in
+// registers) and a stream triad; RooflineReport places benchmarked kernels
+// under these roofs:
+//
+//     jc::RooflineReport report(jc::measureRoofline(queue));
+//     report.add("saxpy", 2 * n, 12 * n, seconds);
+//     std::cout << report;                 // text table, see also csv() and svg()
+//
+// A kernel left of the ridge point (peak compute / peak bandwidth) is
+// memory-bound, right of it compute-bound. The roofs stay as measured: a
+// kernel above them is flagged (the microbenchmarks fell short of the
+// device, or the ops or bytes given for the kernel are off) and shows more
+// than 100% of its roof.
+
+namespace jc {
+
+struct Roofline {
+    std::string device;
+    double peakOps;         // operations per second
+    double peakBandwidth;   // bytes per second
+
+    double ridge() const
+    {
+        return peakBandwidth > 0 ? peakOps / peakBandwidth : 0;
+    }
+
+    // attainable operations per second at intensity ops/byte
+    double roof(double intensity) const
+    {
+        return std::min(peakOps, intensity * peakBandwidth);
+    }
+};
+
+namespace roofline_detail {
+
+const cl_uint FLOPS_ITERATIONS = 256;
+const size_t FLOPS_ITEMS = 1 << 18;
+
+// 8 independent float4 chains, 8 * 4 * 2 operations per iteration
+const char *const FLOPS_SOURCE =
+    "__kernel void jc_roofFlops(__global float *out, float m, uint iterations)\n"
+    "{\n"
+    "    float4 c = (float4)(get_global_id(0));\n"
+    "    float4 x0 = c, x1 = c + 1, x2 = c + 2, x3 = c + 3, x4 = c + 4, x5 = c + 5, x6 = c + 6, x7 = c + 7;\n"
+    "    for (uint k = 0; k < iterations; ++k) {\n"
+    "        x0 = mad(x0, m, c); x1 = mad(x1, m, c); x2 = mad(x2, m, c); x3 = mad(x3, m, c);\n"
+    "        x4 = mad(x4, m, c); x5 = mad(x5, m, c); x6 = mad(x6, m, c); x7 = mad(x7, m, c);\n"
+    "    }\n"
+    "    float4 s = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;\n"
+    "    out[get_global_id(0)] = s.x + s.y + s.z + s.w;\n"
+    "}\n";
+
+const char *const TRIAD_SOURCE =
+    "__kernel void jc_roofTriad(__global float4 *a, __global const float4 *b, __global const float4 *c, float s)\n"
+    "{\n"
+    "    size_t i = get_global_id(0);\n"
+    "    a[i] = b[i] + s * c[i];\n"
+    "}\n";
+
+// fastest of repeats runs of kernel, in seconds; the first run is a warm-up
+inline double bestTime(const TracedQueue &queue, const cl::Kernel &kernel, size_t global, int repeats)
+{
+    cl_ulong best = std::numeric_limits<cl_ulong>::max();
+    for (int run = 0; run <= repeats; ++run) {
+        cl::Event event;
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(global), cl::NullRange, NULL, &event);
+        event.wait();
+        cl_ulong ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        if (run > 0) best = std::min(best, ns);
+    }
+    return std::max<cl_ulong>(best, 1) * 1e-9;
+}
+
+inline std::string escapeXml(const std::string &s)
+{
+    std::string out;
+    for (size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        default: out += s[i];
+        }
+    }
+    return out;
+}
+
+}
+
+// Measures the peaks of the device of queue, which needs
+// CL_QUEUE_PROFILING_ENABLE. Takes a fraction of a second.
+inline Roofline measureRoofline(const cl::CommandQueue &queue, int repeats = 5)
+{
+    using namespace roofline_detail;
+    cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+    cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+    const DeviceInfo &info = deviceInfo(device);
+    TracedQueue traced(queue);
+    Roofline r;
+    r.device = info.name;
+
+    PooledBuffer out = defaultBufferPool().acquire(context, FLOPS_ITEMS * sizeof(cl_float), CL_MEM_WRITE_ONLY);
+    cl::Kernel flops = cachedKernel(context, device, FLOPS_SOURCE, "jc_roofFlops");
+    flops.setArg<cl::Buffer>(0, out);
+    flops.setArg<cl_float>(1, 0.999f);
+    flops.setArg<cl_uint>(2, FLOPS_ITERATIONS);
+    r.peakOps = (double)FLOPS_ITEMS * FLOPS_ITERATIONS * 64 / bestTime(traced, flops, FLOPS_ITEMS, repeats);
+
+    // arrays of 64 MB, far beyond the caches, unless the device cannot hold them
+    // whole work-groups of 64 float4, at least one
+    size_t bytes = std::min<cl_ulong>(64 << 20, std::min(info.maxMemAllocSize, info.globalMemSize / 4));
+    bytes = std::max<size_t>(bytes - bytes % (16 * 64), 16 * 64);
+    PooledBuffer a = defaultBufferPool().acquire(context, bytes, CL_MEM_WRITE_ONLY);
+    PooledBuffer b = defaultBufferPool().acquire(context, bytes, CL_MEM_READ_ONLY);
+    PooledBuffer c = defaultBufferPool().acquire(context, bytes, CL_MEM_READ_ONLY);
+    traced.enqueueFillBuffer<cl_float>(b, 1.0f, 0, bytes);
+    traced.enqueueFillBuffer<cl_float>(c, 2.0f, 0, bytes);
+    cl::Kernel triad = cachedKernel(context, device, TRIAD_SOURCE, "jc_roofTriad");
+    triad.setArg<cl::Buffer>(0, a);
+    triad.setArg<cl::Buffer>(1, b);
+    triad.setArg<cl::Buffer>(2, c);
+    triad.setArg<cl_float>(3, 3.0f);
+    r.peakBandwidth = 3.0 * bytes / bestTime(traced, triad, bytes / 16, repeats);
+    return r;
+}
+
+class RooflineReport {
+public:
+    struct Point {
+        std::string name;
+        double ops, bytes, seconds;
+
+        // operations per byte; infinite for kernels without memory traffic
+        double intensity() const
+        {
+            return bytes > 0 ? ops / bytes : std::numeric_limits<double>::infinity();
+        }
+        double opsPerSecond() const
+        {
+            return seconds > 0 ? ops / seconds : 0;
+        }
+        double bytesPerSecond() const
+        {
+            return seconds > 0 ? bytes / seconds : 0;
+        }
+    };
+
+    explicit RooflineReport(const Roofline &roofline)
+        : roofline_(roofline)
+    {
+    }
+
+    // a kernel run: ops operations and bytes of global memory traffic in seconds
+    void add(const std::string &name, double ops, double bytes, double seconds)
+    {
+        Point p = { name, ops, bytes, seconds };
+        points_.push_back(p);
+    }
+
+    const Roofline &roofline() const
+    {
+        return roofline_;
+    }
+
+    const std::vector<Point> &points() const
+    {
+        return points_;
+    }
+
+    bool memoryBound(const Point &p) const
+    {
+        return p.intensity() < roofline_.ridge();
+    }
+
+    // faster than the measured roof allows
+    bool aboveRoof(const Point &p) const
+    {
+        return p.opsPerSecond() > roofline_.roof(p.intensity()) || p.bytesPerSecond() > roofline_.peakBandwidth;
+    }
+
+    // achieved share of the roof at the kernel's intensity, in percent
+    double percentOfRoof(const Point &p) const
+    {
+        double roof = roofline_.roof(p.intensity());
+        return roof > 0 ? 100 * p.opsPerSecond() / roof : 0;
+    }
+
+    void text(std::ostream &os) const
+    {
+        const Roofline &r = roofline_;
+        os << "Roofline of " << r.device << ": " << std::fixed << std::setprecision(2)
+           << r.peakOps / 1e9 << " GOp/s, " << r.peakBandwidth / 1e9 << " GB/s, ridge at "
+           << r.ridge() << " Op/byte\n";
+        os << "    ***** Kernel *****           | Op/byte   | GOp/s     | GB/s      | roof      | % of roof | bound\n";
+        for (size_t i = 0; i < points_.size(); ++i) {
+            const Point &p = points_[i];
+            std::string name = p.name.substr(0, 32);
+            os << std::left << std::setw(32) << name << " | " << std::right;
+            if (p.bytes > 0) os << std::setw(9) << p.intensity() << " | ";
+            else os << std::setw(9) << "inf" << " | ";
+            os << std::setw(9) << p.opsPerSecond() / 1e9 << " | "
+               << std::setw(9) << p.bytesPerSecond() / 1e9 << " | "
+               << std::setw(9) << r.roof(p.intensity()) / 1e9 << " | "
+               << std::setw(8) << percentOfRoof(p) << "% | "
+               << (memoryBound(p) ? "memory" : "compute") << (aboveRoof(p) ? ", above roof" : "") << "\n";
+        }
+        os << std::defaultfloat << std::setprecision(6);
+    }
+
+    void csv(std::ostream &os) const
+    {
+        os << "device,kernel,ops,bytes,seconds,intensity,ops_per_s,bytes_per_s,roof_ops_per_s,percent_of_roof,bound,above_roof\n";
+        for (size_t i = 0; i < points_.size(); ++i) {
+            const Point &p = points_[i];
+            os << '"' << roofline_.device << "\",\"" << p.name << "\"," << p.ops << ',' << p.bytes << ','
+               << p.seconds << ',' << p.intensity() << ',' << p.opsPerSecond() << ',' << p.bytesPerSecond() << ','
+               << roofline_.roof(p.intensity()) << ',' << percentOfRoof(p) << ','
+               << (memoryBound(p) ? "memory" : "compute") << ',' << (aboveRoof(p) ? 1 : 0) << '\n';
+        }
+    }
+
+    // log-log chart of the roofs and the kernels, as a standalone SVG file
+    void svg(std::ostream &os) const
+    {
+        using roofline_detail::escapeXml;
+        const Roofline &r = roofline_;
+        const double W = 720, H = 480, left = 70, right = 20, top = 40, bottom = 50;
+
+        // decades spanning the ridge and every finite point
+        double xlo = std::min(r.ridge(), 1.0) / 10, xhi = std::max(r.ridge(), 1.0) * 10;
+        double ylo = r.peakOps / 1e4, yhi = r.peakOps * 2;
+        for (size_t i = 0; i < points_.size(); ++i) {
+            double ai = points_[i].intensity();
+            if (std::isfinite(ai) && ai > 0) {
+                xlo = std::min(xlo, ai / 2);
+                xhi = std::max(xhi, ai * 2);
+            }
+            if (points_[i].opsPerSecond() > 0) {
+                ylo = std::min(ylo, points_[i].opsPerSecond() / 2);
+                yhi = std::max(yhi, points_[i].opsPerSecond() * 2);
+            }
+        }
+        xlo = std::pow(10, std::floor(std::log10(xlo)));
+        xhi = std::pow(10, std::ceil(std::log10(xhi)));
+        ylo = std::pow(10, std::floor(std::log10(ylo)));
+        yhi = std::pow(10, std::ceil(std::log10(yhi)));
+        auto X = [&](double ai) { return left + (W - left - right) * std::log10(ai / xlo) / std::log10(xhi / xlo); };
+        auto Y = [&](double ops) { return H - bottom - (H - top - bottom) * std::log10(ops / ylo) / std::log10(yhi / ylo); };
+        auto tick = [](double v) { std::ostringstream oss; oss << v; return oss.str(); };
+
+        os << std::fixed << std::setprecision(1);
+        os << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << W << "\" height=\"" << H
+           << "\" font-family=\"sans-serif\" font-size=\"11\">\n";
+        os << "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n";
+        os << "<text x=\"" << W / 2 << "\" y=\"20\" text-anchor=\"middle\" font-size=\"14\">Roofline of "
+           << escapeXml(r.device) << "</text>\n";
+        for (double x = xlo; x <= xhi * 1.001; x *= 10) {
+            os << "<line x1=\"" << X(x) << "\" y1=\"" << top << "\" x2=\"" << X(x) << "\" y2=\"" << H - bottom
+               << "\" stroke=\"#ddd\"/>\n";
+            os << "<text x=\"" << X(x) << "\" y=\"" << H - bottom + 15 << "\" text-anchor=\"middle\">" << tick(x) << "</text>\n";
+        }
+        for (double y = ylo; y <= yhi * 1.001; y *= 10) {
+            os << "<line x1=\"" << left << "\" y1=\"" << Y(y) << "\" x2=\"" << W - right << "\" y2=\"" << Y(y)
+               << "\" stroke=\"#ddd\"/>\n";
+            os << "<text x=\"" << left - 5 << "\" y=\"" << Y(y) + 4 << "\" text-anchor=\"end\">" << tick(y / 1e9) << "</text>\n";
+        }
+        os << "<text x=\"" << W / 2 << "\" y=\"" << H - 10 << "\" text-anchor=\"middle\">operational intensity [Op/byte]</text>\n";
+        os << "<text transform=\"translate(15," << H / 2 << ") rotate(-90)\" text-anchor=\"middle\">GOp/s</text>\n";
+
+        double x0 = std::max(xlo, ylo / r.peakBandwidth);
+        os << "<polyline fill=\"none\" stroke=\"black\" stroke-width=\"2\" points=\""
+           << X(x0) << ',' << Y(r.roof(x0)) << ' ' << X(r.ridge()) << ',' << Y(r.peakOps) << ' '
+           << X(xhi) << ',' << Y(r.peakOps) << "\"/>\n";
+        os << "<line x1=\"" << X(r.ridge()) << "\" y1=\"" << Y(r.peakOps) << "\" x2=\"" << X(r.ridge()) << "\" y2=\""
+           << H - bottom << "\" stroke=\"gray\" stroke-dasharray=\"4 3\"/>\n";
+
+        for (size_t i = 0; i < points_.size(); ++i) {
+            const Point &p = points_[i];
+            if (p.opsPerSecond() <= 0) continue;
+            // kernels without memory traffic sit at the right edge
+            double x = std::isfinite(p.intensity()) ? X(p.intensity()) : W - right;
+            double y = Y(p.opsPerSecond());
+            // points above the roof get a ring
+            os << "<circle cx=\"" << x << "\" cy=\"" << y << "\" r=\"4\" fill=\""
+               << (memoryBound(p) ? "#1f77b4" : "#d62728") << "\""
+               << (aboveRoof(p) ? " stroke=\"orange\" stroke-width=\"3\"" : "") << "><title>" << escapeXml(p.name) << ": "
+               << percentOfRoof(p) << "% of roof" << (aboveRoof(p) ? ", above the measured roof" : "")
+               << "</title></circle>\n";
+            os << "<text x=\"" << x - 6 << "\" y=\"" << y - 6 << "\" text-anchor=\"end\">" << escapeXml(p.name) << "</text>\n";
+        }
+        os << "</svg>\n";
+        os << std::defaultfloat << std::setprecision(6);
+    }
+
+private:
+    Roofline roofline_;
+    std::vector<Point> points_;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const RooflineReport &report)
+{
+    report.text(os);
+    return os;
+}
+
+}
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/trace.hpp>
+
+// A DAG of device commands and host callbacks. Tasks declare the buffers
+// they read and write; the graph orders every task after the last writer of
+// what it reads, and a writer after the earlier readers and writer, and
+// passes these orderings to OpenCL as event wait lists. Independent tasks
+// are free to run concurrently: the graph uses an out-of-order queue when
+// the device supports one and otherwise spreads the tasks over several
+// in-order queues.
+//
+//     jc::TaskGraph graph(context, device);
+//     jc::TaskGraph::TaskId up = graph.addWrite(in, host, bytes);
+//     graph.addKernel(k1, global, local, { in }, { out1 });   // both after up,
+//     graph.addKernel(k2, global, local, { in }, { out2 });   // concurrently
+//     graph.run();
+//     graph.wait();
+//
+// run() enqueues all device tasks at once, so the stages follow each other
+// without the host in between. Host tasks run on a helper thread as soon as
+// their dependencies have completed, in the order they were added, and
+// release the device tasks waiting on them through a cl::UserEvent.
+// Buffers are told apart by handle (the graph keeps a reference to each, so
+// a handle is not reused while the graph lives): overlapping sub-buffers are
+// not seen as dependent, use after() for those.
+
+namespace jc {
+
+class TaskGraph {
+public:
+    typedef size_t TaskId;
+
+    // queues: the number of in-order queues used when the device has no
+    // out-of-order queue
+    TaskGraph(const cl::Context &context, const cl::Device &device, unsigned int queues = 3)
+        : context_(context), running_(false)
+    {
+        cl_command_queue_properties supported = device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+        if (supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+            queues_.push_back(cl::CommandQueue(context, device,
+                                               CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE));
+        }
+        else {
+            for (unsigned int q = 0; q < std::max(queues, 1u); ++q) {
+                queues_.push_back(cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE));
+            }
+        }
+    }
+
+    ~TaskGraph()
+    {
+        if (host_.joinable()) {
+            host_.join();
+        }
+    }
+
+    TaskGraph(const TaskGraph &) = delete;
+    TaskGraph& operator=(const TaskGraph &) = delete;
+
+    TaskId addKernel(const cl::Kernel &kernel, const cl::NDRange &global, const cl::NDRange &local = cl::NullRange,
+                     const std::vector<cl::Buffer> &reads = std::vector<cl::Buffer>(),
+                     const std::vector<cl::Buffer> &writes = std::vector<cl::Buffer>())
+    {
+        Task t(KERNEL);
+        t.kernel = kernel;
+        t.global = global;
+        t.local = local;
+        return add(t, reads, writes);
+    }
+
+    // copies bytes from host to buffer at offset; host must stay valid until the task has run
+    TaskId addWrite(const cl::Buffer &buffer, const void *host, size_t bytes, size_t offset = 0)
+    {
+        Task t(WRITE_BUFFER);
+        t.buffer = buffer;
+        t.host = const_cast<void*>(host);
+        t.bytes = bytes;
+        t.offset = offset;
+        return add(t, std::vector<cl::Buffer>(), std::vector<cl::Buffer>(1, buffer));
+    }
+
+    // copies bytes from buffer at offset to host
+    TaskId addRead(const cl::Buffer &buffer, void *host, size_t bytes, size_t offset = 0)
+    {
+        Task t(READ_BUFFER);
+        t.buffer = buffer;
+        t.host = host;
+        t.bytes = bytes;
+        t.offset = offset;
+        return add(t, std::vector<cl::Buffer>(1, buffer), std::vector<cl::Buffer>());
+    }
+
+    // fn runs on the host after the tasks it depends on; reads and writes
+    // are the buffers whose host copies it uses, so that it is ordered like
+    // a device task on them
+    TaskId addHost(const std::function<void()> &fn,
+                   const std::vector<cl::Buffer> &reads = std::vector<cl::Buffer>(),
+                   const std::vector<cl::Buffer> &writes = std::vector<cl::Buffer>())
+    {
+        Task t(HOST);
+        t.fn = fn;
+        return add(t, reads, writes);
+    }
+
+    // makes task wait for before as well
+    void after(TaskId task, TaskId before)
+    {
+        if (before >= task || task >= tasks_.size()) {
+            throw std::invalid_argument("jc::TaskGraph::after: a task can only wait for an earlier one");
+        }
+        addEdge(tasks_[task], before);
+    }
+
+    size_t size() const
+    {
+        return tasks_.size();
+    }
+
+    // Enqueues every task and starts the host tasks. Returns once all is
+    // submitted, without waiting for the device. When enqueueing fails, the
+    // host tasks are cancelled, so that the device tasks already waiting on
+    // them are terminated instead of blocking, and the error is rethrown
+    // once the queues have drained; the graph can then be run again.
+    void run()
+    {
+        if (running_) {
+            throw std::logic_error("jc::TaskGraph::run: the graph is already running");
+        }
+        running_ = true;
+        error_ = std::exception_ptr();
+        try {
+            enqueueAll();
+        }
+        catch (...) {
+            cancelHostTasks();
+            for (size_t q = 0; q < queues_.size(); ++q) {
+                try {
+                    queues_[q].finish();
+                }
+                catch (cl::Error &) {
+                }
+            }
+            running_ = false;
+            throw;
+        }
+    }
+
+    // waits for every task; rethrows what a host task threw
+    void wait()
+    {
+        if (host_.joinable()) {
+            host_.join();
+        }
+        running_ = false;
+        for (size_t q = 0; q < queues_.size(); ++q) {
+            queues_[q].finish();
+        }
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+    // event of task in the last run, for profiling
+    const cl::Event &event(TaskId task) const
+    {
+        return tasks_.at(task).event;
+    }
+
+    // nanoseconds from the first start to the last end of the device tasks
+    // of the last run; the queues are created with profiling enabled
+    cl_ulong elapsed() const
+    {
+        cl_ulong first = ~(cl_ulong)0, last = 0;
+        for (size_t id = 0; id < tasks_.size(); ++id) {
+            if (tasks_[id].type == HOST) continue;
+            first = std::min(first, tasks_[id].event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+            last = std::max(last, tasks_[id].event.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+        }
+        return last > first ? last - first : 0;
+    }
+
+private:
+    enum Type { KERNEL, WRITE_BUFFER, READ_BUFFER, HOST };
+
+    // status given to the event of a host task that failed or never ran,
+    // which terminates the device tasks waiting on it
+    static const cl_int HOST_TASK_FAILED = CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+
+    struct Task {
+        explicit Task(Type type) : type(type), host(NULL), bytes(0), offset(0) {}
+        Type type;
+        cl::Kernel kernel;
+        cl::NDRange global, local;
+        cl::Buffer buffer;
+        void *host;
+        size_t bytes, offset;
+        std::function<void()> fn;
+        std::vector<TaskId> deps;
+        cl::Event event;
+        cl::UserEvent done;  // completes host tasks
+    };
+
+    struct Access {
+        Access() : writer((TaskId)-1) {}
+        cl::Buffer buffer;  // held so that its handle is not reused by another buffer
+        TaskId writer;
+        std::vector<TaskId> readers;  // since the last write
+    };
+
+    static void addEdge(Task &t, TaskId before)
+    {
+        if (before != (TaskId)-1 && std::find(t.deps.begin(), t.deps.end(), before) == t.deps.end()) {
+            t.deps.push_back(before);
+        }
+    }
+
+    Access &access(const cl::Buffer &buffer)
+    {
+        Access &a = access_[buffer()];
+        if (a.buffer() == NULL) a.buffer = buffer;
+        return a;
+    }
+
+    TaskId add(Task &t, const std::vector<cl::Buffer> &reads, const std::vector<cl::Buffer> &writes)
+    {
+        if (running_) {
+            throw std::logic_error("jc::TaskGraph: tasks cannot be added while the graph runs");
+        }
+        TaskId id = tasks_.size();
+        for (size_t i = 0; i < reads.size(); ++i) {
+            Access &a = access(reads[i]);
+            addEdge(t, a.writer);
+        }
+        for (size_t i = 0; i < writes.size(); ++i) {
+            Access &a = access(writes[i]);
+            addEdge(t, a.writer);
+            for (size_t r = 0; r < a.readers.size(); ++r) {
+                if (a.readers[r] != id) addEdge(t, a.readers[r]);
+            }
+        }
+        // the accesses are recorded after all edges, so that a task reading
+        // and writing one buffer does not wait for itself
+        for (size_t i = 0; i < reads.size(); ++i) {
+            access(reads[i]).readers.push_back(id);
+        }
+        for (size_t i = 0; i < writes.size(); ++i) {
+            Access &a = access(writes[i]);
+            a.writer = id;
+            a.readers.clear();
+        }
+        tasks_.push_back(t);
+        return id;
+    }
+
+    void enqueueAll()
+    {
+        lastOnQueue_.assign(queues_.size(), (TaskId)-1);
+        size_t next = 0;
+        for (TaskId id = 0; id < tasks_.size(); ++id) {
+            tasks_[id].done = cl::UserEvent();
+        }
+
+        for (TaskId id = 0; id < tasks_.size(); ++id) {
+            Task &t = tasks_[id];
+            std::vector<cl::Event> waits;
+            for (size_t d = 0; d < t.deps.size(); ++d) {
+                waits.push_back(tasks_[t.deps[d]].event);
+            }
+            const std::vector<cl::Event> *waitList = waits.empty() ? NULL : &waits;
+
+            if (t.type == HOST) {
+                t.done = cl::UserEvent(context_);
+                t.event = t.done;
+                continue;
+            }
+            // continue a chain on the queue of its predecessor, else take turns
+            size_t q = next;
+            for (size_t d = 0; d < t.deps.size(); ++d) {
+                for (size_t k = 0; k < queues_.size(); ++k) {
+                    if (lastOnQueue_[k] == t.deps[d]) q = k;
+                }
+            }
+            if (q == next) next = (next + 1) % queues_.size();
+            lastOnQueue_[q] = id;
+            const cl::CommandQueue &queue = queues_[q];
+            Tracer &tracer = defaultTracer();
+            uint64_t enqueued = tracer.now();
+
+            switch (t.type) {
+            case KERNEL:
+                queue.enqueueNDRangeKernel(t.kernel, cl::NullRange, t.global, t.local, waitList, &t.event);
+                tracer.kernel(queue, t.kernel, t.event, enqueued);
+                break;
+            case WRITE_BUFFER:
+                queue.enqueueWriteBuffer(t.buffer, CL_FALSE, t.offset, t.bytes, t.host, waitList, &t.event);
+                tracer.command(queue, "write", "transfer", t.event, enqueued, t.bytes);
+                break;
+            case READ_BUFFER:
+                queue.enqueueReadBuffer(t.buffer, CL_FALSE, t.offset, t.bytes, t.host, waitList, &t.event);
+                tracer.command(queue, "read", "transfer", t.event, enqueued, t.bytes);
+                break;
+            default:
+                break;
+            }
+        }
+        for (size_t q = 0; q < queues_.size(); ++q) {
+            queues_[q].flush();
+        }
+
+        bool hasHostTasks = false;
+        for (TaskId id = 0; id < tasks_.size(); ++id) {
+            hasHostTasks = hasHostTasks || tasks_[id].type == HOST;
+        }
+        if (hasHostTasks) {
+            host_ = std::thread(&TaskGraph::runHostTasks, this);
+        }
+    }
+
+    // completes the user events of this run's host tasks with an error
+    void cancelHostTasks()
+    {
+        for (TaskId id = 0; id < tasks_.size(); ++id) {
+            if (tasks_[id].done() != NULL) {
+                try {
+                    tasks_[id].done.setStatus(HOST_TASK_FAILED);
+                }
+                catch (cl::Error &) {
+                }
+            }
+        }
+    }
+
+    void runHostTasks()
+    {
+        for (TaskId id = 0; id < tasks_.size(); ++id) {
+            Task &t = tasks_[id];
+            if (t.type != HOST) continue;
+            cl_int status = CL_COMPLETE;
+            try {
+                std::vector<cl::Event> waits;
+                for (size_t d = 0; d < t.deps.size(); ++d) {
+                    waits.push_back(tasks_[t.deps[d]].event);
+                }
+                if (!waits.empty()) {
+                    cl::Event::waitForEvents(waits);
+                }
+                if (error_) throw std::runtime_error("jc::TaskGraph: an earlier host task failed");
+                TraceScope scope("host task " + std::to_string(id), "task graph");
+                t.fn();
+            }
+            catch (...) {
+                if (!error_) error_ = std::current_exception();
+                // the device tasks waiting on this one are terminated
+                status = HOST_TASK_FAILED;
+            }
+            t.done.setStatus(status);
+        }
+    }
+
+    cl::Context context_;
+    std::vector<cl::CommandQueue> queues_;
+    std::vector<Task> tasks_;
+    std::map<cl_mem, Access> access_;
+    std::vector<TaskId> lastOnQueue_;
+    std::thread host_;
+    std::exception_ptr error_;
+    bool running_;
+};
+
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jc {
+
+// A fixed set of worker threads that execute index ranges in parallel.
+// The calling thread takes part in the work, so a pool of size 1 has no
+// extra threads and simply runs everything inline. An exception thrown by a
+// task skips the tasks not started yet and is rethrown by parallelFor once
+// the running ones are done.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned int nbrThreads = std::thread::hardware_concurrency())
+        : stop_(false), generation_(0), job_(nullptr), jobSize_(0), next_(0), busy_(0), error_(nullptr)
+    {
+        if (nbrThreads == 0) {
+            nbrThreads = 1;
+        }
+        for (unsigned int i = 1; i < nbrThreads; ++i) {
+            workers_.emplace_back(&ThreadPool::workerLoop, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &w : workers_) {
+            w.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool& operator=(const ThreadPool &) = delete;
+
+    unsigned int size() const
+    {
+        return static_cast<unsigned int>(workers_.size() + 1);
+    }
+
+    // calls fn(i) for every i in [0, n) and returns when all calls are done.
+    // Calls made from inside a pool task run serially on the calling thread.
+    void parallelFor(size_t n, const std::function<void(size_t)> &fn)
+    {
+        if (n == 0) {
+            return;
+        }
+        if (n == 1 || workers_.empty() || insideTask()) {
+            for (size_t i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> submitLock(submit_);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = &fn;
+            jobSize_ = n;
+            next_.store(0);
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        runTasks(fn, n);
+
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_.wait(lock, [this] { return busy_ == 0; });
+            job_ = nullptr;
+            error = error_;
+            error_ = nullptr;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // splits [0, n) into contiguous blocks of at least grain elements and
+    // calls fn(begin, end) for each of them in parallel
+    void parallelForRange(size_t n, size_t grain, const std::function<void(size_t, size_t)> &fn)
+    {
+        if (n == 0) {
+            return;
+        }
+        if (grain == 0) {
+            grain = 1;
+        }
+        size_t blocks = (n + grain - 1) / grain;
+        size_t maxBlocks = 4 * static_cast<size_t>(size());
+        if (blocks > maxBlocks) {
+            blocks = maxBlocks;
+        }
+        size_t blockSize = (n + blocks - 1) / blocks;
+        blocks = (n + blockSize - 1) / blockSize;
+        parallelFor(blocks, [&](size_t b) {
+            size_t begin = b * blockSize;
+            size_t end = begin + blockSize < n ? begin + blockSize : n;
+            fn(begin, end);
+        });
+    }
+
+private:
+    static bool& insideTask()
+    {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    void runTasks(const std::function<void(size_t)> &fn, size_t n)
+    {
+        insideTask() = true;
+        try {
+            for (size_t i = next_.fetch_add(1); i < n; i = next_.fetch_add(1)) {
+                fn(i);
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            next_.store(n);
+        }
+        insideTask() = false;
+    }
+
+    void workerLoop()
+    {
+        size_t seen = 0;
+        for (;;) {
+            const std::function<void(size_t)> *job;
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+                if (stop_) {
+                    return;
+                }
+                seen = generation_;
+                job = job_;
+                n = jobSize_;
+            }
+            runTasks(*job, n);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (--busy_ == 0) {
+                    done_.notify_one();
+                }
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex submit_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stop_;
+    size_t generation_;
+    const std::function<void(size_t)> *job_;
+    size_t jobSize_;
+    std::atomic<size_t> next_;
+    size_t busy_;
+    std::exception_ptr error_;  // first exception of the current job
+};
+
+// process-wide pool sized to the number of hardware threads
+inline ThreadPool& defaultThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+}
@@ -0,0 +1,484 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/deviceInfo.hpp>
+
+// Timeline of host and device activity, written as Chrome trace-event JSON
+// (open it in https://ui.perfetto.dev or chrome://tracing):
+//
+//     jc::defaultTracer().enable();
+//     {
+//         jc::TraceScope scope("build program");          // a host slice
+//         program = buildProgram(...);
+//     }
+//     jc::TracedQueue traced(queue);                      // device slices
+//     traced.enqueueWriteBuffer(in, CL_FALSE, 0, bytes, host);
+//     traced.enqueueNDRangeKernel(kernel, cl::NullRange, global, local);
+//     jc::defaultTracer().writeFile("trace.json");
+//
+// Every device gets a process in the timeline and every queue a track of
+// it; host scopes go to the track of their thread. runAndTimeKernel,
+// KernelFn, TaskGraph, runKernelAsync, readBufferAsync, FusedPipeline,
+// measureRoofline, OutOfCoreExecutor and MultiDeviceExecutor record their
+// commands as well; the other helpers (matrixCL, randomCL, verifyCL, ...)
+// do not. Device commands need queues with CL_QUEUE_PROFILING_ENABLE; their
+// device times are moved to the host clock by the largest offset (host
+// time before the enqueue) - (device QUEUED time) seen on the device, which
+// errs by at most the enqueue latency. Commands of queues without profiling
+// show as instants at their enqueue. While the tracer is disabled (the
+// default) recording costs a branch.
+//
+// The tracer does not keep the events of finished commands: every few
+// hundred commands, and on flush(), it reads the time stamps of those that
+// completed and releases their events. Beyond setLimit() records (a million
+// by default) new ones are dropped and counted in the file.
+
+namespace jc {
+
+class Tracer {
+public:
+    Tracer()
+        : enabled_(false), epoch_(std::chrono::steady_clock::now()), limit_(1 << 20), dropped_(0),
+          firstPending_(0), sinceResolve_(0)
+    {
+    }
+
+    Tracer(const Tracer &) = delete;
+    Tracer& operator=(const Tracer &) = delete;
+
+    void enable(bool on = true)
+    {
+        enabled_ = on;
+    }
+
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    // most host slices and commands kept; the ones beyond are dropped
+    void setLimit(size_t records)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        limit_ = records;
+    }
+
+    // host time in ns since the tracer was created
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    // a host slice from begin to end (ns of now()) on the calling thread
+    void hostSlice(const std::string &name, const std::string &category, uint64_t begin, uint64_t end)
+    {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (full()) return;
+        HostSlice s = { name, category, begin, end, threadTrack() };
+        host_.push_back(s);
+    }
+
+    // a command enqueued on queue at host time enqueued (now() before the
+    // enqueue call), completing event; bytes is 0 for kernels
+    void command(const cl::CommandQueue &queue, const std::string &name, const std::string &category,
+                 const cl::Event &event, uint64_t enqueued, size_t bytes = 0)
+    {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (full()) return;
+        Command c = Command();
+        c.name = name;
+        c.category = category;
+        c.event = event;
+        c.queue = queueTrack(queue);
+        c.enqueued = enqueued;
+        c.bytes = bytes;
+        commands_.push_back(c);
+        if (++sinceResolve_ == RESOLVE_EVERY) {
+            resolve(false);
+        }
+    }
+
+    void kernel(const cl::CommandQueue &queue, const cl::Kernel &kernel, const cl::Event &event, uint64_t enqueued)
+    {
+        if (!enabled_) return;
+        command(queue, kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel", event, enqueued);
+    }
+
+    // waits for the recorded commands and releases their events
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        resolve(true);
+    }
+
+    // Writes what was recorded so far. Waits for the recorded commands.
+    void write(std::ostream &os)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        resolve(true);
+
+        os << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":" << dropped_ << "},\"traceEvents\":[\n";
+        bool first = true;
+        auto sep = [&]() { os << (first ? "" : ",\n"); first = false; };
+
+        sep();
+        os << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":0,\"args\":{\"name\":\"host\"}}";
+        for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+            sep();
+            os << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":0,\"tid\":" << it->second
+               << ",\"args\":{\"name\":\"thread " << it->second << "\"}}";
+        }
+        std::map<int, std::string> devices;
+        for (auto it = queues_.begin(); it != queues_.end(); ++it) {
+            devices[it->second.pid] = it->second.device;
+            sep();
+            os << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << it->second.pid << ",\"tid\":" << it->second.tid
+               << ",\"args\":{\"name\":\"queue " << it->second.tid << "\"}}";
+        }
+        for (auto it = devices.begin(); it != devices.end(); ++it) {
+            sep();
+            os << "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":" << it->first
+               << ",\"args\":{\"name\":" << quote(it->second) << "}}";
+        }
+
+        for (size_t i = 0; i < host_.size(); ++i) {
+            const HostSlice &h = host_[i];
+            sep();
+            os << "{\"ph\":\"X\",\"name\":" << quote(h.name) << ",\"cat\":" << quote(h.category)
+               << ",\"pid\":0,\"tid\":" << h.tid << ",\"ts\":" << micro(h.begin) << ",\"dur\":" << micro(h.end - h.begin) << "}";
+        }
+        for (size_t i = 0; i < commands_.size(); ++i) {
+            const Command &c = commands_[i];
+            const QueueTrack &q = queues_[c.queue];
+            sep();
+            os << "{\"name\":" << quote(c.name) << ",\"cat\":" << quote(c.category)
+               << ",\"pid\":" << q.pid << ",\"tid\":" << q.tid;
+            if (c.profiled) {
+                const Command &s = c;
+                int64_t o = offset_[q.pid];
+                os << ",\"ph\":\"X\",\"ts\":" << micro(s.start + o) << ",\"dur\":" << micro(s.end - s.start)
+                   << ",\"args\":{\"queued_to_start_us\":" << micro(s.start - s.queued);
+            }
+            else {
+                os << ",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << micro(c.enqueued) << ",\"args\":{\"profiled\":false";
+            }
+            if (c.bytes) os << ",\"bytes\":" << c.bytes;
+            os << "}}";
+        }
+        os << "\n]}\n";
+    }
+
+    // writes to file path; false when the file cannot be written
+    bool writeFile(const std::string &path)
+    {
+        std::ofstream file(path.c_str());
+        if (!file) return false;
+        write(file);
+        return (bool)file;
+    }
+
+    // drops what was recorded
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        host_.clear();
+        commands_.clear();
+        offset_.clear();
+        dropped_ = 0;
+        firstPending_ = 0;
+        sinceResolve_ = 0;
+    }
+
+private:
+    struct HostSlice {
+        std::string name, category;
+        uint64_t begin, end;
+        int tid;
+    };
+
+    // commands are resolved between two calls of command()
+    static const size_t RESOLVE_EVERY = 256;
+
+    struct Command {
+        std::string name, category;
+        cl::Event event;            // released once resolved
+        cl_command_queue queue;
+        uint64_t enqueued;
+        size_t bytes;
+        bool resolved, profiled;
+        cl_ulong queued, start, end;
+    };
+
+    // with mutex_ held
+    bool full()
+    {
+        if (host_.size() + commands_.size() < limit_) return false;
+        ++dropped_;
+        return true;
+    }
+
+    // Reads the time stamps of the pending commands that completed (all of
+    // them, waiting, with wait) and releases their events. The device clock
+    // offset is the largest (host time before the enqueue) - (device QUEUED
+    // time) seen on the device.
+    void resolve(bool wait)
+    {
+        sinceResolve_ = 0;
+        for (size_t i = firstPending_; i < commands_.size(); ++i) {
+            Command &c = commands_[i];
+            if (c.resolved) continue;
+            try {
+                if (wait) {
+                    c.event.wait();
+                }
+                else if (c.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) {
+                    continue;   // still queued or running
+                }
+                c.queued = c.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+                c.start = c.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                c.end = c.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                c.profiled = true;
+                int pid = queues_[c.queue].pid;
+                int64_t o = (int64_t)c.enqueued - (int64_t)c.queued;
+                if (!offset_.count(pid) || o > offset_[pid]) offset_[pid] = o;
+            }
+            catch (cl::Error&) {
+                // no profiling on this queue, or the command failed
+            }
+            c.resolved = true;
+            c.event = cl::Event();
+        }
+        while (firstPending_ < commands_.size() && commands_[firstPending_].resolved) {
+            ++firstPending_;
+        }
+    }
+
+    struct QueueTrack {
+        cl::CommandQueue queue;     // held, so that its handle is not reused
+        int pid, tid;
+        std::string device;
+    };
+
+    int threadTrack()
+    {
+        std::thread::id id = std::this_thread::get_id();
+        auto it = threads_.find(id);
+        if (it == threads_.end()) {
+            it = threads_.insert(std::make_pair(id, (int)threads_.size())).first;
+        }
+        return it->second;
+    }
+
+    cl_command_queue queueTrack(const cl::CommandQueue &queue)
+    {
+        if (!queues_.count(queue())) {
+            cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+            auto it = devicePids_.find(device());
+            if (it == devicePids_.end()) {
+                it = devicePids_.insert(std::make_pair(device(), (int)devicePids_.size() + 1)).first;
+            }
+            QueueTrack t;
+            t.queue = queue;
+            t.pid = it->second;
+            t.tid = 0;
+            for (auto q = queues_.begin(); q != queues_.end(); ++q) {
+                if (q->second.pid == t.pid) ++t.tid;
+            }
+            t.device = deviceInfo(device).name;
+            queues_[queue()] = t;
+        }
+        return queue();
+    }
+
+    // trace-event times are in microseconds
+    static std::string micro(int64_t ns)
+    {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(3) << ns / 1000.0;
+        return oss.str();
+    }
+
+    static std::string quote(const std::string &s)
+    {
+        std::ostringstream oss;
+        oss << '"';
+        for (size_t i = 0; i < s.size(); ++i) {
+            unsigned char ch = s[i];
+            if (ch == '"' || ch == '\\') oss << '\\' << ch;
+            else if (ch < 0x20) oss << "\\u00" << "0123456789abcdef"[ch >> 4] << "0123456789abcdef"[ch & 15];
+            else oss << ch;
+        }
+        oss << '"';
+        return oss.str();
+    }
+
+    std::atomic<bool> enabled_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::mutex mutex_;
+    std::vector<HostSlice> host_;
+    std::vector<Command> commands_;
+    std::map<std::thread::id, int> threads_;
+    std::map<cl_command_queue, QueueTrack> queues_;
+    std::map<cl_device_id, int> devicePids_;
+    std::map<int, int64_t> offset_;    // host - device clock, per device process
+    size_t limit_;
+    uint64_t dropped_;
+    size_t firstPending_;               // commands before it are resolved
+    size_t sinceResolve_;
+};
+
+// process-wide tracer
+inline Tracer& defaultTracer()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+// records the host slice of its lifetime
+class TraceScope {
+public:
+    explicit TraceScope(const std::string &name, const std::string &category = "host", Tracer &tracer = defaultTracer())
+        : tracer_(tracer), name_(name), category_(category), begin_(tracer.now())
+    {
+    }
+
+    ~TraceScope()
+    {
+        tracer_.hostSlice(name_, category_, begin_, tracer_.now());
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope& operator=(const TraceScope &) = delete;
+
+private:
+    Tracer &tracer_;
+    std::string name_, category_;
+    uint64_t begin_;
+};
+
+// A command queue recording its enqueues in a tracer. The calls mirror those
+// of cl::CommandQueue; the event parameter may be NULL as there.
+class TracedQueue {
+public:
+    explicit TracedQueue(const cl::CommandQueue &queue, Tracer &tracer = defaultTracer())
+        : queue_(queue), tracer_(tracer)
+    {
+    }
+
+    operator const cl::CommandQueue&() const
+    {
+        return queue_;
+    }
+
+    const cl::CommandQueue &queue() const
+    {
+        return queue_;
+    }
+
+    void enqueueNDRangeKernel(const cl::Kernel &kernel, const cl::NDRange &offset, const cl::NDRange &global,
+                              const cl::NDRange &local = cl::NullRange,
+                              const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueNDRangeKernel(kernel, offset, global, local, events, &e);
+        tracer_.kernel(queue_, kernel, e, t);
+        if (event) *event = e;
+    }
+
+    void enqueueWriteBuffer(const cl::Buffer &buffer, cl_bool blocking, size_t offset, size_t size, const void *ptr,
+                            const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueWriteBuffer(buffer, blocking, offset, size, ptr, events, &e);
+        tracer_.command(queue_, "write", "transfer", e, t, size);
+        if (event) *event = e;
+    }
+
+    void enqueueReadBuffer(const cl::Buffer &buffer, cl_bool blocking, size_t offset, size_t size, void *ptr,
+                           const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueReadBuffer(buffer, blocking, offset, size, ptr, events, &e);
+        tracer_.command(queue_, "read", "transfer", e, t, size);
+        if (event) *event = e;
+    }
+
+    void enqueueCopyBuffer(const cl::Buffer &src, const cl::Buffer &dst, size_t srcOffset, size_t dstOffset, size_t size,
+                           const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueCopyBuffer(src, dst, srcOffset, dstOffset, size, events, &e);
+        tracer_.command(queue_, "copy", "transfer", e, t, size);
+        if (event) *event = e;
+    }
+
+    template <typename P>
+    void enqueueFillBuffer(const cl::Buffer &buffer, P pattern, size_t offset, size_t size,
+                           const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueFillBuffer<P>(buffer, pattern, offset, size, events, &e);
+        tracer_.command(queue_, "fill", "transfer", e, t, size);
+        if (event) *event = e;
+    }
+
+    void *enqueueMapBuffer(const cl::Buffer &buffer, cl_bool blocking, cl_map_flags flags, size_t offset, size_t size,
+                           const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        void *p = queue_.enqueueMapBuffer(buffer, blocking, flags, offset, size, events, &e);
+        tracer_.command(queue_, "map", "transfer", e, t, size);
+        if (event) *event = e;
+        return p;
+    }
+
+    void enqueueUnmapMemObject(const cl::Memory &memory, void *mapped,
+                               const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL) const
+    {
+        cl::Event e;
+        uint64_t t = tracer_.now();
+        queue_.enqueueUnmapMemObject(memory, mapped, events, &e);
+        tracer_.command(queue_, "unmap", "transfer", e, t);
+        if (event) *event = e;
+    }
+
+    void flush() const
+    {
+        queue_.flush();
+    }
+
+    void finish() const
+    {
+        queue_.finish();
+    }
+
+private:
+    cl::CommandQueue queue_;
+    Tracer &tracer_;
+};
+
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include <JC/threadPool.hpp>
+
+// Blocked transposition of row-major data. The matrix is walked in
+// TILE x TILE tiles so that both the reads and the writes of one tile stay
+// in L1; inside a tile full 8x8 (float) or 4x4 (double) sub-blocks are
+// transposed in registers when AVX is available. Rows of tiles are
+// distributed over a ThreadPool.
+
+namespace jc {
+
+namespace transpose_detail {
+
+    const size_t TILE = 64;
+
+    // dst (cols x rows, leading dimension ldd) = transpose of src (rows x cols)
+    template <typename T>
+    void scalarBlock(const T *src, size_t lds, T *dst, size_t ldd, size_t rows, size_t cols)
+    {
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < cols; ++j) {
+                dst[j*ldd + i] = src[i*lds + j];
+            }
+        }
+    }
+
+    template <typename T>
+    struct Kernel {
+        static const size_t W = 1;
+        static void run(const T *src, size_t lds, T *dst, size_t ldd)
+        {
+            dst[0] = src[0];
+            (void)lds; (void)ldd;
+        }
+    };
+
+#if defined(__AVX__)
+    template <>
+    struct Kernel<float> {
+        static const size_t W = 8;
+        static void run(const float *src, size_t lds, float *dst, size_t ldd)
+        {
+            __m256 r0 = _mm256_loadu_ps(src + 0*lds);
+            __m256 r1 = _mm256_loadu_ps(src + 1*lds);
+            __m256 r2 = _mm256_loadu_ps(src + 2*lds);
+            __m256 r3 = _mm256_loadu_ps(src + 3*lds);
+            __m256 r4 = _mm256_loadu_ps(src + 4*lds);
+            __m256 r5 = _mm256_loadu_ps(src + 5*lds);
+            __m256 r6 = _mm256_loadu_ps(src + 6*lds);
+            __m256 r7 = _mm256_loadu_ps(src + 7*lds);
+
+            __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+            __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+            __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+            __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+            __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+            __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+            __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+            __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+
+            __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+            _mm256_storeu_ps(dst + 0*ldd, _mm256_permute2f128_ps(s0, s4, 0x20));
+            _mm256_storeu_ps(dst + 1*ldd, _mm256_permute2f128_ps(s1, s5, 0x20));
+            _mm256_storeu_ps(dst + 2*ldd, _mm256_permute2f128_ps(s2, s6, 0x20));
+            _mm256_storeu_ps(dst + 3*ldd, _mm256_permute2f128_ps(s3, s7, 0x20));
+            _mm256_storeu_ps(dst + 4*ldd, _mm256_permute2f128_ps(s0, s4, 0x31));
+            _mm256_storeu_ps(dst + 5*ldd, _mm256_permute2f128_ps(s1, s5, 0x31));
+            _mm256_storeu_ps(dst + 6*ldd, _mm256_permute2f128_ps(s2, s6, 0x31));
+            _mm256_storeu_ps(dst + 7*ldd, _mm256_permute2f128_ps(s3, s7, 0x31));
+        }
+    };
+
+    template <>
+    struct Kernel<double> {
+        static const size_t W = 4;
+        static void run(const double *src, size_t lds, double *dst, size_t ldd)
+        {
+            __m256d r0 = _mm256_loadu_pd(src + 0*lds);
+            __m256d r1 = _mm256_loadu_pd(src + 1*lds);
+            __m256d r2 = _mm256_loadu_pd(src + 2*lds);
+            __m256d r3 = _mm256_loadu_pd(src + 3*lds);
+
+            __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+            __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+            __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+            __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+
+            _mm256_storeu_pd(dst + 0*ldd, _mm256_permute2f128_pd(t0, t2, 0x20));
+            _mm256_storeu_pd(dst + 1*ldd, _mm256_permute2f128_pd(t1, t3, 0x20));
+            _mm256_storeu_pd(dst + 2*ldd, _mm256_permute2f128_pd(t0, t2, 0x31));
+            _mm256_storeu_pd(dst + 3*ldd, _mm256_permute2f128_pd(t1, t3, 0x31));
+        }
+    };
+#endif
+
+    // transposes one tile: register kernels on the full W x W sub-blocks,
+    // scalar code on the ragged right and bottom edges
+    template <typename T>
+    void tile(const T *src, size_t lds, T *dst, size_t ldd, size_t rows, size_t cols)
+    {
+        const size_t W = Kernel<T>::W;
+        if (W == 1) {
+            scalarBlock(src, lds, dst, ldd, rows, cols);
+            return;
+        }
+        size_t fullRows = rows - rows % W;
+        size_t fullCols = cols - cols % W;
+        for (size_t i = 0; i < fullRows; i += W) {
+            for (size_t j = 0; j < fullCols; j += W) {
+                Kernel<T>::run(src + i*lds + j, lds, dst + j*ldd + i, ldd);
+            }
+        }
+        scalarBlock(src + fullCols, lds, dst + fullCols*ldd, ldd, rows, cols - fullCols);
+        scalarBlock(src + fullRows*lds, lds, dst + fullRows, ldd, rows - fullRows, fullCols);
+    }
+
+} // namespace transpose_detail
+
+// dst (cols x rows) = transpose of src (rows x cols), both row-major and
+// non-overlapping
+template <typename T>
+void transpose(const T *src, T *dst, size_t rows, size_t cols, ThreadPool &pool = defaultThreadPool())
+{
+    using namespace transpose_detail;
+    size_t tileRows = (rows + TILE - 1) / TILE;
+    size_t tileCols = (cols + TILE - 1) / TILE;
+    pool.parallelFor(tileRows * tileCols, [&](size_t t) {
+        size_t i = (t / tileCols) * TILE;
+        size_t j = (t % tileCols) * TILE;
+        tile(src + i*cols + j, cols, dst + j*rows + i, rows,
+             std::min(TILE, rows - i), std::min(TILE, cols - j));
+    });
+}
+
+// transposes the n x n row-major matrix a in place. Off-diagonal tiles are
+// swapped pairwise through two small buffers, diagonal tiles in place.
+template <typename T>
+void transposeInPlace(T *a, size_t n, ThreadPool &pool = defaultThreadPool())
+{
+    using namespace transpose_detail;
+    size_t tiles = (n + TILE - 1) / TILE;
+    // one task per tile pair (bi <= bj), enumerated over the upper triangle
+    size_t pairs = tiles * (tiles + 1) / 2;
+    pool.parallelFor(pairs, [&](size_t p) {
+        size_t bi = 0, rowLength = tiles;
+        while (p >= rowLength) {
+            p -= rowLength;
+            --rowLength;
+            ++bi;
+        }
+        size_t bj = bi + p;
+        size_t i = bi * TILE, j = bj * TILE;
+        size_t h = std::min(TILE, n - i), w = std::min(TILE, n - j);
+
+        if (bi == bj) {
+            for (size_t r = 0; r < h; ++r) {
+                for (size_t c = r + 1; c < w; ++c) {
+                    std::swap(a[(i + r)*n + j + c], a[(j + c)*n + i + r]);
+                }
+            }
+            return;
+        }
+
+        T upper[TILE * TILE], lower[TILE * TILE];
+        // upper = transpose(tile(i, j)) (w x h), lower = transpose(tile(j, i)) (h x w)
+        tile(a + i*n + j, n, upper, h, h, w);
+        tile(a + j*n + i, n, lower, w, w, h);
+        for (size_t r = 0; r < h; ++r) {
+            std::copy(lower + r*w, lower + r*w + w, a + (i + r)*n + j);
+        }
+        for (size_t r = 0; r < w; ++r) {
+            std::copy(upper + r*h, upper + r*h + h, a + (j + r)*n + i);
+        }
+    });
+}
+
+}
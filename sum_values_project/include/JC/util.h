@@ -10,18 +10,15 @@
 #include <cmath>  // log, pow, ...
 #include <cstring> // strncmp
 
+#include <JC/allocator.hpp> // closestMultiple
+#include <JC/random.hpp>
+#include <JC/verify.hpp>
+
 using namespace std;
 
 #define TOLERANCE 0.01
 bool PRINT_DATA = false; // set this to true to print input & output data. Use this to debug
 
-// return smallest x >= size that is a multiple of the divisor
-unsigned int closestMultiple(unsigned int size, unsigned int divisor)
-{
-    unsigned int remainder = size % divisor;
-    return remainder == 0 ? size : size - remainder + divisor;
-}
-
 #ifdef WIN32
 #include <direct.h>  // http://www.codebind.com/cprogramming/get-current-directory-using-c-program/  also linux
 #define GetCurrentDir _getcwd
@@ -85,14 +82,11 @@ float sumArray(float ARRAY[], int size) {
 		sum += ARRAY[i];
 	return sum;
 }
+// array of size values uniform in [MIN_NUMBER, MAX_NUMBER), reproducible for a given seed
 template <class T>
-T* initializeArray(const int size, const T MIN_NUMBER, const T MAX_NUMBER) {
-	srand(time(NULL)); // random initial seed
-
+T* initializeArray(const int size, const T MIN_NUMBER, const T MAX_NUMBER, uint64_t seed = jc::DEFAULT_SEED) {
 	T* array = new T[size];
-	//T SCALE = ;
-	for (int i = 0; i < size; i++)
-		array[i] = rand() * (MAX_NUMBER - MIN_NUMBER) / (RAND_MAX + 1) + MIN_NUMBER;
+	jc::generateUniformParallel(seed, 0, size, MIN_NUMBER, MAX_NUMBER, array);
 	return array;
 }
 
@@ -131,39 +125,29 @@ bool closeEnough(float a, float b, float resolution)
 }
 
 template <class T>
-bool checkIfResultsAreTheSame(T* arr3, T* arr4, int n, bool PRINT) {
-	int nbr_diff = 0;
-	for (int i = 0; i < n; i++) {
-		if (arr3[i] != arr4[i]) {
-			nbr_diff++;
-			if (PRINT && nbr_diff < 10)
-				cout <<"["<<i<<"] "<< arr3[i] << "<>" << arr4[i] << endl;
+bool reportVerification(const T* arr3, const T* arr4, const jc::VerifyResult& result, bool PRINT) {
+	if (PRINT) {
+		for (size_t k = 0; k < result.first.size(); k++) {
+			size_t i = result.first[k];
+			cout << "[" << i << "] " << arr3[i] << "<>" << arr4[i] << endl;
 		}
 	}
-	if (nbr_diff > 0)
-		cout << "Results CPU-GPU are not the same: " << nbr_diff << " differences!!!!!!" << endl;
+	if (result.mismatches > 0)
+		cout << "Results CPU-GPU are not the same: " << result.mismatches << " differences!!!!!!" << endl;
 	else
 		cout << "Results of CPU and GPU are the same. OK. " << endl;
-	return nbr_diff == 0;
+	return result.ok();
 }
 
-// use this one for floating point types
+template <class T>
+bool checkIfResultsAreTheSame(T* arr3, T* arr4, int n, bool PRINT) {
+	return reportVerification(arr3, arr4, jc::verify(arr3, arr4, n, jc::Tolerance::exact(), 9), PRINT);
+}
+
+// use this one for floating point types, precision is the allowed relative difference
 template <class T>
 bool checkIfResultsAreTheSame(T* arr3, T* arr4, int n, T precision, bool PRINT) {
-	int nbr_diff = 0;
-	for (int i = 0; i < n; i++) {
-		T rel_diff = arr3[i] == arr4[i] ? 0 : abs(arr3[i] - arr4[i]) / (arr3[i] == 0 ? arr4[i] : arr3[i]);
-		if (rel_diff > precision) {
-			nbr_diff++;
-			if (PRINT && nbr_diff < 10)
-				cout << "[" << i << "] " << arr3[i] << "<>" << arr4[i] << endl;
-		}
-	}
-	if (nbr_diff > 0)
-		cout << "Results CPU-GPU are not the same: " << nbr_diff << " differences!!!!!!" << endl;
-	else
-		cout << "Results of CPU and GPU are the same. OK. " << endl;
-	return nbr_diff == 0;
+	return reportVerification(arr3, arr4, jc::verify(arr3, arr4, n, jc::Tolerance::relative(precision), 9), PRINT);
 }
 // ******** STATISTICS ***********
 template <class T> T minimalValue(T* values, int NBR) {
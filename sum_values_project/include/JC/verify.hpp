@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include <JC/threadPool.hpp>
+
+// Comparison of large result arrays: one pass over the data, in parallel,
+// with a branch-free inner loop the compiler can vectorize. Only the number
+// of mismatches and the indices of the first few are collected.
+
+namespace jc {
+
+enum ToleranceMode {
+    TOLERANCE_EXACT = 0,     // a == b
+    TOLERANCE_ABSOLUTE = 1,  // |a - b| <= value
+    TOLERANCE_RELATIVE = 2,  // |a - b| <= value * max(|a|, |b|)
+    TOLERANCE_ULP = 3        // a and b at most ulps representable values apart
+};
+
+struct Tolerance {
+    ToleranceMode mode;
+    double value;
+    uint64_t ulps;
+
+    static Tolerance exact()
+    {
+        Tolerance t = { TOLERANCE_EXACT, 0, 0 };
+        return t;
+    }
+
+    static Tolerance absolute(double value)
+    {
+        Tolerance t = { TOLERANCE_ABSOLUTE, value, 0 };
+        return t;
+    }
+
+    static Tolerance relative(double value)
+    {
+        Tolerance t = { TOLERANCE_RELATIVE, value, 0 };
+        return t;
+    }
+
+    static Tolerance ulp(uint64_t ulps)
+    {
+        Tolerance t = { TOLERANCE_ULP, 0, ulps };
+        return t;
+    }
+};
+
+struct VerifyResult {
+    size_t mismatches;
+    std::vector<size_t> first;  // ascending indices of the first mismatches
+
+    bool ok() const
+    {
+        return mismatches == 0;
+    }
+};
+
+namespace verify_detail {
+
+// Elements equal in value always match, so +-0 and equal infinities pass in
+// every mode; NaN never matches.
+template <typename T, ToleranceMode Mode, bool Float = std::is_floating_point<T>::value>
+struct Match;
+
+template <typename T, bool Float>
+struct Match<T, TOLERANCE_EXACT, Float> {
+    Match(const Tolerance &) {}
+    bool operator()(T a, T b) const { return a == b; }
+};
+
+template <typename T>
+struct Match<T, TOLERANCE_ABSOLUTE, true> {
+    T tol;
+    Match(const Tolerance &t) : tol((T)t.value) {}
+    bool operator()(T a, T b) const { return a == b || std::abs(a - b) <= tol; }
+};
+
+template <typename T>
+struct Match<T, TOLERANCE_RELATIVE, true> {
+    T tol;
+    Match(const Tolerance &t) : tol((T)t.value) {}
+    bool operator()(T a, T b) const
+    {
+        return a == b || std::abs(a - b) <= tol * std::max(std::abs(a), std::abs(b));
+    }
+};
+
+// IEEE values as integers that are ordered like the values they represent
+template <typename T> struct Ordered;
+
+template <> struct Ordered<float> {
+    typedef int32_t type;
+    static int64_t get(float x)
+    {
+        int32_t i;
+        std::memcpy(&i, &x, sizeof i);
+        return i < 0 ? (int64_t)INT32_MIN - i : i;
+    }
+};
+
+template <> struct Ordered<double> {
+    typedef int64_t type;
+    static int64_t get(double x)
+    {
+        int64_t i;
+        std::memcpy(&i, &x, sizeof i);
+        return i < 0 ? INT64_MIN - i : i;
+    }
+};
+
+template <typename T>
+struct Match<T, TOLERANCE_ULP, true> {
+    uint64_t ulps;
+    Match(const Tolerance &t) : ulps(t.ulps) {}
+    bool operator()(T a, T b) const
+    {
+        int64_t ia = Ordered<T>::get(a);
+        int64_t ib = Ordered<T>::get(b);
+        uint64_t d = ia > ib ? (uint64_t)ia - (uint64_t)ib : (uint64_t)ib - (uint64_t)ia;
+        return a == b || (d <= ulps && a == a && b == b);
+    }
+};
+
+// integers: the distance is the difference, relative is computed in double
+template <typename T>
+struct Match<T, TOLERANCE_ABSOLUTE, false> {
+    double tol;
+    Match(const Tolerance &t) : tol(t.value) {}
+    bool operator()(T a, T b) const { return std::abs((double)a - (double)b) <= tol; }
+};
+
+template <typename T>
+struct Match<T, TOLERANCE_RELATIVE, false> {
+    double tol;
+    Match(const Tolerance &t) : tol(t.value) {}
+    bool operator()(T a, T b) const
+    {
+        double x = (double)a, y = (double)b;
+        return std::abs(x - y) <= tol * std::max(std::abs(x), std::abs(y));
+    }
+};
+
+template <typename T>
+struct Match<T, TOLERANCE_ULP, false> {
+    double tol;
+    Match(const Tolerance &t) : tol((double)t.ulps) {}
+    bool operator()(T a, T b) const { return std::abs((double)a - (double)b) <= tol; }
+};
+
+// elements per task; also the unit in which the inner loop counts
+const size_t CHUNK = 1 << 16;
+const size_t BLOCK = 256;
+
+// counts the mismatches of [begin, end) and appends the first ones to result
+template <typename T, typename M>
+void verifyRange(const T *a, const T *b, size_t begin, size_t end, const M &match,
+                 size_t maxReported, VerifyResult &result)
+{
+    for (size_t i = begin; i < end; i += BLOCK) {
+        size_t e = std::min(i + BLOCK, end);
+        size_t count = 0;
+        for (size_t j = i; j < e; ++j) {
+            count += match(a[j], b[j]) ? 0 : 1;
+        }
+        // the indices are only looked for in the rare blocks that differ
+        for (size_t j = i; count > 0 && j < e && result.first.size() < maxReported; ++j) {
+            if (!match(a[j], b[j])) result.first.push_back(j);
+        }
+        result.mismatches += count;
+    }
+}
+
+template <typename T, typename M>
+VerifyResult verifyWith(const T *a, const T *b, size_t n, const M &match, size_t maxReported,
+                        ThreadPool &pool)
+{
+    size_t chunks = (n + CHUNK - 1) / CHUNK;
+    std::vector<VerifyResult> partial(chunks);
+    pool.parallelFor(chunks, [&](size_t c) {
+        partial[c].mismatches = 0;
+        verifyRange(a, b, c * CHUNK, std::min((c + 1) * CHUNK, n), match, maxReported, partial[c]);
+    });
+
+    VerifyResult result;
+    result.mismatches = 0;
+    for (size_t c = 0; c < chunks; ++c) {
+        result.mismatches += partial[c].mismatches;
+        for (size_t k = 0; k < partial[c].first.size() && result.first.size() < maxReported; ++k) {
+            result.first.push_back(partial[c].first[k]);
+        }
+    }
+    return result;
+}
+
+}
+
+// compares expected and actual element by element
+template <typename T>
+VerifyResult verify(const T *expected, const T *actual, size_t n,
+                    const Tolerance &tolerance = Tolerance::exact(), size_t maxReported = 10,
+                    ThreadPool &pool = defaultThreadPool())
+{
+    using namespace verify_detail;
+    switch (tolerance.mode) {
+    case TOLERANCE_ABSOLUTE:
+        return verifyWith(expected, actual, n, Match<T, TOLERANCE_ABSOLUTE>(tolerance), maxReported, pool);
+    case TOLERANCE_RELATIVE:
+        return verifyWith(expected, actual, n, Match<T, TOLERANCE_RELATIVE>(tolerance), maxReported, pool);
+    case TOLERANCE_ULP:
+        return verifyWith(expected, actual, n, Match<T, TOLERANCE_ULP>(tolerance), maxReported, pool);
+    default:
+        return verifyWith(expected, actual, n, Match<T, TOLERANCE_EXACT>(tolerance), maxReported, pool);
+    }
+}
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+
+#include <JC/bufferPool.hpp>
+#include <JC/dataCL.hpp>
+#include <JC/verify.hpp>
+
+// jc::verify on the device, for results that are already there: only the
+// per work-group counts and the indices of the first mismatches are read
+// back, not the data. The program passed in must have been built from
+// verify_kernels.ocl, embedded by jc_embed_kernels (JC/kernelRegistry.hpp):
+//     cl::Program program = jc::buildProgram("verify_kernels.ocl", context, device);
+// For float and double the mismatches found are the ones jc::verify finds on
+// the host; for integers the absolute and relative tolerances are applied in
+// float on the device.
+
+namespace jc {
+
+template <typename T> struct CompareKernel;
+template <> struct CompareKernel<float> {
+    typedef cl_float tolerance_type;
+    static const char *name() { return "compareFloat"; }
+};
+template <> struct CompareKernel<double> {
+    typedef cl_double tolerance_type;
+    static const char *name() { return "compareDouble"; }
+};
+template <> struct CompareKernel<int> {
+    typedef cl_float tolerance_type;
+    static const char *name() { return "compareInt"; }
+};
+template <> struct CompareKernel<unsigned int> {
+    typedef cl_float tolerance_type;
+    static const char *name() { return "compareUint"; }
+};
+
+// number of work-groups the comparison is spread over
+const size_t VERIFY_GROUPS = 256;
+// work-group size, a power of two
+const size_t VERIFY_LOCAL_SIZE = 256;
+
+// compares the first n elements of expected and actual
+template <typename T>
+VerifyResult verifyOnDevice(const cl::CommandQueue &queue, const cl::Program &program,
+                            const cl::Buffer &expected, const cl::Buffer &actual, size_t n,
+                            const Tolerance &tolerance = Tolerance::exact(), size_t maxReported = 10)
+{
+    VerifyResult result;
+    result.mismatches = 0;
+    if (n == 0) {
+        return result;
+    }
+    const size_t local = VERIFY_LOCAL_SIZE;
+    size_t groups = std::min(VERIFY_GROUPS, (n + local - 1) / local);
+    size_t chunk = (n + groups - 1) / groups;
+    // the kernel records at least one index per group, so that the buffer is never empty
+    cl_uint K = (cl_uint)std::max<size_t>(maxReported, 1);
+
+    cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+    PooledBuffer counts = defaultBufferPool().acquire(context, groups * sizeof(cl_uint), CL_MEM_WRITE_ONLY);
+    PooledBuffer indices = defaultBufferPool().acquire(context, groups * K * sizeof(cl_ulong), CL_MEM_WRITE_ONLY);
+
+    cl::Kernel kernel(program, CompareKernel<T>::name());
+    kernel.setArg<cl::Buffer>(0, expected);
+    kernel.setArg<cl::Buffer>(1, actual);
+    kernel.setArg<cl_ulong>(2, (cl_ulong)n);
+    kernel.setArg<cl_ulong>(3, (cl_ulong)chunk);
+    kernel.setArg<cl_uint>(4, (cl_uint)tolerance.mode);
+    kernel.setArg<typename CompareKernel<T>::tolerance_type>(5, (typename CompareKernel<T>::tolerance_type)tolerance.value);
+    kernel.setArg<cl_ulong>(6, (cl_ulong)tolerance.ulps);
+    kernel.setArg<cl_uint>(7, K);
+    kernel.setArg<cl::Buffer>(8, counts);
+    kernel.setArg<cl::Buffer>(9, indices);
+    kernel.setArg(10, local * sizeof(cl_uint), NULL);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(groups * local), cl::NDRange(local));
+
+    std::vector<cl_uint> groupCounts(groups);
+    queue.enqueueReadBuffer(counts, CL_TRUE, 0, groups * sizeof(cl_uint), groupCounts.data());
+
+    // the groups are in index order: read the indices of the groups holding
+    // the first maxReported mismatches only
+    for (size_t g = 0; g < groups; ++g) {
+        result.mismatches += groupCounts[g];
+        size_t want = std::min<size_t>(groupCounts[g], maxReported - result.first.size());
+        if (want > 0) {
+            std::vector<cl_ulong> found(want);
+            queue.enqueueReadBuffer(indices, CL_TRUE, g * K * sizeof(cl_ulong), want * sizeof(cl_ulong), found.data());
+            result.first.insert(result.first.end(), found.begin(), found.end());
+        }
+    }
+    return result;
+}
+
+// compares the device copies of expected and actual, uploading only what is stale there
+template <typename T>
+VerifyResult verifyOnDevice(const cl::CommandQueue &queue, const cl::Program &program,
+                            MirroredData<T> &expected, MirroredData<T> &actual,
+                            const Tolerance &tolerance = Tolerance::exact(), size_t maxReported = 10)
+{
+    if (expected.size() != actual.size()) {
+        throw std::invalid_argument("jc::verifyOnDevice: sizes differ");
+    }
+    const cl::Buffer &a = expected.device_buffer(queue, READ);
+    const cl::Buffer &b = actual.device_buffer(queue, READ);
+    return verifyOnDevice<T>(queue, program, a, b, expected.size(), tolerance, maxReported);
+}
+
+}
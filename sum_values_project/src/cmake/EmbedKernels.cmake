@@ -0,0 +1,116 @@
+# Compiles .ocl kernel files into an executable, see JC/kernelRegistry.hpp:
+#
+#     jc_embed_kernels(sumNums SOURCES ../all_kernels.ocl [SPIRV ../array_kernels.ocl ...])
+#
+# SOURCES are embedded as text. With JC_KERNELS_SPIRV on, the files listed
+# under SPIRV (which must also be in SOURCES and build without -D options)
+# are compiled to SPIR-V with clang and llvm-spirv and embedded too.
+#
+# Included from CMakeLists.txt this file defines jc_embed_kernels; run with
+# cmake -P it writes the generated source (OUTPUT, NAMES, FILES, SPIRV_FILES).
+
+if(CMAKE_SCRIPT_MODE_FILE)
+	# NAMES, FILES and SPIRV_FILES come as |-separated lists, SPIRV_FILES
+	# with a - for files without SPIR-V
+	string(REPLACE "|" ";" names "${NAMES}")
+	string(REPLACE "|" ";" files "${FILES}")
+	string(REPLACE "|" ";" spirv_files "${SPIRV_FILES}")
+
+	# 16 bytes per line
+	set(line_regex)
+	foreach(i RANGE 15)
+		string(APPEND line_regex "0x[0-9a-f][0-9a-f],")
+	endforeach()
+
+	function(jc_bytes file var)
+		file(READ "${file}" hex HEX)
+		string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+		string(REGEX REPLACE "(${line_regex})" "\\1\n\t" bytes "${bytes}")
+		set(${var} "${bytes}" PARENT_SCOPE)
+	endfunction()
+
+	set(text "// generated by EmbedKernels.cmake, do not edit\n\n#include <JC/kernelRegistry.hpp>\n\nnamespace {\n")
+	list(LENGTH names count)
+	math(EXPR last "${count} - 1")
+	foreach(i RANGE ${last})
+		list(GET names ${i} name)
+		list(GET files ${i} file)
+		list(GET spirv_files ${i} spirv)
+		string(MAKE_C_IDENTIFIER "${name}" id)
+		jc_bytes("${file}" bytes)
+		# a terminating 0 keeps the array from being empty
+		string(APPEND text "\nconstexpr unsigned char ${id}[] = {\n\t${bytes}0x00\n};\n")
+		if(spirv STREQUAL "-")
+			string(APPEND text "const jc::KernelRegistration ${id}_registration(\"${name}\", ${id}, sizeof(${id}) - 1);\n")
+		else()
+			jc_bytes("${spirv}" bytes)
+			string(APPEND text "constexpr unsigned char ${id}_spirv[] = {\n\t${bytes}0x00\n};\n")
+			string(APPEND text "const jc::KernelRegistration ${id}_registration(\"${name}\", ${id}, sizeof(${id}) - 1,\n\t${id}_spirv, sizeof(${id}_spirv) - 1);\n")
+		endif()
+	endforeach()
+	string(APPEND text "\n}\n")
+	file(WRITE "${OUTPUT}" "${text}")
+	return()
+endif()
+
+set(JC_EMBED_KERNELS_SCRIPT ${CMAKE_CURRENT_LIST_FILE})
+
+if(JC_KERNELS_SPIRV)
+	find_program(JC_CLANG clang)
+	find_program(JC_LLVM_SPIRV llvm-spirv)
+	if(NOT JC_CLANG OR NOT JC_LLVM_SPIRV)
+		message(WARNING "JC_KERNELS_SPIRV needs clang and llvm-spirv, only the kernel sources are embedded")
+	endif()
+endif()
+
+function(jc_embed_kernels target)
+	cmake_parse_arguments(EMBED "" "" "SOURCES;SPIRV" ${ARGN})
+
+	set(spirv_paths)
+	foreach(file ${EMBED_SPIRV})
+		get_filename_component(path ${file} ABSOLUTE)
+		list(APPEND spirv_paths ${path})
+	endforeach()
+
+	set(names)
+	set(files)
+	set(spirv_files)
+	set(depends)
+	foreach(file ${EMBED_SOURCES})
+		get_filename_component(path ${file} ABSOLUTE)
+		get_filename_component(name ${file} NAME)
+		list(APPEND names ${name})
+		list(APPEND files ${path})
+		list(APPEND depends ${path})
+		list(FIND spirv_paths ${path} index)
+		if(index GREATER -1 AND JC_KERNELS_SPIRV AND JC_CLANG AND JC_LLVM_SPIRV)
+			set(bc ${CMAKE_CURRENT_BINARY_DIR}/${name}.bc)
+			set(spv ${CMAKE_CURRENT_BINARY_DIR}/${name}.spv)
+			# -O0 like the -cl-opt-disable of the source build, so both give
+			# the same results
+			add_custom_command(OUTPUT ${spv}
+				COMMAND ${JC_CLANG} -c -x cl -cl-std=CL1.2 -target spir64 -O0 -emit-llvm
+					-Xclang -finclude-default-header -o ${bc} ${path}
+				COMMAND ${JC_LLVM_SPIRV} ${bc} -o ${spv}
+				DEPENDS ${path}
+				COMMENT "Compiling ${name} to SPIR-V"
+				VERBATIM)
+			list(APPEND spirv_files ${spv})
+			list(APPEND depends ${spv})
+		else()
+			list(APPEND spirv_files "-")
+		endif()
+	endforeach()
+
+	string(REPLACE ";" "|" names "${names}")
+	string(REPLACE ";" "|" files "${files}")
+	string(REPLACE ";" "|" spirv_files "${spirv_files}")
+	set(output ${CMAKE_CURRENT_BINARY_DIR}/${target}_kernels.cpp)
+	add_custom_command(OUTPUT ${output}
+		COMMAND ${CMAKE_COMMAND} -DOUTPUT=${output} "-DNAMES=${names}" "-DFILES=${files}"
+			"-DSPIRV_FILES=${spirv_files}" -P ${JC_EMBED_KERNELS_SCRIPT}
+		DEPENDS ${depends} ${JC_EMBED_KERNELS_SCRIPT}
+		COMMENT "Embedding OpenCL kernels into ${target}"
+		VERBATIM)
+	target_sources(${target} PRIVATE ${output})
+endfunction()
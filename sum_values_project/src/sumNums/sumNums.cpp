@@ -1,4 +1,5 @@
 #include <exception>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -9,7 +10,15 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp> // CL namespace
 #include <JC/util.h>
+#include <JC/bufferPool.hpp>
+#include <JC/fusion.hpp>
+#include <JC/instrument.hpp>
+#include <JC/kernelFn.hpp>
 #include <JC/openCLUtil.hpp>  // JC namespace
+#include <JC/perfCounters.hpp>
+#include <JC/roofline.hpp>
+#include <JC/taskGraph.hpp>
+#include <JC/trace.hpp>
 
 using namespace std;
 bool PRESS_KEY_TO_CLOSE_WINDOW = true; // when running from within visual studio
@@ -37,6 +46,9 @@ cl::Program buildProgram(
 	sources.push_back(source);
 	cl::Program program(context, sources);
 	std::string options = "-D N=" + std::to_string(amount);
+	// lets jc::KernelFn check the argument types, from OpenCL C 1.2 on
+	if (jc::deviceInfo(device).openCLCVersion.compare("OpenCL C 1.2") >= 0)
+		options += " -cl-kernel-arg-info";
 	try {
 		program.build(devices, options.c_str());
 	}
@@ -54,10 +66,12 @@ cl::Program buildProgram(
 
 
 
+// the CPU reference of the kernels, measured with hardware counters
 template <class T1, class T2>
-int64_t sumOfNums(T1 *dest, T2 num, int flag)
+jc::CounterSample sumOfNums(T1 *dest, T2 num, int flag, jc::PerfCounters& counters)
 {
-	chrono::time_point<chrono::system_clock> start = chrono::system_clock::now();
+	JC_TIMED_SCOPE("sumOfNums");
+	counters.start();
 
 	T1 result = 0; 
 
@@ -72,14 +86,15 @@ int64_t sumOfNums(T1 *dest, T2 num, int flag)
     if (flag * result)
         dest[0] = result; //won't be executed
 
-	return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now() - start).count();
+	return counters.stop();
 }
 
 void print_table_title() {
-	cout << "    ***** Version Name *****     | min(us)   | mean(us)  | stddev    | GOp/s     |  GB/s     |   CPI     | speedup   |";
+	cout << "    ***** Version Name *****     | min(ns)   | mean(ns)  | stddev    | GOp/s     |  GB/s     |   CPI     | speedup   |";
 	cout << endl;
 }
 
+// times in nanoseconds, the unit of jc::runAndTimeKernel
 void print_row(string name, long long time, long long time_mean, long long time_stddev, long long nbrOperations, long long nbrBytes, long long ticksPerMilliSecond, long long referenceTime) {
 	const char separator = ' ';
 	const int nameWidth = 32;
@@ -91,21 +106,21 @@ void print_row(string name, long long time, long long time_mean, long long time_
 	cout << right << setw(numWidth) << setfill(separator) << time << " | ";
 	cout << right << setw(numWidth) << setfill(separator) << time_mean << " | ";
 	cout << right << setw(numWidth - 4) << setfill(separator) << (time_stddev * 100.0 / time_mean) << "% | ";
-	cout << right << setw(numWidth) << setfill(separator) << (float)nbrOperations / time / 1000 << " | ";
-	cout << right << setw(numWidth) << setfill(separator) << (float)nbrBytes / time / 1000 << " | ";
-	float total_nbr_cycles = (float)(time * (ticksPerMilliSecond / 1000));
+	cout << right << setw(numWidth) << setfill(separator) << (float)nbrOperations / time << " | ";
+	cout << right << setw(numWidth) << setfill(separator) << (float)nbrBytes / time << " | ";
+	float total_nbr_cycles = (float)time * ticksPerMilliSecond / 1000000;
 	cout << right << setw(numWidth) << setfill(separator) << ((float)total_nbr_cycles / nbrOperations) << " | ";
 	cout << right << setw(numWidth) << setfill(separator) << (float)referenceTime / time << " | ";
 	cout << endl;
 }
 
-void analyzePerformance(vector<string> names, long long runtimes[NBR_ALGORITHM_VERSIONS][NBR_EXPERIMENTS], long long totalNbrOfOperations, long long totalNbrOfBytes, long long ticksPerMilliSecond, long long referenceTime) {
+void analyzePerformance(vector<string> names, long long runtimes[NBR_ALGORITHM_VERSIONS][NBR_EXPERIMENTS], const vector<long long>& nbrOfOperations, const vector<long long>& nbrOfBytes, long long ticksPerMilliSecond, long long referenceTime) {
 	print_table_title();
 	for (int v = 0; v < names.size(); v++) {
 		long long time = minimalValue(runtimes[v], NBR_EXPERIMENTS);
 		long long time_mean = meanValue(runtimes[v], NBR_EXPERIMENTS);
 		long long time_stddev = stddev(runtimes[v], NBR_EXPERIMENTS);
-		print_row(names[v], time, time_mean, time_stddev, totalNbrOfOperations, totalNbrOfBytes, ticksPerMilliSecond, referenceTime);
+		print_row(names[v], time, time_mean, time_stddev, nbrOfOperations[v], nbrOfBytes[v], ticksPerMilliSecond, referenceTime);
 	}
 }
 
@@ -137,8 +152,10 @@ long long stddev(long long* values, int NBR) {
 int main(int argc, char *argv[])
 {
 
-	if (argsContainsOption('h', argc, argv) || argsContainsUnknownOption("dhps", argc, argv)) {
-		cout << "Usage: " << argv[0] << " -p <platform ID> -d <device ID> -s <array size>" << endl;
+	if (argsContainsOption('h', argc, argv) || argsContainsUnknownOption("dhprst", argc, argv)) {
+		cout << "Usage: " << argv[0] << " -p <platform ID> -d <device ID> -s <array size> -t -r" << endl;
+		cout << "       without -p and -d the fastest device on a probe kernel is used" << endl;
+		cout << "       -t writes a timeline to trace.json, -r the roofline to roofline.csv and roofline.svg" << endl;
 		return 0;
 	}
 	if (argc > 1)
@@ -148,7 +165,8 @@ int main(int argc, char *argv[])
 		// *0* Configuration
 		string kernel_file("all_kernels.ocl");
 
-		int PLATFORM_ID = defaultOrViaArgs(1, 'p', argc, argv);
+		bool BY_INDEX = argsContainsOption('p', argc, argv) || argsContainsOption('d', argc, argv);
+		int PLATFORM_ID = defaultOrViaArgs(0, 'p', argc, argv);
 		int DEVICE_ID = defaultOrViaArgs(0, 'd', argc, argv);
 		// TODO: array_size is not used deleting it is better?
 		unsigned int array_size = defaultOrViaArgs(1000, 's', argc, argv); // DESTINATION array size
@@ -156,8 +174,14 @@ int main(int argc, char *argv[])
 		float num_float = NUM_FLOAT;
 		int flag = 0;
    		
+		// with -t every command and the main host phases end up in trace.json
+		bool TRACE = argsContainsOption('t', argc, argv);
+		bool ROOFLINE_FILES = argsContainsOption('r', argc, argv);
+		jc::defaultTracer().enable(TRACE);
+
 		// *1* OpenCL initialization
-		cl::Device device = jc::getDevice(PLATFORM_ID, DEVICE_ID, PRESS_KEY_TO_CLOSE_WINDOW);
+		cl::Device device = BY_INDEX ? jc::getDevice(PLATFORM_ID, DEVICE_ID)
+		                             : jc::selectDevice(jc::DeviceQuery().fastest());
 
 		cl::Context context(device);
 		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
@@ -169,9 +193,10 @@ int main(int argc, char *argv[])
        
 
 		// *3* Allocate memory on the device
-        cl::Buffer dest_buffer0(context, CL_MEM_WRITE_ONLY, array_size*sizeof(cl_int));
-		cl::Buffer dest_buffer1(context, CL_MEM_WRITE_ONLY, array_size * sizeof(cl_float));
-		cl::Buffer dest_buffer2(context, CL_MEM_WRITE_ONLY, array_size * sizeof(cl_float));
+		jc::BufferPool& pool = jc::defaultBufferPool();
+		jc::PooledBuffer dest_buffer0 = pool.acquire(context, array_size * sizeof(cl_int), CL_MEM_WRITE_ONLY);
+		jc::PooledBuffer dest_buffer1 = pool.acquire(context, array_size * sizeof(cl_float), CL_MEM_WRITE_ONLY);
+		jc::PooledBuffer dest_buffer2 = pool.acquire(context, array_size * sizeof(cl_float), CL_MEM_WRITE_ONLY);
 
 		
 		float starting_float = 1.1f;
@@ -197,64 +222,79 @@ int main(int argc, char *argv[])
 
 		long long runtimes[NBR_ALGORITHM_VERSIONS][NBR_EXPERIMENTS];
 		vector<string> names;
+		// per version: each work-item adds N (the kernels' N, the work group size) numbers;
+		// with flag 0 nothing is stored, so there is no global memory traffic
+		vector<long long> operations, bytes;
 
 		int work_group_size = 256;
 		int work_items = N / 256;
 		for (int i = 0; i < 9; ++i) {
 			
 			// compile time with N macro equals to work_group_size
-			cl::Program program = buildProgram(kernel_file, context, device, work_group_size);
-
-			// Prepare the kernel parameters
-			cl::Kernel kernel01(program, "intSum");
-			// set the kernel arguments
-			kernel01.setArg<cl::Buffer>(0, dest_buffer0);
-			kernel01.setArg<cl_uint>(1, num_int);
-			kernel01.setArg<cl_uint>(2, flag);
-			kernel01.setArg<cl_uint>(3, expected_sum_int);
-
-
-			cl::Kernel kernel02(program, "floatSum");
-			// set the kernel arguments
-			kernel02.setArg<cl::Buffer>(0, dest_buffer1);
-			kernel02.setArg<cl_float>(1, num_float);
-			kernel02.setArg<cl_uint>(2, flag);
-			kernel02.setArg<cl_float>(3, expected_sum_float);
-
-
-			cl::Kernel kernel03(program, "mixSum");
-			// set the kernel arguments
-			kernel03.setArg<cl::Buffer>(0, dest_buffer2);
-			kernel03.setArg<cl_uint>(1, num_int);
-			kernel03.setArg<cl_uint>(2, flag);
-			kernel03.setArg<cl_float>(3, starting_float);
-			kernel03.setArg<cl_float>(4, expected_sum_mix);
+			cl::Program program;
+			{
+				jc::TraceScope scope("build program g=" + to_string(work_group_size));
+				program = buildProgram(kernel_file, context, device, work_group_size);
+			}
+
+			// Prepare the kernel parameters, typed as in all_kernels.ocl
+			jc::KernelFn<cl::Buffer, cl_int, cl_int, cl_int> kernel01(program, "intSum");
+			kernel01.setArgs(dest_buffer0, num_int, flag, expected_sum_int);
+
+			jc::KernelFn<cl::Buffer, cl_float, cl_int, cl_float> kernel02(program, "floatSum");
+			kernel02.setArgs(dest_buffer1, num_float, flag, expected_sum_float);
+
+			jc::KernelFn<cl::Buffer, cl_int, cl_int, cl_float, cl_float> kernel03(program, "mixSum");
+			kernel03.setArgs(dest_buffer2, num_int, flag, starting_float, expected_sum_mix);
 			
 			std::cout << "WS" << work_group_size << std::endl;
 			cl::NDRange global(N);
 			cl::NDRange local(work_group_size);
 
+			// the three kernels write different buffers, so the graph lets them run concurrently
+			jc::TaskGraph graph(context, device);
+			graph.addKernel(kernel01.kernel(), global, local, {}, { dest_buffer0 });
+			graph.addKernel(kernel02.kernel(), global, local, {}, { dest_buffer1 });
+			graph.addKernel(kernel03.kernel(), global, local, {}, { dest_buffer2 });
+
 			for (int t = 0; t < NBR_EXPERIMENTS; ++t) {
-				int version = 3 * i;
+				int version = 4 * i;
 				// transfer source data from the host to the device
 
-				runtimes[version++][t] = jc::runAndTimeKernel(kernel01, queue, global, local);
+				runtimes[version++][t] = jc::runAndTimeKernel(kernel01.kernel(), queue, global, local);
 				if (t == 0) {
 						names.push_back("GPU INT+INT ");
+						operations.push_back((long long)N * work_group_size);
+						bytes.push_back(0);
 						names.back() += "g=";
 						names.back() += to_string(work_group_size);
 				}
 				
-				runtimes[version++][t] = jc::runAndTimeKernel(kernel02, queue, global, local); // , local
+				runtimes[version++][t] = jc::runAndTimeKernel(kernel02.kernel(), queue, global, local); // , local
 				if (t == 0) {
 					names.push_back("GPU FLOAT+FLOAT");
+					operations.push_back((long long)N * work_group_size);
+					bytes.push_back(0);
 					names.back() += "g=";
 					names.back() += to_string(work_group_size);
 				}
 
-				runtimes[version++][t] = jc::runAndTimeKernel(kernel03, queue, global, local); // , local	
+				runtimes[version++][t] = jc::runAndTimeKernel(kernel03.kernel(), queue, global, local); // , local	
 				if (t == 0) {
 					names.push_back("GPU FLOAT+INT");
+					operations.push_back((long long)N * work_group_size);
+					bytes.push_back(0);
+					names.back() += "g=";
+					names.back() += to_string(work_group_size);
+				}
+
+				graph.run();
+				graph.wait();
+				runtimes[version++][t] = graph.elapsed();
+				if (t == 0) {
+					names.push_back("GPU ALL THREE ");
+					operations.push_back(3LL * N * work_group_size);
+					bytes.push_back(0);
 					names.back() += "g=";
 					names.back() += to_string(work_group_size);
 				}
@@ -263,7 +303,73 @@ int main(int argc, char *argv[])
 			work_group_size /= 2;
 		}
 		long long referenceTime = minimalValue(runtimes[0], NBR_EXPERIMENTS);
-		analyzePerformance(names, runtimes, array_size, array_size * sizeof(float), 0, referenceTime);
+		long long ticksPerMilliSecond = 1000LL * jc::clockFrequency(device);
+		analyzePerformance(names, runtimes, operations, bytes, ticksPerMilliSecond, referenceTime);
+
+		// the same sums on the host, fastest of NBR_EXPERIMENTS runs
+		jc::PerfCounters counters;
+		if (!counters.available())
+			cout << endl << "No hardware counters (see /proc/sys/kernel/perf_event_paranoid): steady clock and TSC only" << endl;
+		jc::CounterSample cpuSamples[3];
+		for (int t = 0; t < NBR_EXPERIMENTS; ++t) {
+			jc::TraceScope scope("CPU reference");
+			jc::CounterSample s[3] = { sumOfNums(cpu_dst, NUM_INT, flag, counters),
+			                           sumOfNums(cpu_dst_f, (float)NUM_FLOAT, flag, counters),
+			                           sumOfNums(cpu_dst_f, NUM_INT, flag, counters) };
+			for (int k = 0; k < 3; ++k)
+				if (t == 0 || s[k].seconds < cpuSamples[k].seconds)
+					cpuSamples[k] = s[k];
+		}
+		cout << endl << "CPU INT+INT     : " << cpuSamples[0] << endl;
+		cout << "CPU FLOAT+FLOAT : " << cpuSamples[1] << endl;
+		cout << "CPU FLOAT+INT   : " << cpuSamples[2] << endl;
+
+		// *6* saxpy followed by the sum of y: one fused kernel against two
+		jc::FusedPipeline<float> saxpySum;
+		saxpySum.input("x").inout("y").scalar("a", 2.0f).stage("y", "a * x + y").reduce("y");
+		jc::PooledBuffer x_buffer = pool.acquire(context, array_size * sizeof(cl_float), CL_MEM_READ_ONLY);
+		jc::PooledBuffer y_buffer = pool.acquire(context, array_size * sizeof(cl_float));
+		{
+			jc::TraceScope scope("data generation");
+			vector<float> ones(array_size, 1.0f);
+			jc::TracedQueue traced(queue);
+			traced.enqueueWriteBuffer(x_buffer, CL_TRUE, 0, array_size * sizeof(cl_float), ones.data());
+			traced.enqueueWriteBuffer(y_buffer, CL_TRUE, 0, array_size * sizeof(cl_float), ones.data());
+		}
+		cout << endl << "saxpy + sum of " << array_size << " floats" << endl;
+		jc::FusionBenchmark<float> fusion;
+		{
+			jc::TraceScope scope("fusion benchmark");
+			fusion = jc::benchmarkFusion(saxpySum, queue, { { "x", x_buffer }, { "y", y_buffer } }, array_size);
+		}
+		cout << fusion << endl;
+
+		// *7* how close each version comes to the limits of the device
+		jc::Roofline peaks;
+		{
+			jc::TraceScope scope("roofline microbenchmarks");
+			peaks = jc::measureRoofline(queue);
+		}
+		jc::RooflineReport roofline(peaks);
+		for (size_t v = 0; v < names.size(); ++v)
+			roofline.add(names[v], operations[v], bytes[v], minimalValue(runtimes[v], NBR_EXPERIMENTS) * 1e-9);
+		roofline.add("saxpy+sum unfused", 3.0 * array_size, fusion.unfused.bytes, fusion.unfused.seconds);
+		roofline.add("saxpy+sum fused", 3.0 * array_size, fusion.fused.bytes, fusion.fused.seconds);
+		cout << endl << roofline;
+		if (ROOFLINE_FILES) {
+			ofstream csv("roofline.csv"), svg("roofline.svg");
+			roofline.csv(csv);
+			roofline.svg(svg);
+			cout << "Roofline written to roofline.csv and roofline.svg" << endl;
+		}
+
+		if (TRACE && jc::defaultTracer().writeFile("trace.json"))
+			cout << "Timeline written to trace.json (open it in https://ui.perfetto.dev)" << endl;
+
+#if JC_INSTRUMENTATION
+		cout << endl << "Host hot paths:" << endl;
+		jc::instrumentation().report(cout);
+#endif
 
 
         // *9* Deallocate memory
@@ -0,0 +1,476 @@
+#include <climits>
+#include <cmath>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <JC/asyncKernel.hpp>
+#include <JC/coExecution.hpp>
+#include <JC/fusion.hpp>
+#include <JC/gemm.hpp>
+#include <JC/instrument.hpp>
+#include <JC/matrixCL.hpp>
+#include <JC/matrixExprCL.hpp>
+#include <JC/multiDevice.hpp>
+#include <JC/openCLUtil.hpp>
+#include <JC/random.hpp>
+#include <JC/randomCL.hpp>
+#include <JC/threadPool.hpp>
+#include <JC/verifyCL.hpp>
+
+using namespace std;
+
+// Checks the kernels of src/*.ocl, and the host code they mirror, against
+// plain CPU references. The host checks always run; the device ones run on
+// the first OpenCL device and are skipped when there is none.
+
+int failures = 0;
+
+#define CHECK(condition, what) \
+	do { \
+		if (!(condition)) { \
+			cerr << "FAILED: " << what << " (line " << __LINE__ << ")" << endl; \
+			++failures; \
+		} \
+	} while (0)
+
+bool closeTo(double a, double b, double relative)
+{
+	return fabs(a - b) <= relative * max(1.0, max(fabs(a), fabs(b)));
+}
+
+void testThreadPoolExceptions()
+{
+	jc::ThreadPool pool(4);
+	bool caught = false;
+	try {
+		pool.parallelFor(100, [](size_t i) { if (i == 37) throw runtime_error("task 37"); });
+	}
+	catch (runtime_error& e) {
+		caught = string(e.what()) == "task 37";
+	}
+	CHECK(caught, "parallelFor rethrows the exception of a task");
+
+	// the pool is still usable afterwards
+	vector<int> hits(100, 0);
+	pool.parallelFor(hits.size(), [&](size_t i) { hits[i] = 1; });
+	int sum = 0;
+	for (size_t i = 0; i < hits.size(); ++i) sum += hits[i];
+	CHECK(sum == 100, "parallelFor after an exception runs every task");
+}
+
+void testGemm(size_t m, size_t n, size_t k)
+{
+	vector<float> a(m * k), b(k * n), c(m * n, 1.0f);
+	jc::generateUniform<float>(1, 0, a.size(), -1.0f, 1.0f, a.data());
+	jc::generateUniform<float>(2, 0, b.size(), -1.0f, 1.0f, b.data());
+	jc::gemm<float>(m, n, k, 2.0f, a.data(), k, b.data(), n, 0.5f, c.data(), n);
+
+	size_t wrong = 0;
+	for (size_t i = 0; i < m; ++i) {
+		for (size_t j = 0; j < n; ++j) {
+			double ref = 0.5;
+			for (size_t x = 0; x < k; ++x) ref += 2.0 * a[i*k + x] * b[x*n + j];
+			if (!closeTo(c[i*n + j], ref, 1e-4)) ++wrong;
+		}
+	}
+	CHECK(wrong == 0, "gemm " << m << "x" << n << "x" << k << ": " << wrong << " wrong elements");
+}
+
+// every event is counted, however many threads record how fast
+void testInstrumentation()
+{
+#if JC_INSTRUMENTATION
+	const int perThread = 100000;
+	auto work = [] {
+		for (int i = 0; i < perThread; ++i) {
+			JC_TIMED_SCOPE("kernelTests timer");
+			JC_COUNT("kernelTests counter", i);
+		}
+	};
+	thread a(work), b(work);
+	a.join();
+	b.join();
+	work();
+
+	vector<jc::SiteStats> stats = jc::instrumentation().snapshot();
+	for (size_t s = 0; s < stats.size(); ++s) {
+		if (stats[s].name == "kernelTests timer") {
+			CHECK(stats[s].count == 3 * perThread, "timer count " << stats[s].count << " of " << 3 * perThread);
+		}
+		if (stats[s].name == "kernelTests counter") {
+			uint64_t inBuckets = 0;
+			for (int b = 0; b < jc::SiteStats::BUCKETS; ++b) inBuckets += stats[s].buckets[b];
+			CHECK(stats[s].count == 3 * perThread && inBuckets == stats[s].count && stats[s].max == perThread - 1,
+			      "counter count " << stats[s].count << ", " << inBuckets << " in buckets, of " << 3 * perThread);
+		}
+	}
+#endif
+}
+
+jc::KernelTiming timingFrom(cl_ulong start, cl_ulong end)
+{
+	jc::KernelTiming t = { start - 2, start - 1, start, end };
+	return t;
+}
+
+// then() and when_all() on ready futures; they need no device
+void testFutures()
+{
+	jc::DeviceFuture<int> two = jc::makeReadyFuture(2, timingFrom(100, 150));
+	jc::DeviceFuture<double> half = two.then([](const int& v) { return v / 4.0; });
+	CHECK(half.get() == 0.5 && half.timing().nanoseconds() == 50, "then() passes the value and the timing on");
+
+	// a continuation returning a future is flattened
+	jc::DeviceFuture<int> flat = two.then([](const int& v) { return jc::makeReadyFuture(v * 10, timingFrom(200, 260)); });
+	CHECK(flat.get() == 20 && flat.timing().nanoseconds() == 60, "then() flattens a returned future, got " << flat.get());
+
+	// a throwing continuation fails its future, and the error skips later ones
+	bool called = false;
+	jc::DeviceFuture<int> failed = two.then([](const int&) -> int { throw runtime_error("continuation"); });
+	jc::DeviceFuture<int> after = failed.then([&](const int& v) { called = true; return v; });
+	string error;
+	try {
+		after.get();
+	}
+	catch (runtime_error& e) {
+		error = e.what();
+	}
+	CHECK(error == "continuation" && !called, "an error of then() reaches get() and skips later continuations");
+
+	error.clear();
+	try {
+		two.then([](const int&) -> jc::DeviceFuture<int> { throw runtime_error("flattened"); }).get();
+	}
+	catch (runtime_error& e) {
+		error = e.what();
+	}
+	CHECK(error == "flattened", "an error of a continuation returning a future reaches get()");
+
+	vector<jc::DeviceFuture<int> > all;
+	all.push_back(jc::makeReadyFuture(1, timingFrom(300, 400)));
+	all.push_back(jc::makeReadyFuture(2, timingFrom(100, 200)));
+	all.push_back(jc::makeReadyFuture(3, timingFrom(150, 350)));
+	jc::DeviceFuture<vector<int> > joined = jc::when_all(all);
+	jc::KernelTiming span = joined.timing();
+	CHECK(joined.get() == vector<int>({ 1, 2, 3 }), "when_all keeps the order of its inputs");
+	CHECK(span.queued == 98 && span.start == 100 && span.end == 400,
+	      "when_all spans " << span.start << " to " << span.end << ", expected 100 to 400");
+	CHECK(jc::when_all(vector<jc::DeviceFuture<int> >()).get().empty(), "when_all of nothing is ready and empty");
+
+	all[1] = failed;
+	error.clear();
+	try {
+		jc::when_all(all).get();
+	}
+	catch (runtime_error& e) {
+		error = e.what();
+	}
+	CHECK(error == "continuation", "an error of one input of when_all reaches get()");
+}
+
+bool contains(const string& text, const string& part)
+{
+	return text.find(part) != string::npos;
+}
+
+// the generated sources and the traffic model of FusedPipeline; nothing runs
+void testFusionSources()
+{
+	set<string> names = jc::fusion_detail::identifiers("2e-3f * x + 1.5f*y1 - _t / .5");
+	CHECK(names == set<string>({ "x", "y1", "_t" }), "identifiers skips numbers, found " << names.size() << " names");
+
+	// a temporary feeding a later stage, stored to an output only array
+	jc::FusedPipeline<float> chain;
+	chain.input("x").output("z").scalar("a", 2.0f).stage("t", "a * x * 2e-3f").stage("z", "t + x");
+	string fused = chain.source(), unfused = chain.unfusedSource();
+	CHECK(contains(fused, "float x = g_x[i];") && !contains(fused, "g_z[i];") && !contains(fused, "g_t"),
+	      "the fused kernel loads the input only and keeps the temporary in a register:\n" << fused);
+	CHECK(contains(fused, "float t = a * x * 2e-3f;") && contains(fused, "g_z[i] = z;"),
+	      "the fused kernel computes the temporary and stores the output:\n" << fused);
+	CHECK(contains(unfused, "__global float* g_t") && contains(unfused, "float t = g_t[i];")
+	      && contains(unfused, "g_t[i] = a * x * 2e-3f;") && !contains(unfused, "float z = g_z[i];"),
+	      "the unfused stages pass the temporary through global memory:\n" << unfused);
+	const size_t n = 1000;
+	CHECK(chain.fusedBytes(n) == 2 * n * sizeof(float), "fused traffic " << chain.fusedBytes(n));
+	CHECK(chain.unfusedBytes(n) == 5 * n * sizeof(float), "unfused traffic " << chain.unfusedBytes(n));
+
+	// a reduction of an input, with no stage
+	jc::FusedPipeline<float> largest;
+	largest.input("x").reduce("x", jc::FUSE_MAX);
+	fused = largest.source();
+	CHECK(contains(fused, "float acc = -INFINITY;") && contains(fused, "acc = fmax(acc, x);") && !contains(fused, "g_x[i] ="),
+	      "the fused max reduction of an input:\n" << fused);
+	CHECK(contains(largest.unfusedSource(), "__kernel void reduceStage") && !contains(largest.unfusedSource(), "stage0"),
+	      "the unfused max reduction of an input is one kernel");
+	CHECK(largest.fusedBytes(n) == n * sizeof(float) + jc::FUSION_GROUPS * sizeof(float)
+	      && largest.unfusedBytes(n) == largest.fusedBytes(n), "reduction traffic " << largest.fusedBytes(n));
+
+	// no element: the reduction is its identity, and nothing is enqueued
+	cl::CommandQueue none;
+	jc::FusedPipeline<float> smallest;
+	smallest.input("x").reduce("x", jc::FUSE_MIN);
+	jc::PipelineRun<float> r = smallest.run(none, map<string, cl::Buffer>(), 0);
+	CHECK(r.value == INFINITY && r.kernels == 0, "min of no element " << r.value);
+	jc::FusedPipeline<int> integers;
+	integers.input("k").reduce("k", jc::FUSE_MAX);
+	CHECK(integers.runUnfused(none, map<string, cl::Buffer>(), 0).value == INT_MIN, "max of no int");
+	CHECK(contains(integers.source(), "int acc = (int)-2147483648;"), "int max identity:\n" << integers.source());
+}
+
+void testExpressions(const cl::Context& context, const cl::CommandQueue& queue)
+{
+	const unsigned int rows = 37, cols = 53;
+	jc::Matrix<float> x(rows, cols), y(rows, cols), c(rows, cols);
+	jc::generateUniform<float>(3, 0, rows * cols, -2.0f, 2.0f, x.data());
+	jc::generateUniform<float>(4, 0, rows * cols, 0.0f, 2.0f, y.data());
+	jc::generateUniform<float>(5, 0, rows * cols, -1.0f, 1.0f, c.data());
+
+	jc::Matrix<float> host, device;
+	host = 2.0f * x + elementwiseSqrt(y) - elementwiseAbs(c);
+	jc::evaluateOnDevice(device, 2.0f * x + elementwiseSqrt(y) - elementwiseAbs(c), context, queue);
+
+	size_t wrong = 0;
+	for (unsigned int i = 0; i < rows * cols; ++i) {
+		double ref = 2.0 * x.data()[i] + sqrt((double)y.data()[i]) - fabs((double)c.data()[i]);
+		if (!closeTo(host.data()[i], ref, 1e-5) || !closeTo(device.data()[i], ref, 1e-5)) ++wrong;
+	}
+	CHECK(device.rows() == rows && device.cols() == cols, "fused expression shape");
+	CHECK(wrong == 0, "fused expression: " << wrong << " wrong elements");
+
+	jc::Matrix<float> empty, result;
+	jc::evaluateOnDevice(result, 2.0f * empty, context, queue);
+	CHECK(result.rows() == 0, "fused expression of an empty matrix");
+}
+
+void testTranspose(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program)
+{
+	const unsigned int rows = 45, cols = 70;
+	jc::Matrix<float> m(rows, cols);
+	jc::generateUniform<float>(7, 0, rows * cols, -1.0f, 1.0f, m.data());
+	jc::Matrix<float> t = jc::transposeOnDevice(m, context, queue, program);
+	size_t wrong = 0;
+	for (unsigned int i = 0; i < rows; ++i) {
+		for (unsigned int j = 0; j < cols; ++j) {
+			if (t.data()[j * rows + i] != m.data()[i * cols + j]) ++wrong;
+		}
+	}
+	CHECK(t.rows() == cols && t.cols() == rows && wrong == 0, "transpose: " << wrong << " wrong elements");
+}
+
+void testPhilox(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& program)
+{
+	const size_t n = 100003;
+	const uint64_t seed = 42;
+	vector<float> host(n), device(n);
+	jc::generateUniform<float>(seed, 0, n, -3.0f, 5.0f, host.data());
+	cl::Buffer buffer(context, CL_MEM_READ_WRITE, n * sizeof(float));
+	jc::DeviceUniformDistribution<float> uniform(program, -3.0f, 5.0f, seed);
+	uniform.fill_n(queue, buffer, n);
+	queue.enqueueReadBuffer(buffer, CL_TRUE, 0, n * sizeof(float), device.data());
+	CHECK(host == device, "Philox uniform floats are bit identical on host and device");
+
+	vector<unsigned int> hostInt(n), deviceInt(n);
+	jc::generateUniform<unsigned int>(seed, 0, n, 10u, 1000u, hostInt.data());
+	cl::Buffer intBuffer(context, CL_MEM_READ_WRITE, n * sizeof(unsigned int));
+	jc::DeviceUniformDistribution<unsigned int> uniformInt(program, 10u, 1000u, seed);
+	uniformInt.fill_n(queue, intBuffer, n);
+	queue.enqueueReadBuffer(intBuffer, CL_TRUE, 0, n * sizeof(unsigned int), deviceInt.data());
+	CHECK(hostInt == deviceInt, "Philox uniform uints are identical on host and device");
+}
+
+void testVerify(const cl::Context& context, const cl::CommandQueue& queue, const cl::Program& verifier)
+{
+	const size_t n = 1 << 20;
+	vector<float> x(n);
+	jc::generateUniform<float>(6, 0, n, 0.0f, 1.0f, x.data());
+	vector<float> y(x);
+	y[5] += 1.0f;
+	y[n / 2] = -y[n / 2];
+	y[n - 1] += 1e-3f;
+	cl::Buffer expected(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(float), x.data());
+	cl::Buffer actual(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(float), y.data());
+	jc::VerifyResult r = jc::verifyOnDevice<float>(queue, verifier, expected, actual, n);
+	CHECK(r.mismatches == 3 && r.first.size() == 3 && r.first[0] == 5 && r.first[2] == n - 1,
+	      "verifyOnDevice counts the mismatches, " << r.mismatches << " found");
+}
+
+void testReductions(const cl::CommandQueue& queue, const cl::Program& arrays)
+{
+	const size_t n = 1 << 20;
+	vector<float> x(n);
+	jc::generateUniform<float>(6, 0, n, 0.0f, 1.0f, x.data());
+	double ref = 0;
+	for (size_t i = 0; i < n; ++i) ref += x[i];
+
+	// the same bits whichever side sums which block
+	jc::CoExecutor executor(queue);
+	executor.setMode(jc::HOST_ONLY);
+	float hostSum = jc::sumCoExecute(executor, arrays, x.data(), n);
+	executor.setMode(jc::DEVICE_ONLY);
+	float deviceSum = jc::sumCoExecute(executor, arrays, x.data(), n);
+	CHECK(closeTo(deviceSum, ref, 1e-5), "blockSumReduce on the device");
+	CHECK(deviceSum == hostSum, "blockSumReduce on the device " << deviceSum << ", on the host " << hostSum);
+	executor.setMode(jc::CO_EXECUTE);
+	for (int run = 0; run < 3; ++run) {
+		float sum = jc::sumCoExecute(executor, arrays, x.data(), n);
+		CHECK(sum == deviceSum, "co-executed sum " << sum << ", on the device " << deviceSum);
+	}
+}
+
+// an OpenCL error of the device side reaches the caller, and the executor
+// is usable afterwards
+void testCoExecutionErrors(const cl::CommandQueue& queue)
+{
+	jc::CoExecutor executor(queue, jc::defaultThreadPool(), 64);
+	bool caught = false;
+	try {
+		executor.forEach(1 << 16, [](size_t, size_t) {},
+		                 [](cl::CommandQueue&, size_t, size_t) { throw cl::Error(CL_OUT_OF_RESOURCES, "clEnqueueNDRangeKernel"); });
+	}
+	catch (cl::Error& e) {
+		caught = e.err() == CL_OUT_OF_RESOURCES;
+	}
+	CHECK(caught, "a device error is rethrown by forEach");
+
+	vector<int> hits(1 << 16, 0);
+	executor.forEach(hits.size(),
+	                 [&](size_t b, size_t e) { for (size_t i = b; i < e; ++i) ++hits[i]; },
+	                 [&](cl::CommandQueue&, size_t b, size_t e) { for (size_t i = b; i < e; ++i) ++hits[i]; });
+	size_t once = 0;
+	for (size_t i = 0; i < hits.size(); ++i) once += hits[i] == 1;
+	CHECK(once == hits.size(), "forEach after an error visits every element once");
+}
+
+struct MultiDeviceResult {
+	double sum;
+	float min, max;
+};
+
+MultiDeviceResult reduceOn(jc::MultiDeviceExecutor& executor, const vector<float>& x, const vector<float>& negated)
+{
+	vector<jc::Stream> in(1, jc::streamIn(x.data()));
+	vector<jc::Stream> negatedIn(1, jc::streamIn(negated.data()));
+	MultiDeviceResult r;
+	r.sum = executor.reduce<float>("sumReduce", x.size(), in, 0.0f, plus<float>());
+	r.min = executor.reduce<float>("minReduce", x.size(), in, INFINITY, [](float a, float b) { return min(a, b); });
+	r.max = executor.reduce<float>("maxReduce", x.size(), negatedIn, -INFINITY, [](float a, float b) { return max(a, b); });
+	return r;
+}
+
+// Splits the device into two sub-devices (as PoCL does for CPUs) and checks
+// that reductions over them match the whole device. The values are positive
+// for min and negative for max, so a zero partial of an empty slice or of
+// an idle work-group would show.
+void testMultiDevice(const cl::Device& device)
+{
+	vector<cl::Device> parts;
+	try {
+		parts = jc::subDevices(device, 2);
+	}
+	catch (exception&) {
+		parts.clear();
+	}
+	if (parts.size() < 2) {
+		cout << "The device has no sub-devices, multi-device test skipped" << endl;
+		return;
+	}
+
+	jc::MultiDeviceExecutor whole(vector<cl::Device>(1, device));
+	jc::MultiDeviceExecutor split(parts);
+	whole.build(jc::fileToString("array_kernels.ocl"));
+	split.build(jc::fileToString("array_kernels.ocl"));
+
+	// 100 elements leave the first slice empty and most work-groups idle
+	const size_t sizes[] = { 100, 5000, (1 << 20) + 3 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		size_t n = sizes[s];
+		vector<float> x(n), negated(n);
+		jc::generateUniform<float>(8 + s, 0, n, 1.0f, 3.0f, x.data());
+		double ref = 0;
+		float lo = x[0];
+		for (size_t i = 0; i < n; ++i) {
+			negated[i] = -x[i];
+			ref += x[i];
+			lo = min(lo, x[i]);
+		}
+		vector<size_t> slices = split.split(n);
+
+		MultiDeviceResult one = reduceOn(whole, x, negated);
+		MultiDeviceResult two = reduceOn(split, x, negated);
+		CHECK(closeTo(one.sum, ref, 1e-5) && closeTo(two.sum, one.sum, 1e-5),
+		      "multi-device sum of " << n << " elements: " << two.sum << ", one device " << one.sum);
+		CHECK(one.min == lo && two.min == lo,
+		      "multi-device min of " << n << " elements: " << two.min << ", one device " << one.min);
+		CHECK(one.max == -lo && two.max == -lo,
+		      "multi-device max of " << n << " elements: " << two.max << ", one device " << one.max);
+		if (n == 100) {
+			CHECK(slices[0] == 0, "100 elements leave the first sub-device idle");
+			// only the second one was measured, so the split still follows
+			// the guesses, which are equal for equal sub-devices
+			vector<size_t> next = split.split(1 << 20);
+			CHECK(next[0] >= (1 << 18) && next[1] >= (1 << 18),
+			      "after 100 elements the sub-devices get " << next[0] << " and " << next[1] << " of " << (1 << 20));
+		}
+	}
+}
+
+int main()
+{
+	try {
+		testThreadPoolExceptions();
+		testGemm(1, 1, 1);
+		testGemm(67, 45, 129);
+		testGemm(300, 517, 260);
+		testInstrumentation();
+		testFutures();
+		testFusionSources();
+
+		vector<cl::Device> devices;
+		try {
+			devices = jc::allDevices();
+		}
+		catch (cl::Error&) {
+		}
+		if (devices.empty()) {
+			cout << "No OpenCL device, device tests skipped" << endl;
+			return failures ? 1 : 0;
+		}
+		cl::Device device = devices[0];
+		cout << "Testing on '" << jc::deviceName(device) << "'" << endl;
+		cl::Context context(device);
+		cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+		// every kernel file must build
+		cl::Program arrays = jc::buildProgram("array_kernels.ocl", context, device);
+		cl::Program matrices = jc::buildProgram("matrix_kernels.ocl", context, device);
+		cl::Program randoms = jc::buildProgram("random_kernels.ocl", context, device);
+		cl::Program verifier = jc::buildProgram("verify_kernels.ocl", context, device);
+
+		testExpressions(context, queue);
+		testTranspose(context, queue, matrices);
+		testPhilox(context, queue, randoms);
+		testVerify(context, queue, verifier);
+		testReductions(queue, arrays);
+		testCoExecutionErrors(queue);
+		testMultiDevice(device);
+	}
+	catch (cl::Error& e) {
+		cerr << "FAILED: " << e.what() << ": " << jc::readableStatus(e.err()) << endl;
+		++failures;
+	}
+	catch (exception& e) {
+		cerr << "FAILED: " << e.what() << endl;
+		++failures;
+	}
+
+	cout << (failures ? "FAILED" : "PASSED") << endl;
+	return failures ? 1 : 0;
+}